@@ -11,6 +11,13 @@
 #define ERR_DEL_NODE -10
 #define ERR_INS_NODE -11
 #define ERR_NO_WRITE -12
+#define ERR_NO_BACKEND -24
+#define ERR_BLOCKSIZE -27
+#define ERR_ASYNC_FULL -28
+#define ERR_ASYNC_START -29
+#define ERR_DURABILITY -30
+#define ERR_CHECKSUM -31
+#define ERR_BAD_TOKEN -32
 
 
 #define ERR_INVALID_TINYFS -13 
@@ -24,5 +31,7 @@
 #define ERR_FILE_EXISTS -20
 #define ERR_FILE_UNOPEN -21
 #define ERR_PAST_EOF -23
+#define ERR_DIR_NOT_EMPTY -25
+#define ERR_OLD_FORMAT -26
 
 #define ERR_DISK_FULL -35
@@ -0,0 +1,447 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "TinyFS_errno.h"
+#include "libDisk.h"
+#include "libCache.h"
+
+#define CACHE_BUCKETS (CACHE_BLOCKS * 2)
+
+// write-back LRU cache of disk blocks keyed by (disk, bNum)
+// entries live in a fixed array, a hash chain finds them
+// and a doubly linked list keeps them in LRU order
+// each entry's buffer grows to the block size of the disk it holds
+// everything is guarded by cacheLock, bulk reads and writes that go
+// around the cache do their disk I/O without it
+typedef struct Entry{
+    int disk;
+    int bNum; // -1 when the slot is unused
+    bool dirty;
+    int token; // read-ahead still in flight into data, -1 if none
+    int size; // block size of the disk, bytes used in data
+    int capacity;
+    char* data;
+    struct Entry* prev; // towards most recently used
+    struct Entry* next; // towards least recently used
+    struct Entry* hashNext;
+}Entry;
+
+static Entry entries[CACHE_BLOCKS];
+static Entry* buckets[CACHE_BUCKETS];
+static Entry* lruHead = NULL;
+static Entry* lruTail = NULL;
+static bool initialized = false;
+static CacheStats stats;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// CACHE HELPER FUNCTIONS
+static int hashKey(int disk, int bNum){
+    unsigned int h = (unsigned int)disk * 2654435761u ^ (unsigned int)bNum;
+    return h % CACHE_BUCKETS;
+}
+
+static void lruRemove(Entry* e){
+    if (e->prev != NULL){
+        e->prev->next = e->next;
+    }else{
+        lruHead = e->next;
+    }
+    if (e->next != NULL){
+        e->next->prev = e->prev;
+    }else{
+        lruTail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void lruPushFront(Entry* e){
+    e->prev = NULL;
+    e->next = lruHead;
+    if (lruHead != NULL){
+        lruHead->prev = e;
+    }
+    lruHead = e;
+    if (lruTail == NULL){
+        lruTail = e;
+    }
+}
+
+static void initCache(void){
+    int i;
+    for (i=0;i<CACHE_BLOCKS;i++){
+        entries[i].disk = -1;
+        entries[i].bNum = -1;
+        entries[i].dirty = false;
+        entries[i].token = -1;
+        entries[i].size = 0;
+        entries[i].capacity = 0;
+        entries[i].data = NULL;
+        entries[i].hashNext = NULL;
+        entries[i].prev = NULL;
+        entries[i].next = NULL;
+        lruPushFront(&entries[i]);
+    }
+    memset(buckets,0,sizeof(buckets));
+    initialized = true;
+}
+
+static Entry* lookup(int disk, int bNum){
+    Entry* e = buckets[hashKey(disk,bNum)];
+    while (e != NULL){
+        if (e->disk == disk && e->bNum == bNum){
+            return e;
+        }
+        e = e->hashNext;
+    }
+    return NULL;
+}
+
+static void hashRemove(Entry* e){
+    Entry** link = &buckets[hashKey(e->disk,e->bNum)];
+    while (*link != NULL){
+        if (*link == e){
+            *link = e->hashNext;
+            break;
+        }
+        link = &(*link)->hashNext;
+    }
+    e->hashNext = NULL;
+}
+
+// empties a slot without writing it back
+static void dropEntry(Entry* e){
+    hashRemove(e);
+    e->disk = -1;
+    e->bNum = -1;
+    e->dirty = false;
+    // unused slots are reused first
+    lruRemove(e);
+    if (lruTail != NULL){
+        lruTail->next = e;
+        e->prev = lruTail;
+        e->next = NULL;
+        lruTail = e;
+    }else{
+        lruPushFront(e);
+    }
+}
+
+
+// waits for the read-ahead filling e, if there is one
+// every block that came in with the same request is settled with it,
+// and dropped if the read failed
+static int settle(Entry* e){
+    int i;
+    if (e->token == -1){
+        return 0;
+    }
+    int token = e->token;
+    int err_code = waitRequest(token);
+    for (i=0;i<CACHE_BLOCKS;i++){
+        if (entries[i].token == token){
+            entries[i].token = -1;
+            if (err_code < 0){
+                dropEntry(&entries[i]);
+            }
+        }
+    }
+    return err_code;
+}
+
+// lookup that waits for read-ahead, NULL if the block isn't cached
+static Entry* find(int disk, int bNum){
+    Entry* e = lookup(disk,bNum);
+    if (e != NULL && settle(e) < 0){
+        return NULL;
+    }
+    return e;
+}
+
+static int writeBack(Entry* e){
+    int err_code = writeBlock(e->disk,e->bNum,e->data);
+    if (err_code < 0){
+        return err_code;
+    }
+    e->dirty = false;
+    stats.writebacks++;
+    return 0;
+}
+
+// takes the least recently used slot, writing it back if dirty
+static int takeVictim(Entry** victim){
+    Entry* e = lruTail;
+    int err_code;
+    settle(e);
+    if (e->bNum != -1){
+        if (e->dirty){
+            err_code = writeBack(e);
+            if (err_code < 0){
+                return err_code;
+            }
+        }
+        hashRemove(e);
+        stats.evictions++;
+    }
+    e->disk = -1;
+    e->bNum = -1;
+    *victim = e;
+    return 0;
+}
+
+static int install(Entry* e, int disk, int bNum){
+    int h = hashKey(disk,bNum);
+    int size = diskBlockSize(disk);
+    if (size < 0){
+        return size;
+    }
+    if (size > e->capacity){
+        char* data = (char*)realloc(e->data,size);
+        if (data == NULL){
+            perror("malloc: ");
+            exit(1);
+        }
+        e->data = data;
+        e->capacity = size;
+    }
+    e->size = size;
+    e->disk = disk;
+    e->bNum = bNum;
+    e->hashNext = buckets[h];
+    buckets[h] = e;
+    return 0;
+}
+
+// CACHE FUNCTIONS
+int cacheReadBlock(int disk, int bNum, void *block){
+    Entry* e;
+    int err_code = 0;
+    pthread_mutex_lock(&cacheLock);
+    if (!initialized){
+        initCache();
+    }
+    e = find(disk,bNum);
+    if (e != NULL){
+        stats.hits++;
+    }else{
+        stats.misses++;
+        err_code = takeVictim(&e);
+        if (err_code == 0){
+            err_code = install(e,disk,bNum);
+            if (err_code == 0){
+                err_code = readBlock(disk,bNum,e->data);
+            }
+            if (err_code < 0){
+                hashRemove(e);
+                e->disk = -1;
+                e->bNum = -1;
+            }
+        }
+    }
+    if (err_code == 0){
+        lruRemove(e);
+        lruPushFront(e);
+        memcpy(block,e->data,e->size);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return err_code;
+}
+
+int cacheWriteBlock(int disk, int bNum, void *block){
+    Entry* e;
+    int err_code = 0;
+    pthread_mutex_lock(&cacheLock);
+    if (!initialized){
+        initCache();
+    }
+    e = find(disk,bNum);
+    if (e != NULL){
+        stats.hits++;
+    }else{
+        // a whole block is overwritten so there is nothing to read
+        stats.misses++;
+        err_code = takeVictim(&e);
+        if (err_code == 0){
+            err_code = install(e,disk,bNum);
+        }
+    }
+    if (err_code == 0){
+        lruRemove(e);
+        lruPushFront(e);
+        memcpy(e->data,block,e->size);
+        e->dirty = true;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return err_code;
+}
+
+// reads count consecutive blocks, cached ones are copied from the
+// cache and each stretch of the others comes straight from the disk
+// with one read, so bulk file data doesn't push out metadata
+// the disk reads happen without the lock, the caller keeps anyone
+// from writing those blocks meanwhile
+int cacheReadBlocks(int disk, int bNum, int count, void *buf){
+    int size = diskBlockSize(disk);
+    int i = 0;
+    int run;
+    int err_code = 0;
+    pthread_mutex_lock(&cacheLock);
+    if (!initialized){
+        initCache();
+    }
+    while (i < count && err_code == 0){
+        Entry* e = find(disk,bNum + i);
+        if (e != NULL){
+            stats.hits++;
+            memcpy((char*)buf + (size_t)i*size,e->data,size);
+            i++;
+            continue;
+        }
+        for (run=1;i + run < count && lookup(disk,bNum + i + run) == NULL;run++);
+        stats.misses += run;
+        pthread_mutex_unlock(&cacheLock);
+        err_code = readBlocks(disk,bNum + i,run,(char*)buf + (size_t)i*size);
+        pthread_mutex_lock(&cacheLock);
+        i += run;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return err_code;
+}
+
+// starts reading count consecutive blocks into the cache in the
+// background, blocks already cached are skipped
+// each stretch of missing blocks is one request, later lookups wait
+// for it, and if the engine is busy the blocks are just not fetched
+int cachePrefetch(int disk, int bNum, int count){
+    struct iovec iov[CACHE_BLOCKS];
+    Entry* fetched[CACHE_BLOCKS];
+    int i = 0;
+    int n, j, token;
+    int err_code;
+    if (count > CACHE_BLOCKS / 2){
+        count = CACHE_BLOCKS / 2;
+    }
+    pthread_mutex_lock(&cacheLock);
+    if (!initialized){
+        initCache();
+    }
+    while (i < count){
+        if (lookup(disk,bNum + i) != NULL){
+            i++;
+            continue;
+        }
+        for (n=0;i + n < count && lookup(disk,bNum + i + n) == NULL;n++){
+            err_code = takeVictim(&fetched[n]);
+            if (err_code == 0){
+                err_code = install(fetched[n],disk,bNum + i + n);
+            }
+            if (err_code < 0){
+                break;
+            }
+            // keep the fetched blocks away from the victim end
+            lruRemove(fetched[n]);
+            lruPushFront(fetched[n]);
+            iov[n].iov_base = fetched[n]->data;
+            iov[n].iov_len = fetched[n]->size;
+        }
+        token = (n > 0) ? submitReadvDetached(disk,bNum + i,iov,n) : -1;
+        for (j=0;j<n;j++){
+            if (token < 0){
+                dropEntry(fetched[j]);
+            }else{
+                fetched[j]->token = token;
+            }
+        }
+        if (token < 0){
+            break;
+        }
+        stats.prefetches += n;
+        i += n;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+// writes the buffers of iov to consecutive blocks from bNum with one
+// disk write, cached copies of those blocks are dropped first so a
+// write back of an old copy can't land on top of it
+int cacheWriteBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt){
+    int i;
+    size_t total = 0;
+    int size = diskBlockSize(disk);
+    if (size < 0){
+        return size;
+    }
+    for (i=0;i<iovcnt;i++){
+        total += iov[i].iov_len;
+    }
+    int count = total / size;
+    pthread_mutex_lock(&cacheLock);
+    for (i=0;i<CACHE_BLOCKS && initialized;i++){
+        if (entries[i].bNum >= bNum && entries[i].bNum < bNum + count && entries[i].disk == disk){
+            // a read-ahead must land before its buffer can be reused
+            settle(&entries[i]);
+            if (entries[i].bNum != -1){
+                dropEntry(&entries[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return writeBlocksv(disk,bNum,iov,iovcnt);
+}
+
+int cacheWriteBlocks(int disk, int bNum, int count, void *buf){
+    struct iovec iov;
+    int size = diskBlockSize(disk);
+    if (size < 0){
+        return size;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)count*size;
+    return cacheWriteBlocksv(disk,bNum,&iov,1);
+}
+
+// writes every dirty block of the disk back
+int cacheFlush(int disk){
+    int i;
+    int err_code = 0;
+    pthread_mutex_lock(&cacheLock);
+    for (i=0;i<CACHE_BLOCKS && initialized && err_code == 0;i++){
+        if (entries[i].bNum != -1 && entries[i].disk == disk && entries[i].dirty){
+            err_code = writeBack(&entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return err_code;
+}
+
+// drops every block of the disk without writing it back
+int cacheInvalidate(int disk){
+    int i;
+    pthread_mutex_lock(&cacheLock);
+    for (i=0;i<CACHE_BLOCKS && initialized;i++){
+        if (entries[i].bNum != -1 && entries[i].disk == disk){
+            settle(&entries[i]);
+            if (entries[i].bNum != -1){
+                dropEntry(&entries[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+void getCacheStats(CacheStats* out){
+    pthread_mutex_lock(&cacheLock);
+    *out = stats;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void resetCacheStats(void){
+    pthread_mutex_lock(&cacheLock);
+    memset(&stats,0,sizeof(stats));
+    pthread_mutex_unlock(&cacheLock);
+}
@@ -0,0 +1,22 @@
+#include <sys/uio.h>
+
+#define CACHE_BLOCKS 64
+
+typedef struct CacheStats{
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long prefetches; // blocks read ahead
+}CacheStats;
+
+extern int cacheReadBlock(int disk, int bNum, void *block);
+extern int cacheWriteBlock(int disk, int bNum, void *block);
+extern int cacheReadBlocks(int disk, int bNum, int count, void *buf);
+extern int cachePrefetch(int disk, int bNum, int count);
+extern int cacheWriteBlocks(int disk, int bNum, int count, void *buf);
+extern int cacheWriteBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt);
+extern int cacheFlush(int disk);
+extern int cacheInvalidate(int disk);
+extern void getCacheStats(CacheStats* stats);
+extern void resetCacheStats(void);
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <string.h>
+#include "libDisk.h"
+#include "libDir.h"
+
+// entries are compared in place in the block, nothing is copied
+// size is the block size of the disk the block came from
+// a name only matches an entry of exactly the same length
+
+static bool entryNameEquals(char* entry, char* name, int len){
+    if (memcmp(entry,name,len) != 0){
+        return false;
+    }
+    return len == DIR_NAME_LEN || entry[len] == '\0';
+}
+
+// FNV-1a of the name, picks the leaf of a directory that holds it
+unsigned int dirHash(char* name){
+    unsigned int h = 2166136261u;
+    while (*name != '\0'){
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    // leaves are picked by the low bits, fold the high ones down
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// returns the offset of the entry holding name, -1 if there is none
+int dirFindEntry(char* block, int size, char* name){
+    int len = strnlen(name,DIR_NAME_LEN+1);
+    int i;
+    if (len == 0 || len > DIR_NAME_LEN){
+        return -1;
+    }
+    for (i=DIR_HEADER;i+DIR_ENTRY_SIZE<=size;i+=DIR_ENTRY_SIZE){
+        if (block[i] == name[0] && entryNameEquals(block+i,name,len)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns the offset of the first unused entry, -1 if the block is full
+int dirFindFree(char* block, int size){
+    int i;
+    for (i=DIR_HEADER;i+DIR_ENTRY_SIZE<=size;i+=DIR_ENTRY_SIZE){
+        if (block[i] == '\0'){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// returns the offset of the next used entry after offset
+// (pass 0 to start), -1 when there are no more
+int dirNextEntry(char* block, int size, int offset){
+    int i = (offset < DIR_HEADER) ? DIR_HEADER : offset + DIR_ENTRY_SIZE;
+    for (;i+DIR_ENTRY_SIZE<=size;i+=DIR_ENTRY_SIZE){
+        if (block[i] != '\0'){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int dirEntryInode(char* block, int offset){
+    return getU32(block+offset+DIR_NAME_LEN);
+}
+
+// copies the name of the entry into name, which holds DIR_NAME_LEN+1 bytes
+void dirEntryName(char* block, int offset, char* name){
+    memcpy(name,block+offset,DIR_NAME_LEN);
+    name[DIR_NAME_LEN] = '\0';
+}
+
+void dirSetEntry(char* block, int offset, char* name, int inode){
+    strncpy(block+offset,name,DIR_NAME_LEN);
+    putU32(block+offset+DIR_NAME_LEN,inode);
+}
+
+void dirClearEntry(char* block, int offset){
+    memset(block+offset,0,DIR_ENTRY_SIZE);
+}
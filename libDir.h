@@ -0,0 +1,17 @@
+// a directory leaf block is a 4 byte header followed by
+// fixed width entries: a 28 byte name padded with '\0'
+// and the inode block as a 32 bit little-endian number
+// byte 2 of the header is the local depth of the leaf
+#define DIR_HEADER 4
+#define DIR_DEPTH 2
+#define DIR_ENTRY_SIZE 32
+#define DIR_NAME_LEN 28
+
+extern unsigned int dirHash(char* name);
+extern int dirFindEntry(char* block, int size, char* name);
+extern int dirFindFree(char* block, int size);
+extern int dirNextEntry(char* block, int size, int offset);
+extern int dirEntryInode(char* block, int offset);
+extern void dirEntryName(char* block, int offset, char* name);
+extern void dirSetEntry(char* block, int offset, char* name, int inode);
+extern void dirClearEntry(char* block, int offset);
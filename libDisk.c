@@ -1,13 +1,34 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <endian.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include "TinyFS_errno.h"
 #include "libDisk.h"
 
-#define BLOCKSIZE 256
+// block size of a newly opened disk
+#define BLOCKSIZE DISK_MIN_BLOCKSIZE
+
+// buffers per preadv/pwritev call (IOV_MAX is not visible without
+// _XOPEN_SOURCE, 1024 is what Linux allows)
+#define DISK_IOV_MAX 1024
+
+// bytes after every block on disk holding its checksum
+#define SUM_SIZE 4
 
 #define READ_MODE 0
 #define WRITE_MODE 1
@@ -16,9 +37,15 @@
 typedef struct Node{
     int diskNum;
     char* filename;
-    FILE* fd;
+    int fd;
     int nBytes;
     int mode;
+    int backend;
+    int blockSize;
+    uint32_t zeroSum; // what a block of zeros of blockSize is sealed with
+    char* map; // whole image when backend is DISK_BACKEND_MMAP, from first use
+    size_t mapLen;
+    pthread_mutex_t mapLock; // taken to map it
     struct Node* next;
 }Node;
 
@@ -26,13 +53,72 @@ typedef struct Node{
 
 // global unique disk number
 int diskNumber = 0;
+// backend used by openDisk
+int defaultBackend = DISK_BACKEND_FILE;
 // we need a way to store the fd, and nbytes
 // use a global linked list implementation
 Node* diskList = NULL;
+// guards diskList and diskNumber, a node stays put until closeDisk
+static pthread_rwlock_t listLock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+// one submitted request, token is -1 while the slot is free
+// a detached request keeps its slot after finishing until waitRequest
+typedef struct Request{
+    int token;
+    bool write;
+    bool detached;
+    bool done;
+    int result;
+    int fd;
+    off_t pos;
+    struct iovec* iov; // the blocks as they are on disk, see layBlocks
+    int iovcnt;
+    uint32_t* sums; // their checksums
+    size_t len;
+    Node* node; // reads are checked against it
+    struct Request* next; // worker queue
+}Request;
+
+// ASYNC ENGINE STATE
+// the engine starts on the first submit and serves every disk
+// slots, the ready list and the worker queue are shared with the
+// workers and only touched with asyncLock held
+static int asyncWanted = DISK_ASYNC_AUTO;
+static int asyncEngine = DISK_ASYNC_AUTO; // AUTO until started
+static Request requests[DISK_ASYNC_DEPTH];
+static int inFlight = 0;
+static int detachedOut = 0; // detached requests in flight
+static int nextToken = 0;
+static DiskCompletion ready[DISK_ASYNC_DEPTH];
+static int readyHead = 0;
+static int readyCount = 0;
+static int checking = 0; // finished requests being checked without asyncLock
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER; // a request finished
+
+// io_uring rings
+static int ringFd = -1;
+static char* sqRing;
+static char* cqRing;
+static size_t sqRingLen;
+static size_t cqRingLen;
+static struct io_uring_sqe* sqes;
+static size_t sqesLen;
+static struct io_uring_params ringParams;
+
+// pread/pwrite workers
+#define DISK_ASYNC_WORKERS 4
+static pthread_t workers[DISK_ASYNC_WORKERS];
+static int workerCount = 0; // workers that started
+static Request* queueHead = NULL;
+static Request* queueTail = NULL;
+static bool stopping = false;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
 
 
 // DISKLIST HELPER FUNCTIONS
-static Node* createNode(int diskNum, char* filename, int nBytes,int mode) {
+static Node* createNode(int diskNum, char* filename, int fd, int nBytes,int mode) {
     Node* newNode = (Node*)malloc(sizeof(Node));
     if (newNode == NULL) {
         perror("malloc: "); 
@@ -41,97 +127,581 @@ static Node* createNode(int diskNum, char* filename, int nBytes,int mode) {
     newNode->diskNum = diskNum;
     newNode->nBytes = nBytes;
     newNode->filename = filename;
+    newNode->fd = fd;
     newNode->mode = mode;
+    newNode->backend = DISK_BACKEND_FILE;
+    newNode->blockSize = BLOCKSIZE;
+    newNode->map = NULL;
+    newNode->mapLen = 0;
+    pthread_mutex_init(&newNode->mapLock,NULL);
     newNode->next = NULL;
     return newNode;
 }
 
-static int insert(int diskNum, char* filename, int nBytes,int mode) {
-    Node* newNode = createNode(diskNum, filename, nBytes,mode);
+// every open takes a new disk number, read only opens too, so two
+// disks open at once never share one, returns the new node
+static Node* insert(char* filename, int fd, int nBytes,int mode) {
+    pthread_rwlock_wrlock(&listLock);
+    int diskNum = diskNumber++;
+    Node* newNode = createNode(diskNum, filename, fd, nBytes,mode);
     Node* head = diskList;
     newNode->next = head;
     diskList = newNode; 
-    return 0;
+    pthread_rwlock_unlock(&listLock);
+    return newNode;
 }
 
 
 static int deleteNode(int disk){
+    pthread_rwlock_wrlock(&listLock);
     Node* temp = diskList;
     Node* prev = NULL;
 
-    if (temp != NULL && temp->diskNum == disk){
-        diskList = temp->next;
-        free(temp);
-        return 0;
-    } 
-
     while (temp != NULL && temp->diskNum != disk) {
         prev = temp;
         temp = temp->next;
     }
 
-    if (temp == NULL) return -1;   
+    if (temp == NULL){
+        pthread_rwlock_unlock(&listLock);
+        return -1;   
+    }
 
-    prev->next = temp->next;
+    if (prev == NULL){
+        diskList = temp->next;
+    }else{
+        prev->next = temp->next;
+    }
+    pthread_rwlock_unlock(&listLock);
+    pthread_mutex_destroy(&temp->mapLock);
     free(temp);
     return 0;
 }
 
 static Node* findNode(int disk) {
+    pthread_rwlock_rdlock(&listLock);
     Node* current = diskList;
-    while (current != NULL) {
-        if (current->diskNum == disk) {
-            return current; // Key found
-        }
+    while (current != NULL && current->diskNum != disk) {
         current = current->next;
-        }
-    return NULL; // Key not found
+    }
+    pthread_rwlock_unlock(&listLock);
+    return current; // NULL if not found
 }
 
 // LIBDISK HELPER FUNCTIONS
 
+// bytes a block takes on disk
+static size_t slotSize(Node* node){
+    return (size_t)node->blockSize + SUM_SIZE;
+}
+
+// maps the image into memory with the block size it has now
+// read only disks map the current file size, writable
+// disks are grown first so every block is backed
+static int mapDisk(Node* node){
+    struct stat st;
+    size_t len;
+    int prot = PROT_READ;
+
+    if (fstat(node->fd,&st) != 0){
+        return ERR_FOPEN;
+    }
+    if (node->mode == READ_MODE){
+        len = st.st_size;
+    }else{
+        len = (size_t)(node->nBytes / node->blockSize) * slotSize(node);
+        if ((size_t)st.st_size < len && ftruncate(node->fd,len) != 0){
+            return ERR_FWRITE;
+        }
+        prot |= PROT_WRITE;
+    }
+    if (len == 0){
+        // nothing to map, every block access fails the size check
+        return 0;
+    }
+    char* map = mmap(NULL,len,prot,MAP_SHARED,node->fd,0);
+    if (map == MAP_FAILED){
+        return ERR_FOPEN;
+    }
+    node->mapLen = len;
+    __atomic_store_n(&node->map,map,__ATOMIC_RELEASE);
+    return 0;
+}
+
+// the image is mapped on first use, once the block size that decides
+// where each block lies is set
+static int diskMap(Node* node){
+    int err_code = 0;
+    if (__atomic_load_n(&node->map,__ATOMIC_ACQUIRE) != NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&node->mapLock);
+    if (node->map == NULL){
+        err_code = mapDisk(node);
+    }
+    pthread_mutex_unlock(&node->mapLock);
+    return err_code;
+}
+
+static int unmapDisk(Node* node){
+    int err_code = 0;
+    if (node->map == NULL){
+        return 0;
+    }
+    if (node->mode != READ_MODE && msync(node->map,node->mapLen,MS_SYNC) != 0){
+        err_code = ERR_FWRITE;
+    }
+    munmap(node->map,node->mapLen);
+    node->map = NULL;
+    node->mapLen = 0;
+    return err_code;
+}
+
+// CHECKSUMS
+// every block is stored followed by its CRC32C (4 bytes, little-endian)
+// and both go out in the same pwrite, so no second write or table has
+// to be kept in step with the data. a write torn between the block and
+// its trailer, like any other damage, fails every read of the block
+// with ERR_CHECKSUM until the block is written again; nothing repairs
+// it behind the caller's back. the stored value is the CRC xor that of
+// a block of zeros, so a block never written since the image was made
+// (zeros and a zero trailer) is valid as it is and every read is
+// checked. the price is that blocks sit blockSize + 4 bytes apart, off
+// page and sector boundaries, which costs unaligned copies but no extra
+// I/O since nothing here uses O_DIRECT
+// the SSE4.2 crc32 instruction does 8 bytes at a time where the CPU
+// has it, slicing-by-8 tables do it everywhere else
+
+static uint32_t crcTables[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+static int crcHardware = 0; // the CPU has SSE4.2
+static int crcKernel = DISK_CRC_SLICING;
+
+static uint32_t crcSlicing(uint32_t crc, const unsigned char* p, size_t len){
+    while (len > 0 && ((uintptr_t)p & 7) != 0){
+        crc = crcTables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8){
+        uint64_t w;
+        memcpy(&w,p,8);
+        w = le64toh(w) ^ crc;
+        crc = crcTables[7][w & 0xff] ^ crcTables[6][(w >> 8) & 0xff]
+            ^ crcTables[5][(w >> 16) & 0xff] ^ crcTables[4][(w >> 24) & 0xff]
+            ^ crcTables[3][(w >> 32) & 0xff] ^ crcTables[2][(w >> 40) & 0xff]
+            ^ crcTables[1][(w >> 48) & 0xff] ^ crcTables[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0){
+        crc = crcTables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// bytes each of the three streams takes in a long and a short round
+#define CRC_LONG 1024
+#define CRC_SHORT 64
+
+// crcShift[round] moves a CRC past the zero bytes of a stream
+static uint32_t crcShift[2][4][256];
+
+static uint32_t shiftCrc(uint32_t table[4][256], uint32_t crc){
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff]
+        ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+// the instruction takes 3 cycles before its result can be used again,
+// so three streams go through it side by side and their CRCs are
+// joined with crcShift at the end of each round
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const unsigned char* p, size_t len){
+    uint64_t c = crc;
+    int round;
+    while (len > 0 && ((uintptr_t)p & 7) != 0){
+        c = _mm_crc32_u8((uint32_t)c,*p++);
+        len--;
+    }
+    for (round=0;round<2;round++){
+        size_t n = (round == 0) ? CRC_LONG : CRC_SHORT;
+        while (len >= 3*n){
+            uint64_t c1 = 0;
+            uint64_t c2 = 0;
+            const unsigned char* end = p + n;
+            while (p < end){
+                uint64_t w0, w1, w2;
+                memcpy(&w0,p,8);
+                memcpy(&w1,p + n,8);
+                memcpy(&w2,p + 2*n,8);
+                c = _mm_crc32_u64(c,w0);
+                c1 = _mm_crc32_u64(c1,w1);
+                c2 = _mm_crc32_u64(c2,w2);
+                p += 8;
+            }
+            c = shiftCrc(crcShift[round],shiftCrc(crcShift[round],(uint32_t)c) ^ (uint32_t)c1) ^ (uint32_t)c2;
+            p += 2*n;
+            len -= 3*n;
+        }
+    }
+    while (len >= 8){
+        uint64_t w;
+        memcpy(&w,p,8);
+        c = _mm_crc32_u64(c,w);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0){
+        c = _mm_crc32_u8((uint32_t)c,*p++);
+        len--;
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// tables[k][i] is the CRC of byte i followed by k zero bytes
+static void crcInit(void){
+    int i, k;
+    for (i=0;i<256;i++){
+        uint32_t c = i;
+        for (k=0;k<8;k++){
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        crcTables[0][i] = c;
+    }
+    for (i=0;i<256;i++){
+        for (k=1;k<8;k++){
+            crcTables[k][i] = (crcTables[k-1][i] >> 8) ^ crcTables[0][crcTables[k-1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    static const unsigned char zeros[CRC_LONG];
+    uint32_t bits[32];
+    int round, b;
+    for (round=0;round<2;round++){
+        size_t n = (round == 0) ? CRC_LONG : CRC_SHORT;
+        for (b=0;b<32;b++){
+            bits[b] = crcSlicing(1u << b,zeros,n);
+        }
+        for (k=0;k<4;k++){
+            for (i=0;i<256;i++){
+                uint32_t c = 0;
+                for (b=0;b<8;b++){
+                    if (i & (1 << b)){
+                        c ^= bits[8*k + b];
+                    }
+                }
+                crcShift[round][k][i] = c;
+            }
+        }
+    }
+    __builtin_cpu_init();
+    crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+    crcKernel = crcHardware ? DISK_CRC_HARDWARE : DISK_CRC_SLICING;
+}
+
+static uint32_t crcUpdate(uint32_t crc, const void* buf, size_t len){
+#if defined(__x86_64__)
+    if (__atomic_load_n(&crcKernel,__ATOMIC_RELAXED) == DISK_CRC_HARDWARE){
+        return crcSse42(crc,buf,len);
+    }
+#endif
+    return crcSlicing(crc,buf,len);
+}
+
+// the checksum of a block as it is stored
+static uint32_t sealCrc(Node* node, uint32_t crc){
+    return htole32(~crc ^ node->zeroSum);
+}
+
+// the CRC of a block of zeros, blocks are multiples of the smallest size
+static uint32_t zeroCrc(int blockSize){
+    static const unsigned char zeros[DISK_MIN_BLOCKSIZE];
+    uint32_t crc = 0xffffffff;
+    int i;
+    pthread_once(&crcOnce,crcInit);
+    for (i=0;i<blockSize;i+=DISK_MIN_BLOCKSIZE){
+        crc = crcUpdate(crc,zeros,DISK_MIN_BLOCKSIZE);
+    }
+    return ~crc;
+}
+
+// lays count blocks held by the buffers of iov out the way they are on
+// disk, each one followed by its entry in sums, into a malloc'd array
+// returns the number of buffers in it
+static int layBlocks(Node* node, const struct iovec *iov, int iovcnt, int count, uint32_t* sums, struct iovec** out){
+    struct iovec* slots = (struct iovec*)malloc(sizeof(struct iovec) * (iovcnt + 2*count));
+    size_t used = 0; // bytes of iov[i] already laid out
+    int n = 0;
+    int i = 0;
+    int b;
+    if (slots == NULL){
+        perror("malloc: ");
+        exit(1);
+    }
+    for (b=0;b<count;b++){
+        size_t left = node->blockSize;
+        while (left > 0){
+            size_t len = iov[i].iov_len - used;
+            if (len > left){
+                len = left;
+            }
+            if (len > 0){
+                slots[n].iov_base = (char*)iov[i].iov_base + used;
+                slots[n].iov_len = len;
+                n++;
+            }
+            used += len;
+            left -= len;
+            if (used == iov[i].iov_len){
+                i++;
+                used = 0;
+            }
+        }
+        slots[n].iov_base = &sums[b];
+        slots[n].iov_len = SUM_SIZE;
+        n++;
+    }
+    *out = slots;
+    return n;
+}
+
+// goes over blocks laid out by layBlocks, sealing each with its
+// checksum or checking it against the one it came with
+static int sumBlocks(Node* node, const struct iovec *slots, int n, bool seal){
+    uint32_t crc = 0xffffffff;
+    size_t filled = 0;
+    int i;
+    pthread_once(&crcOnce,crcInit);
+    for (i=0;i<n;i++){
+        if (filled < (size_t)node->blockSize){
+            crc = crcUpdate(crc,slots[i].iov_base,slots[i].iov_len);
+            filled += slots[i].iov_len;
+            continue;
+        }
+        uint32_t* sum = (uint32_t*)slots[i].iov_base;
+        if (seal){
+            *sum = sealCrc(node,crc);
+        }else if (*sum != sealCrc(node,crc)){
+            return ERR_CHECKSUM;
+        }
+        crc = 0xffffffff;
+        filled = 0;
+    }
+    return 0;
+}
+
+// moves laid out blocks between the buffers and the image from byte
+// pos on, with one preadv/pwritev per DISK_IOV_MAX buffers
+static int moveSlots(Node* node, const struct iovec *slots, int n, off_t pos, bool write){
+    int err_code = write ? ERR_FWRITE : ERR_FREAD;
+    int i;
+    if (node->backend == DISK_BACKEND_MMAP){
+        size_t total = 0;
+        for (i=0;i<n;i++){
+            total += slots[i].iov_len;
+        }
+        int map_code = diskMap(node);
+        if (map_code < 0){
+            return map_code;
+        }
+        if ((size_t)pos + total > node->mapLen){
+            return write ? ERR_DISK_SIZE_EXCEEDED : ERR_FREAD;
+        }
+        char* at = node->map + pos;
+        for (i=0;i<n;i++){
+            if (write){
+                memcpy(at,slots[i].iov_base,slots[i].iov_len);
+            }else{
+                memcpy(slots[i].iov_base,at,slots[i].iov_len);
+            }
+            at += slots[i].iov_len;
+        }
+        return 0;
+    }
+    while (n > 0){
+        int k = (n > DISK_IOV_MAX) ? DISK_IOV_MAX : n;
+        ssize_t want = 0;
+        ssize_t got;
+        for (i=0;i<k;i++){
+            want += slots[i].iov_len;
+        }
+        if (write){
+            got = pwritev(node->fd,slots,k,pos);
+        }else{
+            got = preadv(node->fd,slots,k,pos);
+        }
+        if (got != want){
+            return err_code;
+        }
+        pos += want;
+        slots += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int setDiskBackend(int backend){
+    if (backend != DISK_BACKEND_FILE && backend != DISK_BACKEND_MMAP){
+        return ERR_NO_BACKEND;
+    }
+    defaultBackend = backend;
+    return 0;
+}
+
+// CRC32C of len bytes of buf carried on from crc, 0 to start one
+unsigned int crc32c(unsigned int crc, const void* buf, size_t len){
+    pthread_once(&crcOnce,crcInit);
+    return ~crcUpdate(~crc,buf,len);
+}
+
+// picks the kernel checksums are computed with, DISK_CRC_AUTO takes
+// the fastest one the CPU has
+int setDiskCrc(int kernel){
+    pthread_once(&crcOnce,crcInit);
+    if (kernel == DISK_CRC_AUTO){
+        kernel = crcHardware ? DISK_CRC_HARDWARE : DISK_CRC_SLICING;
+    }
+    if (kernel != DISK_CRC_HARDWARE && kernel != DISK_CRC_SLICING){
+        return ERR_NO_BACKEND;
+    }
+    if (kernel == DISK_CRC_HARDWARE && !crcHardware){
+        return ERR_NO_BACKEND;
+    }
+    __atomic_store_n(&crcKernel,kernel,__ATOMIC_RELAXED);
+    return 0;
+}
+
+int diskCrcKernel(void){
+    pthread_once(&crcOnce,crcInit);
+    return __atomic_load_n(&crcKernel,__ATOMIC_RELAXED);
+}
+
 // for now we can assume that we can open
 // the same filename multiple times
+// the descriptor stays open until closeDisk so
+// block I/O is a single pread/pwrite
 int openDisk(char *filename, int nBytes){
-    FILE* file; 
+    return openDiskBackend(filename, nBytes, defaultBackend);
+}
+
+int openDiskBackend(char *filename, int nBytes, int backend){
+    int fd; 
+    int mode;
+    if (backend != DISK_BACKEND_FILE && backend != DISK_BACKEND_MMAP){
+        return ERR_NO_BACKEND;
+    }
     if (nBytes == 0){    
-        // open file for appending
         // tries to open file if it exists
-        file = fopen(filename,"r");
-        if (!file){
+        fd = open(filename,O_RDONLY);
+        if (fd < 0){
             return ERR_NO_FILE;
         }
         // Now we know that the file exists
-        if (insert(diskNumber, filename, nBytes,READ_MODE) == -1){
-            return ERR_INS_NODE;
-        }
-        fclose(file);
-        return diskNumber; 
+        mode = READ_MODE;
     }else if (nBytes < BLOCKSIZE){
         // less than blocksize bytes
         return ERR_NBYTES;
     }else{
         // open/create file for writing
-        // need to fopen twice because w+ would truncate 
-        // an already existing file
+        // O_CREAT without O_TRUNC keeps an already existing file
         nBytes = (nBytes - (nBytes%BLOCKSIZE));
-        // tries to open file for writing if it exists 
-        file = fopen(filename,"r+");
-        int mode = OVERWRITE_MODE;
-        if (!file){
+        mode = OVERWRITE_MODE;
+        fd = open(filename,O_RDWR);
+        if (fd < 0){
             // tries to create a file
-            file = fopen(filename,"w+"); 
-            if (!file){ 
+            fd = open(filename,O_RDWR | O_CREAT, 0644); 
+            if (fd < 0){ 
                 return ERR_FOPEN;
             }
             mode = WRITE_MODE;
         }
-        fclose(file);
-        if (insert(diskNumber, filename, nBytes,mode) == -1){
-            return ERR_INS_NODE;
+    }
+    Node* node = insert(filename, fd, nBytes,mode);
+    if (node == NULL){
+        close(fd);
+        return ERR_INS_NODE;
+    }
+    // the mapping waits for the first block, see diskMap
+    node->backend = backend;
+    node->zeroSum = zeroCrc(node->blockSize);
+    return node->diskNum; 
+}
+
+// changes the size of the blocks read and written on an open disk
+// the size is a power of two between DISK_MIN_BLOCKSIZE and
+// DISK_MAX_BLOCKSIZE, and writable disks must hold a whole number of them
+int setDiskBlockSize(int disk, int blockSize){
+    Node* node = findNode(disk);
+    if (node == NULL){
+        return ERR_DISK_CLOSED;    
+    }
+    if (blockSize < DISK_MIN_BLOCKSIZE || blockSize > DISK_MAX_BLOCKSIZE
+        || (blockSize & (blockSize - 1)) != 0){
+        return ERR_BLOCKSIZE;
+    }
+    if (node->nBytes % blockSize != 0){
+        return ERR_NBYTES;
+    }
+    if (node->blockSize != blockSize){
+        // every block moves, map the image again on next use
+        int err_code = unmapDisk(node);
+        if (err_code < 0){
+            return err_code;
         }
-        return diskNumber++; 
     }
+    node->blockSize = blockSize;
+    node->zeroSum = zeroCrc(blockSize);
+    return 0;
+}
+
+// throws away the contents of a writable disk, for an image about to
+// be formatted whose old blocks would not match their checksums
+// laid out with the new block size
+int eraseDisk(int disk){
+    Node* node = findNode(disk);
+    if (node == NULL){
+        return ERR_DISK_CLOSED;    
+    }
+    if (node->mode == READ_MODE){
+        return ERR_NO_WRITE;
+    }
+    int err_code = unmapDisk(node);
+    if (ftruncate(node->fd,0) != 0){
+        return ERR_FWRITE;
+    }
+    return err_code;
+}
+
+int diskBlockSize(int disk){
+    Node* node = findNode(disk);
+    if (node == NULL){
+        return ERR_DISK_CLOSED;    
+    }
+    return node->blockSize;
+}
+
+// pushes written blocks of the disk to stable storage
+int syncDisk(int disk){
+    Node* node = findNode(disk);
+    if (node == NULL){
+        return ERR_DISK_CLOSED;    
+    }
+    if (node->mode == READ_MODE){
+        return 0;
+    }
+    if (node->backend == DISK_BACKEND_MMAP){
+        if (node->map != NULL && msync(node->map,node->mapLen,MS_SYNC) != 0){
+            return ERR_FWRITE;
+        }
+        return 0;
+    }
+    if (fdatasync(node->fd) != 0){
+        return ERR_FWRITE;
+    }
+    return 0;
 }
 
 int closeDisk(int disk){
@@ -139,89 +709,713 @@ int closeDisk(int disk){
     if (node == NULL){
         return ERR_DISK_CLOSED;    
     }
+    int fd = node->fd;
+    int err_code = unmapDisk(node);
     if (deleteNode(disk) == -1){
         return ERR_DEL_NODE;
     }
-    return 0; 
+    if (close(fd) != 0){
+        return ERR_FCLOSE;
+    }
+    return err_code; 
 }
 
+// a block and its checksum come in with one pread
 int readBlock(int disk, int bNum, void *block){
+    struct iovec slots[2];
+    uint32_t sum;
     // check if disk is open for reading
-    FILE* fd;
     Node* node = findNode(disk);
     if (node == NULL){
        return ERR_DISK_CLOSED; 
     }
     // check if bNum isn't too big
     
+    int size = node->blockSize;
     if (node->nBytes != 0){
-        if (bNum*BLOCKSIZE > node->nBytes){
+        if ((long)(bNum+1)*size > node->nBytes){
             return ERR_DISK_SIZE_EXCEEDED;
         }
     }
-
-    char* file = node->filename;
-    if (!file){
-        return ERR_NO_FILE;
+    if (bNum < 0){
+        return ERR_FREAD;
     }
-    fd = fopen(node->filename,"r");
-    
+
     // load block into block
-    if (fseek(fd,bNum*BLOCKSIZE,SEEK_SET) != 0){
-        return ERR_FSEEK; 
+    slots[0].iov_base = block;
+    slots[0].iov_len = size;
+    slots[1].iov_base = &sum;
+    slots[1].iov_len = SUM_SIZE;
+    int err_code = moveSlots(node,slots,2,(off_t)bNum*slotSize(node),false);
+    if (err_code < 0){
+        return err_code;
     }
-    fread(block,1,BLOCKSIZE,fd);
-    fflush(fd);
-    if (feof(fd) != 0 || ferror(fd)!=0){
-        return ERR_FREAD;
-    }
-    fclose(fd);
-    return 0;
+    return sumBlocks(node,slots,2,false);
 }
 
+// and go out the same way
 int writeBlock(int disk, int bNum, void *block){
+    struct iovec slots[2];
+    uint32_t sum;
     // check if disk is open
     Node* node = findNode(disk);
-    FILE* fd;
+
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
 
     if (node->mode != WRITE_MODE && node->mode != OVERWRITE_MODE){
        return ERR_NO_WRITE; 
     }    
 
+    // check if bNum isn't too big
+    int size = node->blockSize;
+    if (bNum < 0 || (long)(bNum+1)*size > node->nBytes){
+        return ERR_DISK_SIZE_EXCEEDED;
+    }
+
+    // write from block if possible
+    slots[0].iov_base = block;
+    slots[0].iov_len = size;
+    slots[1].iov_base = &sum;
+    slots[1].iov_len = SUM_SIZE;
+    sumBlocks(node,slots,2,true);
+    int err_code = moveSlots(node,slots,2,(off_t)bNum*slotSize(node),true);
+    if (err_code < 0){
+        return err_code;
+    }
+    if (node->mode != OVERWRITE_MODE){
+        node->mode = OVERWRITE_MODE;
+    }
+    return 0;
+}
+
+// checks that iov covers whole blocks starting at bNum and that they
+// fit on the disk, returns the number of blocks
+static int checkRange(Node* node, int bNum, const struct iovec *iov, int iovcnt){
+    size_t total = 0;
+    int i;
+    for (i=0;i<iovcnt;i++){
+        total += iov[i].iov_len;
+    }
+    if (iovcnt <= 0 || total == 0 || total % node->blockSize != 0){
+        return ERR_NBYTES;
+    }
+    if (bNum < 0){
+        return ERR_DISK_SIZE_EXCEEDED;
+    }
+    if (node->nBytes != 0 && (size_t)bNum*node->blockSize + total > (size_t)node->nBytes){
+        return ERR_DISK_SIZE_EXCEEDED;
+    }
+    return total / node->blockSize;
+}
+
+// reads consecutive blocks starting at bNum into the buffers of iov
+// (their lengths must add up to whole blocks) with one preadv per
+// DISK_IOV_MAX buffers, checksums included
+int readBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt){
+    Node* node = findNode(disk);
+    struct iovec* slots;
     if (node == NULL){
        return ERR_DISK_CLOSED; 
     }
-    // check if bNum isn't too big
-    if (bNum*BLOCKSIZE > node->nBytes){
-        return ERR_DISK_SIZE_EXCEEDED;
+    int count = checkRange(node,bNum,iov,iovcnt);
+    if (count < 0){
+        return count;
     }
-    char* file = node->filename;
-    if (!file){
-        return ERR_NO_FILE;
+
+    uint32_t* sums = (uint32_t*)malloc(count * sizeof(uint32_t));
+    int n = layBlocks(node,iov,iovcnt,count,sums,&slots);
+    int err_code = moveSlots(node,slots,n,(off_t)bNum*slotSize(node),false);
+    if (err_code == 0){
+        err_code = sumBlocks(node,slots,n,false);
     }
+    free(slots);
+    free(sums);
+    return err_code;
+}
 
-    if (node->mode == WRITE_MODE){
-        fd = fopen(file,"w+");
+// writes the buffers of iov to consecutive blocks starting at bNum
+int writeBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt){
+    Node* node = findNode(disk);
+    struct iovec* slots;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    if (node->mode != WRITE_MODE && node->mode != OVERWRITE_MODE){
+       return ERR_NO_WRITE; 
+    }    
+    int count = checkRange(node,bNum,iov,iovcnt);
+    if (count < 0){
+        return count;
+    }
+
+    uint32_t* sums = (uint32_t*)malloc(count * sizeof(uint32_t));
+    int n = layBlocks(node,iov,iovcnt,count,sums,&slots);
+    sumBlocks(node,slots,n,true);
+    int err_code = moveSlots(node,slots,n,(off_t)bNum*slotSize(node),true);
+    free(slots);
+    free(sums);
+    if (err_code < 0){
+        return err_code;
+    }
+    if (node->mode != OVERWRITE_MODE){
         node->mode = OVERWRITE_MODE;
+    }
+    return 0;
+}
+
+// count consecutive blocks from bNum in one call
+int readBlocks(int disk, int bNum, int count, void *buf){
+    Node* node = findNode(disk);
+    struct iovec iov;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)count*node->blockSize;
+    return readBlocksv(disk,bNum,&iov,1);
+}
+
+int writeBlocks(int disk, int bNum, int count, void *buf){
+    Node* node = findNode(disk);
+    struct iovec iov;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)count*node->blockSize;
+    return writeBlocksv(disk,bNum,&iov,1);
+}
+
+// checks the blocks a finished read brought in against their
+// checksums, without asyncLock so other requests don't wait on it
+static int checkRead(Request* req, int result){
+    if (result == 0 && !req->write){
+        result = sumBlocks(req->node,req->iov,req->iovcnt,false);
+    }
+    return result;
+}
+
+// ASYNC HELPER FUNCTIONS
+// asyncLock is held by the callers of everything below
+
+static void release(Request* req){
+    free(req->iov);
+    free(req->sums);
+    req->token = -1;
+}
+
+// hands a finished request back to the caller through the ready list,
+// detached requests keep their result in the slot for waitRequest
+// reads have been through checkRead already
+static void complete(Request* req, int result){
+    if (req->detached){
+        req->done = true;
+        req->result = result;
+        return;
+    }
+    DiskCompletion* c = &ready[(readyHead + readyCount) % DISK_ASYNC_DEPTH];
+    c->token = req->token;
+    c->result = result;
+    readyCount++;
+    release(req);
+}
+
+static Request* freeSlot(void){
+    int i;
+    for (i=0;i<DISK_ASYNC_DEPTH;i++){
+        if (requests[i].token == -1){
+            return &requests[i];
+        }
+    }
+    return NULL;
+}
+
+static int uringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags){
+    return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringStart(void){
+    struct io_uring_params* p = &ringParams;
+    memset(p,0,sizeof(*p));
+    ringFd = syscall(__NR_io_uring_setup, DISK_ASYNC_DEPTH, p);
+    if (ringFd < 0){
+        return ERR_ASYNC_START;
+    }
+    sqRingLen = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    cqRingLen = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP){
+        // both rings share one mapping
+        if (cqRingLen > sqRingLen){
+            sqRingLen = cqRingLen;
+        }
+        cqRingLen = 0;
+    }
+    sqesLen = p->sq_entries * sizeof(struct io_uring_sqe);
+    sqRing = mmap(NULL, sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = sqRing;
+    if (sqRing != MAP_FAILED && cqRingLen != 0){
+        cqRing = mmap(NULL, cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    }
+    sqes = mmap(NULL, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED){
+        if (sqes != MAP_FAILED){
+            munmap(sqes,sqesLen);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing){
+            munmap(cqRing,cqRingLen);
+        }
+        if (sqRing != MAP_FAILED){
+            munmap(sqRing,sqRingLen);
+        }
+        close(ringFd);
+        ringFd = -1;
+        return ERR_ASYNC_START;
+    }
+    return 0;
+}
+
+static void uringStop(void){
+    munmap(sqes,sqesLen);
+    if (cqRing != sqRing){
+        munmap(cqRing,cqRingLen);
+    }
+    munmap(sqRing,sqRingLen);
+    close(ringFd);
+    ringFd = -1;
+}
+
+static int uringSubmit(Request* req){
+    struct io_uring_params* p = &ringParams;
+    unsigned* tail = (unsigned*)(sqRing + p->sq_off.tail);
+    unsigned mask = *(unsigned*)(sqRing + p->sq_off.ring_mask);
+    unsigned* array = (unsigned*)(sqRing + p->sq_off.array);
+    // no more than DISK_ASYNC_DEPTH requests are ever out, so the
+    // submission ring always has room
+    unsigned t = *tail;
+    unsigned index = t & mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long)req->iov;
+    sqe->len = req->iovcnt;
+    sqe->off = req->pos;
+    sqe->user_data = req - requests;
+    array[index] = index;
+    __atomic_store_n(tail, t + 1, __ATOMIC_RELEASE);
+    if (uringEnter(1, 0, 0) != 1){
+        // take the entry back, the kernel didn't consume it
+        __atomic_store_n(tail, t, __ATOMIC_RELEASE);
+        return req->write ? ERR_FWRITE : ERR_FREAD;
+    }
+    return 0;
+}
+
+// moves everything on the completion ring to the ready list
+// reads that came in whole are checked with asyncLock let go
+static void uringReap(void){
+    struct io_uring_params* p = &ringParams;
+    unsigned* head = (unsigned*)(cqRing + p->cq_off.head);
+    unsigned* tail = (unsigned*)(cqRing + p->cq_off.tail);
+    unsigned mask = *(unsigned*)(cqRing + p->cq_off.ring_mask);
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)(cqRing + p->cq_off.cqes);
+    unsigned h = *head;
+    unsigned t = __atomic_load_n(tail, __ATOMIC_ACQUIRE);
+    Request* reads[DISK_ASYNC_DEPTH];
+    int results[DISK_ASYNC_DEPTH];
+    int n = 0;
+    int i;
+
+    while (h != t){
+        struct io_uring_cqe* cqe = &cqes[h & mask];
+        Request* req = &requests[cqe->user_data];
+        if (cqe->res != (int)req->len){
+            complete(req, req->write ? ERR_FWRITE : ERR_FREAD);
+        }else if (req->write){
+            complete(req, 0);
+        }else{
+            reads[n++] = req;
+        }
+        h++;
+    }
+    __atomic_store_n(head, h, __ATOMIC_RELEASE);
+    if (n == 0){
+        return;
+    }
+    checking += n;
+    pthread_mutex_unlock(&asyncLock);
+    for (i=0;i<n;i++){
+        results[i] = checkRead(reads[i],0);
+    }
+    pthread_mutex_lock(&asyncLock);
+    for (i=0;i<n;i++){
+        complete(reads[i],results[i]);
+    }
+    checking -= n;
+    pthread_cond_broadcast(&doneCond);
+}
+
+// blocks until the ring has min more completions, or until another
+// thread is done checking the reads it took off the ring, which the
+// ring would never hand out again
+static int uringWait(unsigned min){
+    if (checking > 0){
+        pthread_cond_wait(&doneCond,&asyncLock);
+        return 0;
+    }
+    return uringEnter(0, min, IORING_ENTER_GETEVENTS);
+}
+
+static void* worker(void* arg){
+    Request* req;
+    ssize_t got;
+    int result;
+    (void)arg;
+    pthread_mutex_lock(&asyncLock);
+    while (true){
+        while (queueHead == NULL && !stopping){
+            pthread_cond_wait(&workCond,&asyncLock);
+        }
+        if (queueHead == NULL){
+            break;
+        }
+        req = queueHead;
+        queueHead = req->next;
+        if (queueHead == NULL){
+            queueTail = NULL;
+        }
+        pthread_mutex_unlock(&asyncLock);
+        if (req->write){
+            got = pwritev(req->fd, req->iov, req->iovcnt, req->pos);
+        }else{
+            got = preadv(req->fd, req->iov, req->iovcnt, req->pos);
+        }
+        if (got == (ssize_t)req->len){
+            result = checkRead(req, 0);
+        }else{
+            result = req->write ? ERR_FWRITE : ERR_FREAD;
+        }
+        pthread_mutex_lock(&asyncLock);
+        complete(req, result);
+        pthread_cond_broadcast(&doneCond);
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return NULL;
+}
+
+// runs with as many workers as could be started, at least one
+static int workersStart(void){
+    stopping = false;
+    workerCount = 0;
+    while (workerCount < DISK_ASYNC_WORKERS
+            && pthread_create(&workers[workerCount],NULL,worker,NULL) == 0){
+        workerCount++;
+    }
+    if (workerCount > 0){
+        return 0;
+    }
+    return ERR_ASYNC_START;
+}
+
+// the workers finish the queue before they exit
+static void workersStop(void){
+    int i;
+    stopping = true;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&asyncLock);
+    for (i=0;i<workerCount;i++){
+        pthread_join(workers[i],NULL);
+    }
+    workerCount = 0;
+    pthread_mutex_lock(&asyncLock);
+}
+
+static int asyncStart(void){
+    int i;
+    for (i=0;i<DISK_ASYNC_DEPTH;i++){
+        requests[i].token = -1;
+    }
+    if (asyncWanted != DISK_ASYNC_THREADS && uringStart() == 0){
+        asyncEngine = DISK_ASYNC_URING;
+        return 0;
+    }
+    if (asyncWanted == DISK_ASYNC_URING){
+        return ERR_ASYNC_START;
+    }
+    if (workersStart() < 0){
+        return ERR_ASYNC_START;
+    }
+    asyncEngine = DISK_ASYNC_THREADS;
+    return 0;
+}
+
+static int submit(int disk, int bNum, const struct iovec *iov, int iovcnt, bool write, bool detached){
+    Node* node = findNode(disk);
+    Request* req;
+    struct iovec* slots;
+    int err_code = 0;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    if (write && node->mode != WRITE_MODE && node->mode != OVERWRITE_MODE){
+       return ERR_NO_WRITE; 
+    }
+    int count = checkRange(node,bNum,iov,iovcnt);
+    if (count < 0){
+        return count;
+    }
+
+    // the caller's array only has to last until submit returns, the
+    // request goes out as laid out blocks and their checksums
+    uint32_t* sums = (uint32_t*)malloc(count * sizeof(uint32_t));
+    int n = layBlocks(node,iov,iovcnt,count,sums,&slots);
+    if (n > DISK_IOV_MAX){
+        free(slots);
+        free(sums);
+        return ERR_NBYTES;
+    }
+    if (write){
+        sumBlocks(node,slots,n,true);
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    if (asyncEngine == DISK_ASYNC_AUTO){
+        err_code = asyncStart();
+    }
+    if (err_code == 0 && inFlight == DISK_ASYNC_DEPTH){
+        err_code = ERR_ASYNC_FULL;
+    }
+    if (err_code < 0){
+        pthread_mutex_unlock(&asyncLock);
+        free(slots);
+        free(sums);
+        return err_code;
+    }
+    req = freeSlot();
+    req->token = nextToken;
+    req->write = write;
+    req->detached = detached;
+    req->done = false;
+    req->fd = node->fd;
+    req->pos = (off_t)bNum*slotSize(node);
+    req->iov = slots;
+    req->iovcnt = n;
+    req->sums = sums;
+    req->len = (size_t)count*slotSize(node);
+    req->node = node;
+    req->next = NULL;
+
+    if (node->backend == DISK_BACKEND_MMAP){
+        // the copy is as cheap as queueing it, it is done below once the
+        // slot is taken
+        checking++;
+    }else if (asyncEngine == DISK_ASYNC_URING){
+        err_code = uringSubmit(req);
     }else{
-        fd = fopen(file,"r+");
+        if (queueTail != NULL){
+            queueTail->next = req;
+        }else{
+            queueHead = req;
+        }
+        queueTail = req;
+        pthread_cond_signal(&workCond);
+    }
+    if (err_code < 0){
+        release(req);
+        pthread_mutex_unlock(&asyncLock);
+        return err_code;
     }
+    if (write){
+        if (node->mode != OVERWRITE_MODE){
+            node->mode = OVERWRITE_MODE;
+        }
+    }
+    inFlight++;
+    if (detached){
+        detachedOut++;
+    }
+    int token = nextToken;
+    nextToken = (nextToken == 0x7fffffff) ? 0 : nextToken + 1;
+    if (node->backend == DISK_BACKEND_MMAP){
+        pthread_mutex_unlock(&asyncLock);
+        int result = checkRead(req, moveSlots(node,slots,n,req->pos,write));
+        pthread_mutex_lock(&asyncLock);
+        complete(req, result);
+        checking--;
+        pthread_cond_broadcast(&doneCond);
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return token;
+}
 
+// takes up to max entries off the ready list
+static int takeReady(DiskCompletion *done, int max){
+    int n = 0;
+    while (n < max && readyCount > 0){
+        done[n++] = ready[readyHead];
+        readyHead = (readyHead + 1) % DISK_ASYNC_DEPTH;
+        readyCount--;
+        inFlight--;
+    }
+    return n;
+}
 
-    // write from block if possible
-    if (fseek(fd,bNum*BLOCKSIZE,SEEK_SET) != 0){
-        return ERR_FSEEK; 
+
+// ASYNC I/O
+// requests run in the background and finish in any order, buf must
+// stay valid until the request's completion has been returned
+// every request must be reaped before its disk is closed
+
+// picks the engine the next start uses, the running one is shut down
+// once nothing is in flight
+int setDiskAsync(int engine){
+    if (engine != DISK_ASYNC_AUTO && engine != DISK_ASYNC_URING && engine != DISK_ASYNC_THREADS){
+        return ERR_NO_BACKEND;
     }
-    if (fwrite(block,1,BLOCKSIZE,fd) != BLOCKSIZE){
-        return ERR_FWRITE;
+    pthread_mutex_lock(&asyncLock);
+    if (inFlight != 0){
+        pthread_mutex_unlock(&asyncLock);
+        return ERR_ASYNC_FULL;
     }
-    fflush(fd);
-    if (feof(fd) != 0 || ferror(fd)!=0){
-        return ERR_FWRITE;
+    if (asyncEngine == DISK_ASYNC_URING){
+        uringStop();
+    }else if (asyncEngine == DISK_ASYNC_THREADS){
+        workersStop();
     }
+    asyncEngine = DISK_ASYNC_AUTO;
+    asyncWanted = engine;
+    pthread_mutex_unlock(&asyncLock);
     return 0;
 }
 
+// the engine that is running, DISK_ASYNC_AUTO before the first submit
+int diskAsyncEngine(void){
+    return asyncEngine;
+}
+
+// queues a read of count blocks from bNum into buf
+// returns a token that comes back with the completion
+int submitRead(int disk, int bNum, int count, void *buf){
+    Node* node = findNode(disk);
+    struct iovec iov;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)count*node->blockSize;
+    return submit(disk,bNum,&iov,1,false,false);
+}
+
+int submitWrite(int disk, int bNum, int count, void *buf){
+    Node* node = findNode(disk);
+    struct iovec iov;
+    if (node == NULL){
+       return ERR_DISK_CLOSED; 
+    }
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)count*node->blockSize;
+    return submit(disk,bNum,&iov,1,true,false);
+}
+
+// queues a read of consecutive blocks from bNum into the buffers of iov
+// whose completion only comes back through waitRequest(token), so a
+// library can keep reads in flight without taking completions meant
+// for its caller
+int submitReadvDetached(int disk, int bNum, const struct iovec *iov, int iovcnt){
+    return submit(disk,bNum,iov,iovcnt,false,true);
+}
+
+// waits for a detached request and returns its result, ERR_BAD_TOKEN
+// if token isn't a detached request in flight
+int waitRequest(int token){
+    int i;
+    Request* req = NULL;
+    pthread_mutex_lock(&asyncLock);
+    for (i=0;i<DISK_ASYNC_DEPTH;i++){
+        if (requests[i].token == token && requests[i].detached){
+            req = &requests[i];
+        }
+    }
+    if (req == NULL){
+        pthread_mutex_unlock(&asyncLock);
+        return ERR_BAD_TOKEN;
+    }
+    while (!req->done){
+        if (asyncEngine == DISK_ASYNC_URING){
+            uringReap();
+            if (!req->done && uringWait(1) < 0 && errno != EINTR){
+                break;
+            }
+        }else{
+            pthread_cond_wait(&doneCond,&asyncLock);
+        }
+    }
+    int result = req->done ? req->result : ERR_FREAD;
+    release(req);
+    inFlight--;
+    detachedOut--;
+    pthread_mutex_unlock(&asyncLock);
+    return result;
+}
+
+// copies up to max finished requests into done without blocking
+// returns how many were copied
+int pollCompletions(DiskCompletion *done, int max){
+    int n;
+    pthread_mutex_lock(&asyncLock);
+    if (asyncEngine == DISK_ASYNC_URING){
+        uringReap();
+    }
+    n = takeReady(done,max);
+    pthread_mutex_unlock(&asyncLock);
+    return n;
+}
+
+// like pollCompletions but blocks until min requests have finished
+// (or everything in flight, if that is fewer)
+int waitCompletions(DiskCompletion *done, int min, int max){
+    int n;
+    pthread_mutex_lock(&asyncLock);
+    if (min > max){
+        min = max;
+    }
+    if (min > inFlight - detachedOut){
+        min = inFlight - detachedOut;
+    }
+    if (asyncEngine == DISK_ASYNC_URING){
+        uringReap();
+        while (readyCount < min){
+            if (uringWait(min - readyCount) < 0 && errno != EINTR){
+                break;
+            }
+            uringReap();
+        }
+    }else{
+        while (readyCount < min){
+            pthread_cond_wait(&doneCond,&asyncLock);
+        }
+    }
+    n = takeReady(done,max);
+    pthread_mutex_unlock(&asyncLock);
+    return n;
+}
+
+// block fields wider than a byte are stored little-endian
+unsigned int getU32(char* field){
+    unsigned char* b = (unsigned char*)field;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+void putU32(char* field, unsigned int value){
+    field[0] = value;
+    field[1] = value >> 8;
+    field[2] = value >> 16;
+    field[3] = value >> 24;
+}
+
 /*int main(){
     void* write_block[256];
     void* read_block[256];
@@ -1,6 +1,58 @@
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define DISK_BACKEND_FILE 0
+#define DISK_BACKEND_MMAP 1
+
+// disks start out with the smallest block size
+#define DISK_MIN_BLOCKSIZE 256
+#define DISK_MAX_BLOCKSIZE 65536
+
+// async engines, DISK_ASYNC_AUTO tries io_uring and falls back to threads
+#define DISK_ASYNC_AUTO 0
+#define DISK_ASYNC_URING 1
+#define DISK_ASYNC_THREADS 2
+// requests submitted but not yet returned by poll/waitCompletions
+#define DISK_ASYNC_DEPTH 256
+
+// CRC32C kernels, DISK_CRC_AUTO takes SSE4.2 where the CPU has it
+#define DISK_CRC_AUTO 0
+#define DISK_CRC_HARDWARE 1
+#define DISK_CRC_SLICING 2
+
+typedef struct DiskCompletion{
+    int token; // what submitRead/submitWrite returned
+    int result; // 0 or a negative error code
+}DiskCompletion;
+
 extern int openDisk(char* filename, int nBytes);
+extern int openDiskBackend(char* filename, int nBytes, int backend);
+extern int setDiskBackend(int backend);
+extern int setDiskBlockSize(int disk, int blockSize);
+extern int diskBlockSize(int disk);
+extern int syncDisk(int disk);
 extern int closeDisk(int disk);
 extern int readBlock(int disk, int bNum, void *block);
 extern int writeBlock(int disk, int bNumm, void *block);
-
-
+extern int readBlocks(int disk, int bNum, int count, void *buf);
+extern int writeBlocks(int disk, int bNum, int count, void *buf);
+extern int readBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt);
+extern int writeBlocksv(int disk, int bNum, const struct iovec *iov, int iovcnt);
+extern int setDiskAsync(int engine);
+extern int diskAsyncEngine(void);
+// an async request goes out as one preadv/pwritev, so it can't take
+// more than 1024 buffers counting every block piece and every block's
+// checksum, 512 blocks from one buffer. bigger ones fail with
+// ERR_NBYTES, the caller splits them
+extern int submitRead(int disk, int bNum, int count, void *buf);
+extern int submitWrite(int disk, int bNum, int count, void *buf);
+extern int submitReadvDetached(int disk, int bNum, const struct iovec *iov, int iovcnt);
+extern int waitRequest(int token);
+extern int pollCompletions(DiskCompletion *done, int max);
+extern int waitCompletions(DiskCompletion *done, int min, int max);
+extern int eraseDisk(int disk);
+extern unsigned int crc32c(unsigned int crc, const void* buf, size_t len);
+extern int setDiskCrc(int kernel);
+extern int diskCrcKernel(void);
+extern unsigned int getU32(char* field);
+extern void putU32(char* field, unsigned int value);
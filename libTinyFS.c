@@ -4,1504 +4,4203 @@
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "libDisk.h"
+#include "libCache.h"
+#include "libDir.h"
 #include "libTinyFS.h"
 #include "TinyFS_errno.h"
 
 #define MAGIC_NUMBER 0x44
 
+// on-disk format version, older images kept block numbers in one byte,
+// chained file data through a header in every block, never stored
+// file data in the inode, kept a directory in a single block, had no
+// journal or had no block checksums
+#define FORMAT_VERSION 8
+
+// superblock fields, block numbers are 32 bit little-endian
+#define SB_CLEAN 3
+#define SB_VERSION 8
+#define SB_ROOT_INODE 12
+#define SB_NUM_BLOCKS 16
+#define SB_BITMAP_START 20
+#define SB_BITMAP_BLOCKS 24
+#define SB_BLOCK_SIZE 28
+#define SB_JOURNAL_START 32
+#define SB_JOURNAL_BLOCKS 36
+
+// inode fields
+#define INODE_NAME 4 // first 8 bytes of the name
+#define INODE_ENTRIES 12 // number of entries of a directory
+#define INODE_SIZE 16 // file size in bytes
+#define INODE_CURSOR 20 // file pointer saved by tfs_closeFile
+#define INODE_RUNS 24 // number of runs in the extent map
+#define INODE_INDIRECT 28 // first indirect block, 0 if none
+#define INODE_MAP 32 // the first runs of the extent map
+
+// file data blocks have no header, the extent map lists them as
+// (start block, length) runs of 8 bytes, runs that do not fit in
+// the inode go into a chain of indirect blocks ('7')
+#define RUN_SIZE 8
+#define INDIRECT_NEXT 4
+#define INDIRECT_HEADER 8
+#define DIRECT_RUNS ((fs->blockSize - INODE_MAP) / RUN_SIZE)
+#define INDIRECT_RUNS ((fs->blockSize - INDIRECT_HEADER) / RUN_SIZE)
+
+// files of up to INLINE_MAX bytes keep their data in the inode where
+// the extent map would go and have no runs, larger ones have no inline
+// data, the bytes past the end of an inline file are zero
+#define INLINE_MAX (fs->blockSize - INODE_MAP)
+
+// bitmap blocks keep a 4 byte header like every other block
+#define BITMAP_HEADER 4
+#define BITMAP_BITS(size) (((size) - BITMAP_HEADER) * 8)
+
+// the journal is a header block ('8') and a log of transactions, each
+// one or more groups of a descriptor block ('9') and the blocks it lists
+#define JOURNAL_SEQUENCE 4 // header: sequence of the first transaction in the log
+#define DESC_SEQUENCE 4 // sequence of the transaction
+#define DESC_COUNT 8 // blocks listed in this descriptor
+#define DESC_MORE 12 // 1 if the transaction goes on in the next group
+#define DESC_CHECKSUM 16 // of the block numbers and images of the group
+#define DESC_BLOCKS 20 // where the block numbers start
+#define DESC_ENTRIES ((fs->blockSize - DESC_BLOCKS) / 4)
+// mkfs gives the journal 1/32 of the disk within these bounds
+#define JOURNAL_MIN 8
+#define JOURNAL_MAX_BYTES (4 << 20)
+
 typedef struct Node{
-    fileDescriptor FD;
-    char* fileName;
-    struct Node* next;
+    fileDescriptor FD; // 0 when the slot is free
+    char* fileName; // own copy of the path the file was opened with
+    int inode; // inode block of the file
+    int offset; // file pointer in bytes, written to the inode on close
+    int runIndex; // run of the extent map holding the file pointer, -1 if unknown
+    int runFirst; // file block that run starts at
+    int raNext; // where a sequential tfs_read would start next
+    int raWindow; // blocks to read ahead, 0 while access isn't sequential
+    int raBlock; // file block read-ahead has been started up to
+    int next; // next slot in the same hash bucket or in the free list
 }Node;
 
-int mountedDiskNum = -1;
-char* mountedDiskName = NULL;
+// remembered (directory inode, name) -> inode lookup, see DENTRY CACHE
+typedef struct Dentry{
+    int parent; // inode of the directory, 0 when unused
+    char name[DIR_NAME_LEN+1];
+    int inode; // 0 for a negative entry
+    bool dir; // inode has been checked to be a directory
+    int next; // next slot in the same bucket
+}Dentry;
 
+// block image in the running transaction, see JOURNAL
+typedef struct TxBlock{
+    int bNum; // -1 once the block is dropped from the transaction
+    char* data;
+    int next; // next image in the same bucket
+}TxBlock;
 
-Node* openedFiles = NULL;
-fileDescriptor fdGlobal = 1;
+#define DENTRY_SLOTS 512
+#define DENTRY_BUCKETS 256
+#define INODE_LOCKS 64
 
+// everything about one mounted disk
+struct tfs_ctx{
+    int diskNum; // -1 while nothing is mounted
+    char* diskName; // own copy of the name it was mounted with
+    // block size of the mounted disk, read from its superblock
+    int blockSize;
 
+    // open file table
+    // a file descriptor is its slot index + 1 so lookups are direct,
+    // closed slots are kept on a free list and reused first,
+    // and paths are hashed into buckets of slot indexes
+    Node* openedFiles;
+    int openedCapacity;
+    int openedCount;
+    int freeSlot;
+    int* pathBuckets;
+    int numBuckets;
 
-// LIBTINY HELPER FUNCTIONS
-static Node* createNode(fileDescriptor fd,char* filename) {
-    Node* newNode = (Node*)malloc(sizeof(Node));
-    if (newNode == NULL) {
+    // locks, see LOCKING
+    pthread_rwlock_t namespaceLock;
+    pthread_rwlock_t inodeLocks[INODE_LOCKS];
+    pthread_mutex_t allocLock;
+
+    // dentry cache, see DENTRY CACHE
+    Dentry dentries[DENTRY_SLOTS];
+    int dentryBuckets[DENTRY_BUCKETS];
+    int dentryVictim;
+    bool dentryReady;
+    int rootDirectory;
+
+    // allocation bitmap, see BLOCK ALLOCATOR
+    uint64_t* blockBitmap;
+    int bitmapWords;
+    int totalBlocks;
+    int bitmapStart;
+    int bitmapBlocks;
+    char* bitmapDirty; // one flag per bitmap block
+
+    // journal, see JOURNAL
+    int journalStart; // the header block, the log follows it
+    int journalBlocks; // header and log
+    int journalHead; // next free log block, counted from journalStart
+    unsigned int journalSequence; // of the next transaction
+    // running transaction, txLock guards it while file I/O adds to it
+    TxBlock* txBlocks;
+    int txCount;
+    int txCapacity; // also the number of buckets
+    int* txBuckets;
+    int* txFrees; // metadata freed by the running transaction
+    int txFreeCount;
+    int txFreeCapacity;
+    int* deferred; // metadata freed by committed transactions
+    int deferredCount;
+    int deferredCapacity;
+    pthread_mutex_t txLock;
+    bool exclusive; // the namespace lock is held for writing
+
+    // durability, see DURABILITY, txLock guards it too
+    int durability; // TFS_DURABLE_*
+    int syncMs;
+    int syncBlocks;
+    int unsynced; // blocks written since the last sync
+    struct timespec firstUnsynced; // when the first of them was
+    bool dataPending; // file data written since the last commit
+    pthread_cond_t syncCond; // wakes the flusher
+    pthread_t flusher;
+    bool flusherRunning;
+    bool flusherStop;
+    pthread_mutex_t flusherLock; // starting and stopping it, taken first
+
+    struct tfs_ctx* next; // next mounted context
+};
+
+// MOUNT CONTEXTS
+// the tfs_* calls without a context work on defaultCtx, the tfs_*_ctx
+// ones on theirs. every call first makes its context the one of the
+// calling thread, fs, and everything below works on fs
+static tfs_ctx defaultCtx = {
+    .diskNum = -1,
+    .blockSize = BLOCKSIZE,
+    .freeSlot = -1,
+    .namespaceLock = PTHREAD_RWLOCK_INITIALIZER,
+};
+static pthread_once_t defaultOnce = PTHREAD_ONCE_INIT;
+static __thread tfs_ctx* fs = &defaultCtx;
+
+// mounted contexts, so no disk is mounted twice, and mounts are
+// serialized by mountLock, taken after the namespace lock
+static tfs_ctx* mountedCtxs = NULL;
+static pthread_mutex_t mountLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void initCtxLocks(tfs_ctx* ctx){
+    pthread_mutexattr_t attr;
+    pthread_condattr_t condAttr;
+    int i;
+    for (i=0;i<INODE_LOCKS;i++){
+        pthread_rwlock_init(&ctx->inodeLocks[i],NULL);
+    }
+    // the allocator calls itself, and writeAll holds it across a
+    // free and the allocation that may reuse the freed blocks
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ctx->allocLock,&attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&ctx->txLock,NULL);
+    pthread_mutex_init(&ctx->flusherLock,NULL);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr,CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->syncCond,&condAttr);
+    pthread_condattr_destroy(&condAttr);
+}
+
+static void initDefaultCtx(void){
+    initCtxLocks(&defaultCtx);
+}
+
+static tfs_ctx* newCtx(void){
+    tfs_ctx* ctx = (tfs_ctx*)calloc(1, sizeof(tfs_ctx));
+    if (ctx == NULL){
         perror("malloc: "); 
         exit(1);
     }
-    newNode->FD = fd;
-    newNode->fileName = filename;
-    newNode->next = NULL;
-    return newNode;
+    ctx->diskNum = -1;
+    ctx->blockSize = BLOCKSIZE;
+    ctx->freeSlot = -1;
+    pthread_rwlock_init(&ctx->namespaceLock,NULL);
+    initCtxLocks(ctx);
+    return ctx;
+}
+
+// frees a context that has nothing mounted
+static void freeCtx(tfs_ctx* ctx){
+    int i;
+    for (i=0;i<INODE_LOCKS;i++){
+        pthread_rwlock_destroy(&ctx->inodeLocks[i]);
+    }
+    pthread_rwlock_destroy(&ctx->namespaceLock);
+    pthread_mutex_destroy(&ctx->allocLock);
+    pthread_mutex_destroy(&ctx->txLock);
+    pthread_mutex_destroy(&ctx->flusherLock);
+    pthread_cond_destroy(&ctx->syncCond);
+    free(ctx->openedFiles);
+    free(ctx->pathBuckets);
+    free(ctx->blockBitmap);
+    free(ctx->bitmapDirty);
+    free(ctx->txBlocks);
+    free(ctx->txBuckets);
+    free(ctx->txFrees);
+    free(ctx->deferred);
+    free(ctx);
 }
 
-static int insert(fileDescriptor fd,char* filename) {
-    Node* newNode = createNode(fd,filename);
-    Node* head = openedFiles;
-    newNode->next = head;
-    openedFiles = newNode; 
+// makes ctx the context of the calling thread
+static int useCtx(tfs_ctx* ctx){
+    if (ctx == NULL){
+        return ERR_DISK_CLOSED;
+    }
+    if (ctx == &defaultCtx){
+        pthread_once(&defaultOnce,initDefaultCtx);
+    }
+    fs = ctx;
     return 0;
 }
 
-static int deleteNode(fileDescriptor fd){
-    Node* temp = openedFiles;
-    Node* prev = NULL;
+#define INITIAL_OPEN_FILES 16
+// read-ahead window in blocks, doubling from MIN for each sequential read
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX (CACHE_BLOCKS / 2)
+
 
-    if (temp != NULL && temp->FD == fd){
-        openedFiles = temp->next;
-        free(temp);
-        return 0;
-    } 
 
-    while (temp != NULL && temp->FD != fd) {
-        prev = temp;
-        temp = temp->next;
+// LIBTINY HELPER FUNCTIONS
+static unsigned int hashPath(char* path){
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    while (*path != '\0'){
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
     }
+    return h;
+}
+
+static void hashInsert(int slot){
+    int b = hashPath(fs->openedFiles[slot].fileName) & (fs->numBuckets-1);
+    fs->openedFiles[slot].next = fs->pathBuckets[b];
+    fs->pathBuckets[b] = slot;
+}
 
-    if (temp == NULL) return ERR_NO_FILE;   
+static void hashRemove(int slot){
+    int b = hashPath(fs->openedFiles[slot].fileName) & (fs->numBuckets-1);
+    int* link = &fs->pathBuckets[b];
+    while (*link != -1){
+        if (*link == slot){
+            *link = fs->openedFiles[slot].next;
+            break;
+        }
+        link = &fs->openedFiles[*link].next;
+    }
+    fs->openedFiles[slot].next = -1;
+}
 
-    prev->next = temp->next;
-    free(temp);
+// doubles the table and the buckets, rehashing every open path
+static int growTable(void){
+    int newCapacity = fs->openedCapacity == 0 ? INITIAL_OPEN_FILES : fs->openedCapacity * 2;
+    Node* table = (Node*)realloc(fs->openedFiles, newCapacity * sizeof(Node));
+    int* buckets = (int*)malloc(newCapacity * sizeof(int));
+    int i;
+    if (table == NULL || buckets == NULL){
+        perror("malloc: ");
+        exit(1);
+    }
+    fs->openedFiles = table;
+    free(fs->pathBuckets);
+    fs->pathBuckets = buckets;
+    fs->numBuckets = newCapacity;
+    for (i=0;i<fs->numBuckets;i++){
+        fs->pathBuckets[i] = -1;
+    }
+    for (i=fs->openedCapacity;i<newCapacity;i++){
+        fs->openedFiles[i].FD = 0;
+        fs->openedFiles[i].fileName = NULL;
+    }
+    for (i=0;i<fs->openedCapacity;i++){
+        if (fs->openedFiles[i].FD != 0){
+            hashInsert(i);
+        }
+    }
+    // new slots go on the free list, lowest first
+    for (i=newCapacity-1;i>=fs->openedCapacity;i--){
+        fs->openedFiles[i].next = fs->freeSlot;
+        fs->freeSlot = i;
+    }
+    fs->openedCapacity = newCapacity;
     return 0;
 }
 
+// returns the new file descriptor
+static fileDescriptor insert(char* filename,int inode) {
+    if (fs->freeSlot == -1){
+        growTable();
+    }
+    int slot = fs->freeSlot;
+    Node* newNode = &fs->openedFiles[slot];
+    fs->freeSlot = newNode->next;
+    newNode->fileName = strdup(filename);
+    if (newNode->fileName == NULL){
+        perror("malloc: "); 
+        exit(1);
+    }
+    newNode->FD = slot + 1;
+    newNode->inode = inode;
+    newNode->offset = 0;
+    newNode->runIndex = -1;
+    newNode->runFirst = 0;
+    newNode->raNext = 0;
+    newNode->raWindow = 0;
+    newNode->raBlock = 0;
+    hashInsert(slot);
+    fs->openedCount++;
+    return newNode->FD;
+}
 
 static Node* findNode(fileDescriptor fd) {
-    Node* current = openedFiles;
-    while (current != NULL) {
-        if (current->FD == fd) {
-            return current; // Key found
-        }
-        current = current->next;
-        }
-    return NULL; // Key not found
+    if (fd < 1 || fd > fs->openedCapacity || fs->openedFiles[fd-1].FD != fd){
+        return NULL; // Key not found
+    }
+    return &fs->openedFiles[fd-1];
+}
+
+static int deleteNode(fileDescriptor fd){
+    Node* node = findNode(fd);
+    if (node == NULL) return ERR_NO_FILE;   
+
+    hashRemove(fd-1);
+    free(node->fileName);
+    node->fileName = NULL;
+    node->FD = 0;
+    node->next = fs->freeSlot;
+    fs->freeSlot = fd-1;
+    fs->openedCount--;
+    return 0;
 }
 
 static int modifyFilename(fileDescriptor fd, char* newFileName){
     Node* n = findNode(fd);
     if (n == NULL){
         return ERR_NO_FILE;
-    }else{
-        n->fileName = newFileName;
-    } 
+    }
+    char* copy = strdup(newFileName);
+    if (copy == NULL){
+        perror("malloc: "); 
+        exit(1);
+    }
+    hashRemove(fd-1);
+    free(n->fileName);
+    n->fileName = copy;
+    hashInsert(fd-1);
     return 0;
 }
 
 static Node* findNodeFilename(char* filename) {
-    Node* current = openedFiles;
-    while (current != NULL) {
-        if (current->fileName == filename) {
-            return current; // Key found
-        }
-        current = current->next;
+    if (fs->numBuckets == 0){
+        return NULL;
+    }
+    int slot = fs->pathBuckets[hashPath(filename) & (fs->numBuckets-1)];
+    while (slot != -1) {
+        if (strcmp(fs->openedFiles[slot].fileName, filename) == 0) {
+            return &fs->openedFiles[slot]; // Key found
         }
+        slot = fs->openedFiles[slot].next;
+    }
     return NULL; // Key not found
 }
 
 
-// libTiny function implementation
-
+// LOCKING
+// every context has its own locks, so mounted disks never wait on
+// each other outside libCache and libDisk
+// the namespace lock covers the mount, the directory tree, the dentry
+// cache and the open file table, anything that changes them holds it
+// for writing. file I/O holds it for reading plus the lock of the
+// file's inode, for writing when the file or its open file entry
+// changes. inode locks are striped over INODE_LOCKS rwlocks by block
+// number. the bitmap has allocLock, libCache and libDisk lock their
+// own state, txLock guards the running transaction. locks are taken
+// in that order: namespace, inode, alloc, tx
+// transactions are committed while the namespace lock is held for
+// writing, so no operation is ever half in one
+#define COMMIT_NONE 0
+#define COMMIT_LOG 1
+#define COMMIT_SYNC 2
+static int commitTx(void);
+static int commitDue(void);
+static int syncNow(void);
 
-// this overwrites any existing files
-// with the same name
-int tfs_mkfs(char* filename, int nBytes){
-    char* write_block = malloc(BLOCKSIZE * sizeof(char));
-    char* super_block = malloc(BLOCKSIZE * sizeof(char));
-    char* root_inode = malloc(BLOCKSIZE * sizeof(char));
-    char* root_directory = malloc(BLOCKSIZE * sizeof(char));
-    int diskNum = openDisk(filename,nBytes);
-    int err_code;
-    if (diskNum < 0){
-        return diskNum;
-    }
-    // format the file
-    // set the file to 0
-    memset(write_block,0x00,BLOCKSIZE);
-    write_block[0] = '4';
-    write_block[1] = MAGIC_NUMBER;
-    int i;
-    int numBlocks = ((nBytes - (nBytes % BLOCKSIZE)) / BLOCKSIZE);
-    if (numBlocks < 2){
-        return ERR_DISK_SMALL;
+static void lockNamespace(bool write){
+    if (write){
+        pthread_rwlock_wrlock(&fs->namespaceLock);
+        fs->exclusive = true;
+    }else{
+        pthread_rwlock_rdlock(&fs->namespaceLock);
     }
-    for (i=0; i<numBlocks; i++){
-        if (i == numBlocks-1){
-            write_block[2] = 0; //empty next free block (no more free blocks)
-        }else{
-            write_block[2] = i+1; //defaults the next free block to be the next available block
-        }
-        err_code=writeBlock(diskNum,i,write_block); 
-        if (err_code < 0){
-            free(write_block);
-            free(super_block);
-            free(root_inode);
-            return err_code; 
+}
+
+// a writer commits the running transaction on its way out once it is
+// big enough, and syncs under TFS_DURABLE_SYNC. a reader that finds
+// either due comes back as a writer to do it
+static void unlockNamespace(void){
+    bool writer = fs->exclusive;
+    int due = commitDue();
+    if (writer){
+        if (due == COMMIT_SYNC){
+            syncNow();
+        }else if (due == COMMIT_LOG){
+            commitTx();
         }
+        fs->exclusive = false;
     }
-
-    // set the superblock
-    memset(super_block,0x00,BLOCKSIZE);
-    super_block[0] = '0';
-    super_block[1] = MAGIC_NUMBER;
-    super_block[2] = 3;//pointer to next free block
-    super_block[3] = 0x00;  //empty 
-    super_block[4] = MAGIC_NUMBER;//magic number
-    super_block[5] = 1;//pointer to root inode directory
-    super_block[6] = numBlocks; //size of the disk
-    
-    err_code = writeBlock(diskNum,0,super_block);
-    if (err_code < 0){
-        free(write_block);
-        free(super_block);
-        free(root_inode);
-        return err_code;
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    if (!writer && due != COMMIT_NONE){
+        lockNamespace(true);
+        unlockNamespace();
     }
+}
 
-    //set the root_directory_inode
-    memset(root_inode,0x00,BLOCKSIZE);
-    root_inode[0] = '5';
-    root_inode[1] = MAGIC_NUMBER;
-    root_inode[2] = 2; // address of directory file extent
-    root_inode[4] = '/'; // name of directory
-
-    root_inode[12] = 0; //size of directory 
-
-   //set the root_directory_inode
-    memset(root_directory,0x00,BLOCKSIZE);
-    root_directory[0] = '3';
-    root_directory[1] = MAGIC_NUMBER;
-    root_directory[2] = 0; // address of directory file extent
- 
-    err_code = writeBlock(diskNum,1,root_inode);
-    if (err_code < 0){
-        free(write_block);
-        free(super_block);
-        free(root_inode);
-        free(root_directory);
-        return err_code;
+// finds the open file FD for I/O and takes the namespace lock for
+// reading and its inode lock, NULL with nothing held if FD isn't open
+static Node* lockFile(fileDescriptor FD, bool write){
+    lockNamespace(false);
+    Node* node = findNode(FD);
+    if (node == NULL){
+        unlockNamespace();
+        return NULL;
     }
-
-    err_code = writeBlock(diskNum,2,root_directory);
-    if (err_code < 0){
-        free(write_block);
-        free(super_block);
-        free(root_inode);
-        free(root_directory);
-        return err_code;
+    if (write){
+        pthread_rwlock_wrlock(&fs->inodeLocks[node->inode % INODE_LOCKS]);
+    }else{
+        pthread_rwlock_rdlock(&fs->inodeLocks[node->inode % INODE_LOCKS]);
     }
+    return node;
+}
 
-  
-    // the disk is set up
-    // lets close it for now
-    err_code = closeDisk(diskNum);
-    if (err_code < 0){
-        free(write_block);
-        free(super_block);
-        free(root_inode);
-        return err_code;
-    }
+static void unlockFile(Node* node){
+    pthread_rwlock_unlock(&fs->inodeLocks[node->inode % INODE_LOCKS]);
+    unlockNamespace();
+}
 
-    free(write_block);
-    free(super_block);
-    free(root_inode);
-    return SUCCESS;
+static void lockAllocator(void){
+    pthread_mutex_lock(&fs->allocLock);
 }
-int tfs_mount(char* diskname){
-    char* read_block = malloc(BLOCKSIZE * sizeof(char));
-    int diskNum; 
-    int err_code;
 
-    if (mountedDiskNum != -1){
-        return ERR_DISK_MOUNTED;
-    }    
+static void unlockAllocator(void){
+    pthread_mutex_unlock(&fs->allocLock);
+}
 
-    diskNum = openDisk(diskname, 0); 
-    if (diskNum < 0){
-        free(read_block);
-        return diskNum;
+
+// DENTRY CACHE
+// remembers (directory inode, name) -> inode lookups,
+// including names that are not there (inode 0), and
+// whether the inode is known to be a directory
+
+static int dentryHash(int parent, char* name){
+    unsigned int h = 2166136261u ^ (unsigned int)parent;
+    while (*name != '\0'){
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
     }
-    //lets read the superblock
-    err_code = readBlock(diskNum,0,read_block);
-    if (err_code < 0){
-        free(read_block);
-        return err_code;
+    return h % DENTRY_BUCKETS;
+}
+
+// drops every entry, used when a whole subtree goes away
+static void dentryFlush(void){
+    int i;
+    for (i=0;i<DENTRY_SLOTS;i++){
+        fs->dentries[i].parent = 0;
+        fs->dentries[i].next = -1;
     }
-    if (read_block[1] != MAGIC_NUMBER){
-        free(read_block);
-        return ERR_INVALID_TINYFS; 
+    for (i=0;i<DENTRY_BUCKETS;i++){
+        fs->dentryBuckets[i] = -1;
     }
+    fs->dentryVictim = 0;
+    fs->dentryReady = true;
+}
 
-    //get free list
-    char* read_block_fl = malloc(BLOCKSIZE * sizeof(char));
-    int MAX_BLOCKS = read_block[6];
-    int* free_list = malloc(MAX_BLOCKS * sizeof(int));
-
-    //setting up list of free blocks
-    int k;
-    for(k = 0; k < MAX_BLOCKS; k++){
-        free_list[k] = -1;
+static Dentry* dentryLookup(int parent, char* name){
+    if (!fs->dentryReady){
+        dentryFlush();
     }
-    
-    //All the stuff for the first free block
-    k = 0;
-    int next_free_block = read_block[2]; //inital next free block
-    if(next_free_block == 0){
-        free(read_block);
-        return ERR_DISK_FULL;
+    int slot = fs->dentryBuckets[dentryHash(parent,name)];
+    while (slot != -1){
+        if (fs->dentries[slot].parent == parent && strcmp(fs->dentries[slot].name,name) == 0){
+            return &fs->dentries[slot];
+        }
+        slot = fs->dentries[slot].next;
     }
-    free_list[k] = next_free_block; // adds the next free block to the list
-    k++;
+    return NULL;
+}
 
-    while(next_free_block > 0){
-        err_code = readBlock(diskNum, next_free_block, read_block_fl); // reads the next free block
-        if(err_code < 0 || read_block_fl[2] == 0){
-            free(read_block_fl);
+static void dentryUnlink(int slot){
+    int* link = &fs->dentryBuckets[dentryHash(fs->dentries[slot].parent,fs->dentries[slot].name)];
+    while (*link != -1){
+        if (*link == slot){
+            *link = fs->dentries[slot].next;
             break;
         }
-        //printf("read block free: %d\n", read_block_fl[2]);
-        next_free_block = read_block_fl[2]; // sets new free block 
-        if(next_free_block == 0){
-            free(read_block);
-            return ERR_DISK_FULL;
-        }
-        free_list[k] = next_free_block; // adds the next free block to the list
-        k++;
+        link = &fs->dentries[*link].next;
     }
-    /*
-    int j;
-    for(j = 0; j <  MAX_BLOCKS; j++){
-        printf("freeblock: %d\n", free_list[j]);
+    fs->dentries[slot].parent = 0;
+    fs->dentries[slot].next = -1;
+}
+
+static void dentryInvalidate(int parent, char* name){
+    Dentry* d = dentryLookup(parent,name);
+    if (d != NULL){
+        dentryUnlink(d - fs->dentries);
     }
-    */
-    //validate all the blocks
-    int numBlocks = read_block[6];
-    int i;
-    for (i=1;i<numBlocks;i++){
-        err_code = readBlock(diskNum,i,read_block);
-        if (err_code < 0){
-            free(read_block);
-            return err_code;
-        }
-        
-        if (read_block[1] != MAGIC_NUMBER){
-            free(read_block);
-            return ERR_INVALID_TINYFS; 
-        }
-
-        if(read_block[0] == '4'){
-            // if node is free but not in free list
-            int found = 0;
-            int j;
-            for(j = 0; j <  MAX_BLOCKS; j++){
-                if (free_list[j] == i){
-                    found = 1;
-                } 
-            } 
-            if(found != 1){
-                printf("%d free node not in list \n",i);
-                return ERR_INVALID_TINYFS; 
-            }
-        } else {
-            // checks if a non free node is in the free list
-            int found = 0;
-            int j;
-            for(j = 0; j < MAX_BLOCKS; j++){
-                if(free_list[j] == i){
-                    found = 1;
-                }
-            }
+}
 
-            if(found){
-                printf("Non free node found in list \n");
-                return ERR_INVALID_TINYFS;
-            }
+static Dentry* dentryInsert(int parent, char* name, int inode){
+    Dentry* d = dentryLookup(parent,name);
+    if (d == NULL){
+        // slots are recycled round robin once the cache is full
+        int slot = fs->dentryVictim;
+        fs->dentryVictim = (fs->dentryVictim + 1) % DENTRY_SLOTS;
+        if (fs->dentries[slot].parent != 0){
+            dentryUnlink(slot);
         }
+        d = &fs->dentries[slot];
+        int b = dentryHash(parent,name);
+        d->parent = parent;
+        strncpy(d->name,name,DIR_NAME_LEN);
+        d->name[DIR_NAME_LEN] = '\0';
+        d->next = fs->dentryBuckets[b];
+        fs->dentryBuckets[b] = slot;
+    }
+    d->inode = inode;
+    d->dir = false;
+    return d;
+}
+
+// JOURNAL
+// metadata blocks are not written in place right away: metaWrite keeps
+// their images in the running transaction and metaRead looks there
+// first. commitTx writes the transaction and the bitmap blocks it
+// changed to the log, syncs, and only then gives the images to libCache
+// to be written in place whenever. a checkpoint empties a full log once
+// the cache is flushed and synced, and mount replays every complete
+// transaction still in the log. file data goes around the journal,
+// it is written back and synced before the transaction pointing at it
+// is logged
+// freed metadata blocks go back to the bitmap at the checkpoint after
+// their transaction commits, so a replay never writes over a block
+// that was reused for something else
+#define INITIAL_TX_BLOCKS 64
+static void noteWritesLocked(int count);
 
+// the image of bNum in the running transaction, -1 if there is none
+// txLock is held by the callers
+static int txFind(int bNum){
+    if (fs->txCount == 0){
+        return -1;
     }
-    // ok now we know the disk size
-    // reopen disk for writing
-    err_code = closeDisk(diskNum);
-    if (err_code < 0){
-        free(read_block);
-        return err_code;
+    int i = fs->txBuckets[bNum & (fs->txCapacity-1)];
+    while (i != -1 && fs->txBlocks[i].bNum != bNum){
+        i = fs->txBlocks[i].next;
     }
-    
-    free(read_block);
-    openDisk(diskname, numBlocks*BLOCKSIZE);
+    return i;
+}
 
-    mountedDiskNum = diskNum;
-    mountedDiskName = diskname;
-    return SUCCESS;
+static void growTx(void){
+    int newCapacity = fs->txCapacity == 0 ? INITIAL_TX_BLOCKS : fs->txCapacity * 2;
+    TxBlock* blocks = (TxBlock*)realloc(fs->txBlocks, newCapacity * sizeof(TxBlock));
+    int* buckets = (int*)malloc(newCapacity * sizeof(int));
+    int i;
+    if (blocks == NULL || buckets == NULL){
+        perror("malloc: ");
+        exit(1);
+    }
+    for (i=0;i<newCapacity;i++){
+        buckets[i] = -1;
+    }
+    for (i=0;i<fs->txCount;i++){
+        if (blocks[i].bNum != -1){
+            int b = blocks[i].bNum & (newCapacity-1);
+            blocks[i].next = buckets[b];
+            buckets[b] = i;
+        }
+    }
+    free(fs->txBuckets);
+    fs->txBlocks = blocks;
+    fs->txBuckets = buckets;
+    fs->txCapacity = newCapacity;
+}
 
+static int metaRead(int bNum, char* block){
+    pthread_mutex_lock(&fs->txLock);
+    int i = txFind(bNum);
+    if (i != -1){
+        memcpy(block,fs->txBlocks[i].data,fs->blockSize);
+    }
+    pthread_mutex_unlock(&fs->txLock);
+    if (i != -1){
+        return 0;
+    }
+    return cacheReadBlock(fs->diskNum,bNum,block);
 }
 
-int tfs_closeFile(fileDescriptor FD){
-    // remove the node from our open list
-    int err_code = deleteNode(FD);
+static int metaWrite(int bNum, char* block){
+    pthread_mutex_lock(&fs->txLock);
+    int i = txFind(bNum);
+    if (i == -1){
+        if (fs->txCount == fs->txCapacity){
+            growTx();
+        }
+        int b = bNum & (fs->txCapacity-1);
+        i = fs->txCount++;
+        noteWritesLocked(1);
+        fs->txBlocks[i].bNum = bNum;
+        fs->txBlocks[i].data = (char*)malloc(fs->blockSize * sizeof(char));
+        fs->txBlocks[i].next = fs->txBuckets[b];
+        fs->txBuckets[b] = i;
+    }
+    memcpy(fs->txBlocks[i].data,block,fs->blockSize);
+    pthread_mutex_unlock(&fs->txLock);
+    return 0;
+}
+
+static int metaReadBlocks(int bNum, int count, char* buf){
+    int err_code = cacheReadBlocks(fs->diskNum,bNum,count,buf);
+    int k;
     if (err_code < 0){
         return err_code;
     }
-    return SUCCESS;
+    pthread_mutex_lock(&fs->txLock);
+    for (k=0;k<count;k++){
+        int i = txFind(bNum+k);
+        if (i != -1){
+            memcpy(buf + (size_t)k*fs->blockSize,fs->txBlocks[i].data,fs->blockSize);
+        }
+    }
+    pthread_mutex_unlock(&fs->txLock);
+    return 0;
 }
 
+static int metaWriteBlocks(int bNum, int count, char* buf){
+    int k;
+    for (k=0;k<count;k++){
+        metaWrite(bNum+k,buf + (size_t)k*fs->blockSize);
+    }
+    return 0;
+}
 
-int tfs_unmount(void){
-    // lets unmount the currently mounted file
-    //close all the open files
-    Node* cur = openedFiles;
-    Node* next = NULL;
-    int err_code;
-    while (cur != NULL){
-        next = cur->next;
-        err_code = tfs_closeFile(cur->FD);
-        if (err_code < 0){
-            return err_code;
+// blocks given back to the bitmap at once must not be written later
+static void dropImages(int start, int count){
+    int b;
+    pthread_mutex_lock(&fs->txLock);
+    for (b=start;b<start+count && fs->txCount > 0;b++){
+        int i = txFind(b);
+        if (i != -1){
+            free(fs->txBlocks[i].data);
+            fs->txBlocks[i].data = NULL;
+            fs->txBlocks[i].bNum = -1;
         }
-        cur = next; 
-    } 
-
-    mountedDiskNum = -1;
-    mountedDiskName = NULL;
-    return SUCCESS;     
-
+    }
+    pthread_mutex_unlock(&fs->txLock);
 }
 
-static char* substring(char* string, int start, int end){
-    // Copy the substring
-    int len = end-start;
-    char* sub = (char*) malloc(sizeof(char) * (len+1));
-    strncpy(sub, string + start, len);
-    // Null-terminate the substring
-    sub[len] = '\0';
-    return sub;
+// forgets the running transaction, images and frees
+static void endTx(void){
+    int i;
+    pthread_mutex_lock(&fs->txLock);
+    for (i=0;i<fs->txCount;i++){
+        free(fs->txBlocks[i].data);
+    }
+    for (i=0;i<fs->txCapacity;i++){
+        fs->txBuckets[i] = -1;
+    }
+    fs->txCount = 0;
+    fs->txFreeCount = 0;
+    pthread_mutex_unlock(&fs->txLock);
 }
 
-static int checkDirectory(char* name,char* buffer){
-    int i;
-    char* entry;
-    int len;
-    for (i=4;i<BLOCKSIZE;i+=9){
-        entry = substring(buffer,i,i+8);
-        len = strlen(name);
-        if (strncmp(name,entry,len) == 0){
-            return buffer[i+8]; // returns the inode
+static void pushBlock(int** list, int* count, int* capacity, int bNum){
+    if (*count == *capacity){
+        *capacity = (*capacity == 0) ? INITIAL_TX_BLOCKS : *capacity * 2;
+        *list = (int*)realloc(*list, *capacity * sizeof(int));
+        if (*list == NULL){
+            perror("malloc: ");
+            exit(1);
         }
-        free(entry);
     }
-    return 0; //returns 0 if not in directory
+    (*list)[(*count)++] = bNum;
 }
 
+// frees blocks once the running transaction has committed and the log
+// has been checkpointed, until then the last commit may still point at
+// them (metadata replayed over a new owner, or another file's data)
+static void freeMeta(int start, int count){
+    int b;
+    pthread_mutex_lock(&fs->txLock);
+    for (b=start;b<start+count;b++){
+        pushBlock(&fs->txFrees,&fs->txFreeCount,&fs->txFreeCapacity,b);
+    }
+    pthread_mutex_unlock(&fs->txLock);
+}
 
-static int modifyFileFromDirectory(char* name,char* buffer,char* newContent){
-    int i;
-    int j;
-    char* entry;
-    int len;
-    int flag = 0;
-    for (i=4;i<BLOCKSIZE;i+=9){
-        entry = substring(buffer,i,i+8);
-        len = strlen(name);
-        if (strncmp(name,entry,len) == 0){
-            if (newContent == NULL){
-                for(j=0;j<9;j++){
-                    buffer[i+j] = 0;
-                }
-            }else{
-                for(j=0;j<8;j++){
-                    if (newContent[j] == '\0'){
-                        flag = 1;
-                    }
-                    if (!flag){
-                        buffer[i+j] = newContent[j];
-                    }else{
-                        buffer[i+j] = 0;
-                    }
-                }
-            } 
-            free(entry);  
-            return 1; // returns true if worked
+// commit when a quarter of the log would be taken, or sync after
+// every change under TFS_DURABLE_SYNC
+static int commitDue(void){
+    int due = COMMIT_NONE;
+    pthread_mutex_lock(&fs->txLock);
+    if (fs->diskNum != -1){
+        if (fs->durability == TFS_DURABLE_SYNC && fs->unsynced > 0){
+            due = COMMIT_SYNC;
+        }else if (fs->txCount >= (fs->journalBlocks-1) / 4){
+            due = COMMIT_LOG;
         }
     }
-    free(entry);
-    return ERR_NOT_IN_DIR; //returns -1 if not in directory
+    pthread_mutex_unlock(&fs->txLock);
+    return due;
 }
 
+// BLOCK ALLOCATOR
+// the allocation bitmap of the mounted disk is loaded at mount
+// and kept in memory, one bit per block, set when in use
+// allocating only flips bits, the bitmap blocks that changed go
+// into the next commit, allocLock guards all of it
 
-// return values:
-// if < 0 --> can't find a directory or other error
-// if = 0 --> can't find the filename
-// if > 0 --> this is the inode associated with file
-static int searchForFile(char* path, char* root_buffer, char* filename){
-    int anchor = 1;
-    int inode;
-    int i;
-    int cur_directory;
+static bool blockInUse(int bNum){
+    return (fs->blockBitmap[bNum >> 6] >> (bNum & 63)) & 1;
+}
 
-    if (path[0] != '/'){
-        return ERR_INVALID_PATH;
+static void markBlocks(int start, int count, bool used){
+    int b;
+    for (b=start;b<start+count;b++){
+        if (used){
+            fs->blockBitmap[b >> 6] |= (uint64_t)1 << (b & 63);
+        }else{
+            fs->blockBitmap[b >> 6] &= ~((uint64_t)1 << (b & 63));
+        }
     }
-    for (i=1;i<strlen(path);i++){
-        if (path[i] == '/'){
-            //directory name 
-            char* dirName = substring(path,anchor,i);
-            inode = checkDirectory(dirName,root_buffer);
-            free(dirName);
-            if (inode != 0){
-                readBlock(mountedDiskNum,inode,root_buffer);
-                cur_directory = root_buffer[2];
-                if (cur_directory == 0){
-                    return ERR_DISK_FULL;
-                }
-                readBlock(mountedDiskNum,cur_directory,root_buffer);
-                // now read_block has the contents of the directory
-            }else{
-                return ERR_INVALID_PATH;
-            }
-            anchor = i+1;
-        }   
+    for (b=start/BITMAP_BITS(fs->blockSize);b<=(start+count-1)/BITMAP_BITS(fs->blockSize);b++){
+        fs->bitmapDirty[b] = 1;
     }
-    char* temp = substring(path,anchor,strlen(path));
-    strncpy(filename,temp,8);
-    free(temp);
-    if (sizeof(filename) > 8){
-        return ERR_FILENAME_BIG; //  not a possible filename
+}
+
+// first block at or after from with the given state, totalBlocks if none
+// whole words are skipped when they can not hold a match
+static int findBlock(int from, bool used){
+    int w = from >> 6;
+    uint64_t word;
+    if (from >= fs->totalBlocks){
+        return fs->totalBlocks;
     }
-    inode = checkDirectory(filename,root_buffer);
-    if (inode != 0){
-        return inode;
-    }else{
-        return 0;
+    word = used ? fs->blockBitmap[w] : ~fs->blockBitmap[w];
+    word &= ~(uint64_t)0 << (from & 63);
+    while (word == 0){
+        if (++w >= fs->bitmapWords){
+            return fs->totalBlocks;
+        }
+        word = used ? fs->blockBitmap[w] : ~fs->blockBitmap[w];
     }
+    int b = (w << 6) + __builtin_ctzll(word);
+    return b < fs->totalBlocks ? b : fs->totalBlocks;
 }
 
+static int checkpoint(void);
 
-static int getRecentDirectory(char* path, char* root_buffer){
-    int anchor = 1;
-    int inode;
-    int i;
-    int cur_directory = 0;
-    char* dirName;
-    if (path[0] != '/'){
-        return ERR_INVALID_PATH;
+// the metadata freed so far is only reusable after a checkpoint, one
+// is taken when the disk looks full, committing the running
+// transaction first if the namespace lock is held for writing
+// true if any blocks came back
+static bool reclaimSpace(void){
+    if (fs->exclusive && fs->txFreeCount > 0 && commitTx() < 0){
+        return false;
     }
-    for (i=1;i<strlen(path);i++){
-        if (path[i] == '/'){
-            //directory name 
-            dirName = substring(path,anchor,i);
-            inode = checkDirectory(dirName,root_buffer);
-            free(dirName);
-            if (inode != 0){
-                readBlock(mountedDiskNum,inode,root_buffer);
-                cur_directory = root_buffer[2];
-                if (cur_directory == 0){
-                    return ERR_DISK_FULL;
-                }
-                readBlock(mountedDiskNum,cur_directory,root_buffer);
-                // now read_block has the contents of the directory
-            }else{
-                return ERR_INVALID_PATH;
+    if (fs->deferredCount == 0){
+        return false;
+    }
+    return checkpoint() == 0;
+}
+
+// file I/O holds the namespace lock only for reading and can't commit,
+// when it runs out of space it comes here to commit and checkpoint
+// what was freed meanwhile, true if it is worth trying again
+// callers try again once at most
+static bool reclaimForIO(int err_code){
+    if (err_code != ERR_DISK_FULL){
+        return false;
+    }
+    lockNamespace(true);
+    bool again = fs->diskNum != -1 && (fs->txFreeCount > 0 || fs->deferredCount > 0)
+        && commitTx() == 0 && checkpoint() == 0;
+    unlockNamespace();
+    return again;
+}
+
+// first fit from goal on, wrapping around to the start of the disk,
+// else the longest run found, returns its length and start
+static int searchFree(int goal, int count, int* start){
+    int best = -1;
+    int bestLen = 0;
+    int pass;
+    for (pass=0;pass<2 && bestLen < count;pass++){
+        int limit = (pass == 0) ? fs->totalBlocks : goal;
+        int b = findBlock((pass == 0) ? goal : 0,false);
+        while (b < limit){
+            int end = findBlock(b,true);
+            if (end - b >= count){
+                best = b;
+                bestLen = count;
+                break;
             }
-            anchor = i+1;
-        }   
+            if (end - b > bestLen){
+                best = b;
+                bestLen = end - b;
+            }
+            b = findBlock(end,false);
+        }
     }
-    return cur_directory;
+    *start = best;
+    return bestLen;
 }
 
+// finds count contiguous free blocks near goal
+// if no run is long enough the longest run found is used
+// returns the length of the run allocated at *start
+static int allocBlocksNear(int goal, int count, int* start){
+    int best;
+    int bestLen;
+    if (goal < 0 || goal >= fs->totalBlocks){
+        goal = 0;
+    }
+    lockAllocator();
+    bestLen = searchFree(goal,count,&best);
+    if (bestLen == 0 && reclaimSpace()){
+        bestLen = searchFree(goal,count,&best);
+    }
+    if (bestLen > 0){
+        markBlocks(best,bestLen,true);
+    }
+    unlockAllocator();
+    if (bestLen == 0){
+        return ERR_DISK_FULL;
+    }
+    *start = best;
+    return bestLen;
+}
 
+static int allocBlockNear(int goal){
+    int b;
+    int err_code = allocBlocksNear(goal,1,&b);
+    if (err_code < 0){
+        return err_code;
+    }
+    return b;
+}
 
-static int addFileToBuffer(char* name, char* buffer, int inode){
-    int i;
-    int j;
-    for (i=4; i<BLOCKSIZE;i+=9){
-        if (buffer[i] == '\0'){
-            for (j=0;j<8;j++){
-                if (name[j] == '\0'){
-                    break;
-                }
-                buffer[i+j] = name[j];  
+static int allocBlock(void){
+    return allocBlockNear(0);
+}
+
+// blocks that no longer belong to anything, reusable once the
+// transaction freeing them is on disk
+static void freeBlocks(int start, int count){
+    dropImages(start,count);
+    freeMeta(start,count);
+}
+
+// puts blocks taken by the running operation straight back, nothing
+// committed can point at them
+static void returnBlocks(int start, int count){
+    lockAllocator();
+    markBlocks(start,count,false);
+    unlockAllocator();
+    dropImages(start,count);
+}
+
+// builds the in memory bitmap from the bitmap blocks of a disk
+static int loadBitmap(int diskNum, char* read_block){
+    int i, j, err_code;
+    fs->bitmapWords = (fs->totalBlocks + 63) / 64;
+    free(fs->blockBitmap);
+    fs->blockBitmap = (uint64_t*)calloc(fs->bitmapWords, sizeof(uint64_t));
+    free(fs->bitmapDirty);
+    fs->bitmapDirty = (char*)calloc(fs->bitmapBlocks, sizeof(char));
+    for (i=0;i<fs->bitmapBlocks;i++){
+        err_code = readBlock(diskNum,fs->bitmapStart+i,read_block);
+        if (err_code < 0){
+            return err_code;
+        }
+        if (read_block[0] != '6' || read_block[1] != MAGIC_NUMBER){
+            return ERR_INVALID_TINYFS;
+        }
+        for (j=0;j<BITMAP_BITS(fs->blockSize)/8;j++){
+            int byte = i*(BITMAP_BITS(fs->blockSize)/8) + j;
+            if (byte*8 >= fs->totalBlocks){
+                break;
             }
-            buffer[i+8] = inode; 
-            return 0;
+            fs->blockBitmap[byte >> 3] |= (uint64_t)(unsigned char)read_block[BITMAP_HEADER+j] << ((byte & 7) * 8);
         }
     }
-    // we can't find enough space in current dictionary
-    // TO-DO: extend the file extent
-    // as of now our directories don't grow yet
-    printf("oopsies - directory ran out of space");
-    return ERR_DIRECTORY_FULL;
+    // bits past the end of the disk never look free
+    for (i=fs->totalBlocks;i<fs->bitmapWords*64;i++){
+        fs->blockBitmap[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    return 0;
 }
 
-int addNewFile(char* name){
-
-    // inode
-    char* inode_block = malloc(BLOCKSIZE * sizeof(char));
-    char* read_block = malloc(BLOCKSIZE * sizeof(char));
-    int err_code;
+// fills block, size bytes long, with bitmap block number index of the bitmap in bits
+static void packBitmap(uint64_t* bits, int numBlocks, int index, char* block, int size){
+    int j;
+    memset(block,0x00,size);
+    block[0] = '6';
+    block[1] = MAGIC_NUMBER;
+    for (j=0;j<BITMAP_BITS(size)/8;j++){
+        int byte = index*(BITMAP_BITS(size)/8) + j;
+        if (byte*8 >= numBlocks){
+            break;
+        }
+        block[BITMAP_HEADER+j] = bits[byte >> 3] >> ((byte & 7) * 8);
+    }
+}
 
-    memset(inode_block,0x00,BLOCKSIZE);
-    inode_block[0] = '2';
-    inode_block[1] = MAGIC_NUMBER;
-    inode_block[2] = 0;
-    inode_block[3] = 0x00;  //empty   
+// adds the bitmap blocks that changed to the running transaction
+static void storeBitmap(void){
     int i;
+    char* write_block = (char*)malloc(fs->blockSize * sizeof(char));
+    lockAllocator();
+    for (i=0;i<fs->bitmapBlocks;i++){
+        if (fs->bitmapDirty[i]){
+            packBitmap(fs->blockBitmap,fs->totalBlocks,i,write_block,fs->blockSize);
+            metaWrite(fs->bitmapStart+i,write_block);
+            fs->bitmapDirty[i] = 0;
+        }
+    }
+    unlockAllocator();
+    free(write_block);
+}
 
-    // read from superblock
-    readBlock(mountedDiskNum,0,read_block);
-    int freeBlock = read_block[2]; // next free block
-    // check if disk is full
-    if (freeBlock == 0){
-        free(inode_block);
-        free(read_block);
-        return ERR_DISK_FULL;
+
+// JOURNAL COMMIT AND REPLAY
+
+// CRC32C over the block numbers and images of a group, seeded with its
+// transaction so a group left over from an older one never matches
+static unsigned int journalChecksum(unsigned int seq, char* desc, char* images, int count){
+    unsigned int h = crc32c(seq,desc + DESC_BLOCKS,(size_t)count*4);
+    return crc32c(h,images,(size_t)count*fs->blockSize);
+}
+
+// an empty log starting at journalSequence
+static int writeJournalHeader(void){
+    char* block = (char*)calloc(fs->blockSize, sizeof(char));
+    block[0] = '8';
+    block[1] = MAGIC_NUMBER;
+    putU32(block + JOURNAL_SEQUENCE, fs->journalSequence);
+    int err_code = writeBlock(fs->diskNum,fs->journalStart,block);
+    free(block);
+    if (err_code < 0){
+        return err_code;
     }
-    
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        free(inode_block);
-        free(read_block);
-        return ERR_DISK_FULL;
+    return syncDisk(fs->diskNum);
+}
+
+// writes everything committed in place and empties the log, then the
+// metadata freed by committed transactions can be reused
+static int checkpoint(void){
+    int i;
+    int err_code = 0;
+    lockAllocator();
+    if (fs->journalHead > 1){
+        err_code = cacheFlush(fs->diskNum);
+        if (err_code == 0){
+            err_code = syncDisk(fs->diskNum);
+        }
+        if (err_code == 0){
+            err_code = writeJournalHeader();
+        }
+        if (err_code == 0){
+            fs->journalHead = 1;
+        }
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
-    int subDir;
-    char* filename = (char *)malloc(9*sizeof(char));
-    int inode = searchForFile(name,read_block,filename);
-    if(inode < 0){
-        free(inode_block);
-        free(read_block);
-        return inode;
-    }else if (inode == 0){
-        readBlock(mountedDiskNum,cur_directory,read_block);
-        int dir_block = getRecentDirectory(name,read_block); 
-        if (dir_block == 0){
-            subDir = cur_directory;
-        }else if (dir_block< 0){
-            free(inode_block);
-            free(read_block);
-            return dir_block;
-        }else{
-            //readBlock(mountedDiskNum,dir_inode,read_block);
-            //subDir = read_block[2];
-            subDir = dir_block;
-        }   
-    }else{
-       return ERR_FILE_EXISTS; 
-    }   
+    if (err_code == 0){
+        for (i=0;i<fs->deferredCount;i++){
+            markBlocks(fs->deferred[i],1,false);
+        }
+        fs->deferredCount = 0;
+    }
+    unlockAllocator();
+    return err_code;
+}
 
-    // for directory implementation we are adding the filename
-    // the current directory is in read_block
-    readBlock(mountedDiskNum, subDir, read_block);    
+// sets the clean flag of the superblock and syncs it, everything
+// cached before goes with it
+static int setClean(char clean){
+    char* read_block = (char*)malloc(fs->blockSize * sizeof(char));
+    int err_code = cacheReadBlock(fs->diskNum,0,read_block);
+    if (err_code == 0){
+        read_block[SB_CLEAN] = clean;
+        err_code = cacheWriteBlock(fs->diskNum,0,read_block);
+    }
+    free(read_block);
+    if (err_code == 0){
+        err_code = cacheFlush(fs->diskNum);
+    }
+    if (err_code == 0){
+        err_code = syncDisk(fs->diskNum);
+    }
+    return err_code;
+}
 
-    addFileToBuffer(filename,read_block,freeBlock);
-    writeBlock(mountedDiskNum,subDir,read_block);
- 
-    for (i=0;i<8;i++){
-        if (filename[i] == '\0'){
-            break;
+// hands the images at picks of the running transaction to libCache
+static int installTx(int* picks, int count){
+    int i;
+    int err_code = 0;
+    for (i=0;i<count;i++){
+        TxBlock* t = &fs->txBlocks[picks[i]];
+        int e = cacheWriteBlock(fs->diskNum,t->bNum,t->data);
+        if (e < 0 && err_code == 0){
+            err_code = e;
         }
-        inode_block[4+i] = filename[i];
-    }   
-    inode_block[12] = 0; // size of the new file
+    }
+    return err_code;
+}
+
+// log blocks taken by count images, a descriptor for every DESC_ENTRIES
+static int logSize(int count){
+    return count + (count + DESC_ENTRIES - 1) / DESC_ENTRIES;
+}
 
-    // get the next free block to update in superblock
-    err_code = readBlock(mountedDiskNum,freeBlock,read_block);
+// the images at picks as groups of a descriptor and up to DESC_ENTRIES
+// blocks, written to the log after journalHead and synced
+static int logTx(int* picks, int live){
+    int bs = fs->blockSize;
+    int need = logSize(live);
+    int err_code = 0;
+    if (fs->journalHead + need > fs->journalBlocks){
+        err_code = checkpoint();
+        if (err_code < 0){
+            return err_code;
+        }
+    }
+    char* log = (char*)malloc((size_t)need * bs * sizeof(char));
+    int at = 0;
+    int i = 0;
+    int left = live;
+    int k;
+    while (left > 0){
+        int n = (left < DESC_ENTRIES) ? left : DESC_ENTRIES;
+        char* desc = log + (size_t)at*bs;
+        char* images = desc + bs;
+        memset(desc,0x00,bs);
+        desc[0] = '9';
+        desc[1] = MAGIC_NUMBER;
+        putU32(desc + DESC_SEQUENCE, fs->journalSequence);
+        putU32(desc + DESC_COUNT, n);
+        putU32(desc + DESC_MORE, left > n);
+        for (k=0;k<n;k++){
+            TxBlock* t = &fs->txBlocks[picks[i++]];
+            putU32(desc + DESC_BLOCKS + k*4, t->bNum);
+            memcpy(images + (size_t)k*bs,t->data,bs);
+        }
+        putU32(desc + DESC_CHECKSUM, journalChecksum(fs->journalSequence,desc,images,n));
+        at += 1 + n;
+        left -= n;
+    }
+    err_code = writeBlocks(fs->diskNum,fs->journalStart+fs->journalHead,need,log);
+    free(log);
+    if (err_code == 0){
+        err_code = syncDisk(fs->diskNum);
+    }
     if (err_code < 0){
-        free(inode_block);
-        free(read_block);
         return err_code;
     }
-    int nextBlock = read_block[2];
-    if (nextBlock == 0){
-        free(inode_block);
-        free(read_block);
-        return ERR_DISK_FULL;
+    fs->journalHead += need;
+    fs->journalSequence++;
+    return installTx(picks,live);
+}
+
+// true if bNum is free in the bitmap as last committed, so the running
+// transaction took it and nothing committed points at it
+static bool committedFree(int bNum, char* block){
+    int bytes = BITMAP_BITS(fs->blockSize) / 8;
+    int byte = bNum / 8;
+    if (cacheReadBlock(fs->diskNum,fs->bitmapStart + byte / bytes,block) < 0){
+        return false;
+    }
+    return ((block[BITMAP_HEADER + byte % bytes] >> (bNum & 7)) & 1) == 0;
+}
+
+// a transaction too big for the log goes in as several that fit, in an
+// order where a crash between two of them only leaves blocks marked in
+// use that nothing points at: the bitmap first, then the blocks the
+// transaction took, then the blocks that were already in use, in one
+// commit of their own when they fit. the superblock stays unclean
+// until the last is logged, so the next mount checks the whole tree
+// and frees what was left over
+static int splitTx(int* picks, int live){
+    int most = fs->journalBlocks - 1;
+    int i, n;
+    int front = 0;
+    while (logSize(most) > fs->journalBlocks - 1){
+        most--;
+    }
+    // bitmap blocks are first already, taken blocks go after them
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    for (i=0;i<live;i++){
+        int bNum = fs->txBlocks[picks[i]].bNum;
+        if ((bNum >= fs->bitmapStart && bNum < fs->bitmapStart + fs->bitmapBlocks)
+                || committedFree(bNum,block)){
+            int t = picks[front];
+            picks[front++] = picks[i];
+            picks[i] = t;
+        }
     }
+    free(block);
 
-    
-    // add the inode block
-    err_code = writeBlock(mountedDiskNum,freeBlock,inode_block);
+    int err_code = setClean(0);
+    for (i=0;i<live && err_code == 0;i+=n){
+        n = live - i;
+        if (i < front && n > front - i && live - front <= most){
+            // the blocks already in use go in together
+            n = front - i;
+        }
+        if (n > most){
+            n = most;
+        }
+        err_code = logTx(picks + i,n);
+    }
+    if (err_code == 0){
+        err_code = setClean(1);
+    }
+    return err_code;
+}
+
+// writes back and syncs the file data written since the last commit,
+// so a committed inode never points at blocks still holding old data
+static int flushData(void){
+    pthread_mutex_lock(&fs->txLock);
+    bool pending = fs->dataPending;
+    fs->dataPending = false;
+    pthread_mutex_unlock(&fs->txLock);
+    if (!pending){
+        return 0;
+    }
+    int err_code = cacheFlush(fs->diskNum);
+    if (err_code == 0){
+        err_code = syncDisk(fs->diskNum);
+    }
+    if (err_code < 0){
+        pthread_mutex_lock(&fs->txLock);
+        fs->dataPending = true;
+        pthread_mutex_unlock(&fs->txLock);
+    }
+    return err_code;
+}
+
+// makes the running transaction durable, the namespace lock is held
+// for writing so it holds whole operations only
+// the transaction is kept for another try if it can't be written
+static int commitTx(void){
+    int i;
+    int live = 0;
+    int err_code;
+    if (fs->diskNum == -1){
+        return ERR_DISK_CLOSED;
+    }
+    storeBitmap();
+    int* picks = (int*)malloc((fs->txCount + 1) * sizeof(int));
+    // bitmap blocks first, see splitTx
+    for (i=0;i<fs->txCount;i++){
+        int bNum = fs->txBlocks[i].bNum;
+        if (bNum >= fs->bitmapStart && bNum < fs->bitmapStart + fs->bitmapBlocks){
+            picks[live++] = i;
+        }
+    }
+    for (i=0;i<fs->txCount;i++){
+        int bNum = fs->txBlocks[i].bNum;
+        if (bNum != -1 && (bNum < fs->bitmapStart || bNum >= fs->bitmapStart + fs->bitmapBlocks)){
+            picks[live++] = i;
+        }
+    }
+    if (live == 0 && fs->txFreeCount == 0){
+        free(picks);
+        endTx();
+        return 0;
+    }
+    if (live == 0){
+        // only frees, nothing on disk points at them any more
+        err_code = 0;
+    }else{
+        // the file data the transaction points at goes first
+        err_code = flushData();
+        if (err_code < 0){
+            // keep it for the next try
+        }else if (logSize(live) > fs->journalBlocks - 1){
+            err_code = splitTx(picks,live);
+        }else{
+            err_code = logTx(picks,live);
+        }
+    }
+    free(picks);
     if (err_code < 0){
-        free(inode_block);
-        free(read_block);
         return err_code;
     }
-    
-    // update superblock  
-    err_code = readBlock(mountedDiskNum,0,read_block);
+    // what the transaction freed comes back at the next checkpoint
+    for (i=0;i<fs->txFreeCount;i++){
+        pushBlock(&fs->deferred,&fs->deferredCount,&fs->deferredCapacity,fs->txFrees[i]);
+    }
+    endTx();
+    if (fs->journalHead == 1){
+        // nothing in the log refers to them
+        return checkpoint();
+    }
+    return 0;
+}
+
+// commits and checkpoints until the log is empty and every freed block
+// is back in the bitmap on disk, the second commit holds the bitmap
+// blocks the first checkpoint changed
+static int settleJournal(void){
+    int err_code = commitTx();
+    if (err_code == 0){
+        err_code = checkpoint();
+    }
+    if (err_code == 0){
+        err_code = commitTx();
+    }
+    if (err_code == 0){
+        err_code = checkpoint();
+    }
+    return err_code;
+}
+
+// writes every complete transaction left in the log in place, oldest
+// first, and empties the log. a transaction is complete when each of
+// its groups has its sequence and a matching checksum and the last
+// group says it is the last
+static int replayJournal(void){
+    int bs = fs->blockSize;
+    char* desc = (char*)malloc(bs * sizeof(char));
+    char* images = NULL;
+    int* nums = NULL;
+    int pos = 1;
+    int replayed = 0;
+    bool complete = true;
+    int err_code = readBlock(fs->diskNum,fs->journalStart,desc);
+    if (err_code == 0 && (desc[0] != '8' || desc[1] != MAGIC_NUMBER)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    unsigned int seq = getU32(desc + JOURNAL_SEQUENCE);
+    while (err_code == 0 && complete){
+        int have = 0;
+        int at = pos;
+        int k;
+        complete = false;
+        while (at < fs->journalBlocks){
+            err_code = readBlock(fs->diskNum,fs->journalStart+at,desc);
+            if (err_code == ERR_CHECKSUM){
+                // torn on the way out, the log ends here
+                err_code = 0;
+                break;
+            }
+            if (err_code < 0){
+                break;
+            }
+            int count = getU32(desc + DESC_COUNT);
+            if (desc[0] != '9' || desc[1] != MAGIC_NUMBER || getU32(desc + DESC_SEQUENCE) != seq
+                    || count < 1 || count > DESC_ENTRIES || at + 1 + count > fs->journalBlocks){
+                break;
+            }
+            images = (char*)realloc(images, (size_t)(have+count) * bs * sizeof(char));
+            nums = (int*)realloc(nums, (have+count) * sizeof(int));
+            if (images == NULL || nums == NULL){
+                perror("malloc: ");
+                exit(1);
+            }
+            err_code = readBlocks(fs->diskNum,fs->journalStart+at+1,count,images + (size_t)have*bs);
+            if (err_code == ERR_CHECKSUM){
+                err_code = 0;
+                break;
+            }
+            if (err_code < 0){
+                break;
+            }
+            if (journalChecksum(seq,desc,images + (size_t)have*bs,count) != getU32(desc + DESC_CHECKSUM)){
+                break;
+            }
+            for (k=0;k<count;k++){
+                int bNum = getU32(desc + DESC_BLOCKS + k*4);
+                if (bNum <= 0 || bNum >= fs->totalBlocks
+                        || (bNum >= fs->journalStart && bNum < fs->journalStart + fs->journalBlocks)){
+                    break;
+                }
+                nums[have+k] = bNum;
+            }
+            if (k < count){
+                break;
+            }
+            have += count;
+            at += 1 + count;
+            if (getU32(desc + DESC_MORE) == 0){
+                complete = true;
+                break;
+            }
+        }
+        for (k=0;k<have && complete && err_code == 0;k++){
+            err_code = writeBlock(fs->diskNum,nums[k],images + (size_t)k*bs);
+        }
+        if (complete && err_code == 0){
+            pos = at;
+            seq++;
+            replayed++;
+        }
+    }
+    free(desc);
+    free(images);
+    free(nums);
     if (err_code < 0){
-        free(inode_block);
-        free(read_block);
         return err_code;
     }
-    read_block[2] = nextBlock;
-    err_code = writeBlock(mountedDiskNum,0,read_block);
+    fs->journalSequence = seq;
+    fs->journalHead = 1;
+    if (replayed > 0){
+        err_code = syncDisk(fs->diskNum);
+        if (err_code == 0){
+            err_code = writeJournalHeader();
+        }
+    }
+    return err_code;
+}
+
+
+// DURABILITY
+// under TFS_DURABLE_NONE changes reach the disk when the journal
+// commits on its own, on tfs_sync, tfs_syncfs and tfs_unmount. under
+// TFS_DURABLE_SYNC every call that changes the disk commits and syncs
+// before it returns. under TFS_DURABLE_GROUP a flusher thread syncs
+// syncMs after the first unsynced write, or as soon as syncBlocks
+// blocks are waiting, so the writes in between share one sync
+// metadata blocks count when they join the transaction, file data
+// when it is written
+
+static void noteWritesLocked(int count){
+    if (fs->unsynced == 0){
+        clock_gettime(CLOCK_MONOTONIC,&fs->firstUnsynced);
+    }
+    fs->unsynced += count;
+    if (fs->durability == TFS_DURABLE_GROUP
+            && (fs->unsynced == count || fs->unsynced >= fs->syncBlocks)){
+        pthread_cond_signal(&fs->syncCond);
+    }
+}
+
+static void noteWrites(int count){
+    pthread_mutex_lock(&fs->txLock);
+    noteWritesLocked(count);
+    fs->dataPending = true;
+    pthread_mutex_unlock(&fs->txLock);
+}
+
+// file data goes straight to libCache
+static int dataWrite(int bNum, char* block){
+    noteWrites(1);
+    return cacheWriteBlock(fs->diskNum,bNum,block);
+}
+
+static int dataWriteBlocks(int bNum, int count, char* buf){
+    noteWrites(count);
+    return cacheWriteBlocks(fs->diskNum,bNum,count,buf);
+}
+
+static int dataWriteBlocksv(int bNum, int count, const struct iovec* iov, int iovcnt){
+    noteWrites(count);
+    return cacheWriteBlocksv(fs->diskNum,bNum,iov,iovcnt);
+}
+
+// makes everything written so far durable, file data first so the
+// metadata committed after it never points at blocks not written yet
+// the namespace lock is held for writing
+static int syncNow(void){
+    int err_code = cacheFlush(fs->diskNum);
+    if (err_code == 0){
+        err_code = commitTx();
+    }
+    if (err_code == 0){
+        err_code = syncDisk(fs->diskNum);
+    }
+    pthread_mutex_lock(&fs->txLock);
+    if (err_code == 0){
+        fs->unsynced = 0;
+    }else{
+        // try again syncMs from now
+        clock_gettime(CLOCK_MONOTONIC,&fs->firstUnsynced);
+    }
+    pthread_mutex_unlock(&fs->txLock);
+    return err_code;
+}
+
+static void* flusher(void* arg){
+    useCtx((tfs_ctx*)arg);
+    pthread_mutex_lock(&fs->txLock);
+    while (!fs->flusherStop){
+        if (fs->unsynced == 0){
+            pthread_cond_wait(&fs->syncCond,&fs->txLock);
+            continue;
+        }
+        struct timespec due = fs->firstUnsynced;
+        struct timespec now;
+        due.tv_sec += fs->syncMs / 1000;
+        due.tv_nsec += (long)(fs->syncMs % 1000) * 1000000;
+        if (due.tv_nsec >= 1000000000){
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        if (fs->unsynced < fs->syncBlocks && (now.tv_sec < due.tv_sec
+                || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec))){
+            pthread_cond_timedwait(&fs->syncCond,&fs->txLock,&due);
+            continue;
+        }
+        pthread_mutex_unlock(&fs->txLock);
+        lockNamespace(true);
+        syncNow();
+        unlockNamespace();
+        pthread_mutex_lock(&fs->txLock);
+    }
+    pthread_mutex_unlock(&fs->txLock);
+    return NULL;
+}
+
+// the flusher runs while a disk is mounted under TFS_DURABLE_GROUP
+// flusherLock is held by the callers of both, and no namespace lock
+static void startFlusher(tfs_ctx* ctx){
+    if (ctx->flusherRunning || ctx->diskNum == -1 || ctx->durability != TFS_DURABLE_GROUP){
+        return;
+    }
+    ctx->flusherStop = false;
+    if (pthread_create(&ctx->flusher,NULL,flusher,ctx) == 0){
+        ctx->flusherRunning = true;
+    }
+}
+
+static void stopFlusher(tfs_ctx* ctx){
+    if (!ctx->flusherRunning){
+        return;
+    }
+    pthread_mutex_lock(&ctx->txLock);
+    ctx->flusherStop = true;
+    pthread_cond_signal(&ctx->syncCond);
+    pthread_mutex_unlock(&ctx->txLock);
+    pthread_join(ctx->flusher,NULL);
+    ctx->flusherRunning = false;
+}
+
+
+// file pointer as stored in the inode
+static int getStoredPointer(char* inode_block){
+    return getU32(inode_block + INODE_CURSOR);
+}
+
+static void setStoredPointer(char* inode_block, int offset){
+    putU32(inode_block + INODE_CURSOR, offset);
+}
+
+
+// FILE EXTENT MAP
+typedef struct Run{
+    int start; // first block of the run
+    int len; // number of blocks
+}Run;
+
+// reads the extent map of the inode into a malloc'd array
+// returns the number of runs
+static int loadRuns(char* inode_block, Run** runs){
+    int count = getU32(inode_block + INODE_RUNS);
+    int indirect = getU32(inode_block + INODE_INDIRECT);
+    char* block = NULL;
+    char* entry;
+    int i, err_code;
+
+    if (count < 0 || count > fs->totalBlocks){
+        return ERR_INVALID_TINYFS;
+    }
+    Run* map = (Run*)malloc((count + 1) * sizeof(Run));
+    for (i=0;i<count;i++){
+        if (i < DIRECT_RUNS){
+            entry = inode_block + INODE_MAP + i*RUN_SIZE;
+        }else{
+            int j = (i - DIRECT_RUNS) % INDIRECT_RUNS;
+            if (j == 0){
+                if (block == NULL){
+                    block = (char*)malloc(fs->blockSize * sizeof(char));
+                }
+                err_code = (indirect == 0) ? ERR_INVALID_TINYFS : metaRead(indirect,block);
+                if (err_code < 0){
+                    free(block);
+                    free(map);
+                    return err_code;
+                }
+                indirect = getU32(block + INDIRECT_NEXT);
+            }
+            entry = block + INDIRECT_HEADER + j*RUN_SIZE;
+        }
+        map[i].start = getU32(entry);
+        map[i].len = getU32(entry + 4);
+    }
+    free(block);
+    *runs = map;
+    return count;
+}
+
+// gives the indirect blocks of the inode back to the bitmap
+static int freeIndirect(char* inode_block){
+    int indirect = getU32(inode_block + INODE_INDIRECT);
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    int err_code = 0;
+    while (indirect != 0 && err_code == 0){
+        freeMeta(indirect,1);
+        err_code = metaRead(indirect,block);
+        indirect = getU32(block + INDIRECT_NEXT);
+    }
+    free(block);
+    putU32(inode_block + INODE_INDIRECT, 0);
+    return err_code;
+}
+
+// writes runs into the extent map of the inode block, the caller
+// writes the inode itself
+// new indirect blocks are taken before the old ones are given back
+// so a full disk leaves the old map in place
+static int storeRuns(char* inode_block, Run* runs, int count){
+    int needed = 0;
+    int i, j, k, err_code;
+    if (count > DIRECT_RUNS){
+        needed = (count - DIRECT_RUNS + INDIRECT_RUNS - 1) / INDIRECT_RUNS;
+    }
+    int* chain = (int*)malloc((needed + 1) * sizeof(int));
+    for (k=0;k<needed;k++){
+        chain[k] = allocBlockNear(k == 0 ? runs[DIRECT_RUNS].start : chain[k-1]);
+        if (chain[k] < 0){
+            err_code = chain[k];
+            for (j=0;j<k;j++){
+                freeBlocks(chain[j],1);
+            }
+            free(chain);
+            return err_code;
+        }
+    }
+    chain[needed] = 0;
+    err_code = freeIndirect(inode_block);
+    if (err_code < 0){
+        free(chain);
+        return err_code;
+    }
+
+    for (i=0;i<count && i<DIRECT_RUNS;i++){
+        putU32(inode_block + INODE_MAP + i*RUN_SIZE, runs[i].start);
+        putU32(inode_block + INODE_MAP + i*RUN_SIZE + 4, runs[i].len);
+    }
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    for (k=0;k<needed;k++){
+        memset(block,0x00,fs->blockSize);
+        block[0] = '7';
+        block[1] = MAGIC_NUMBER;
+        putU32(block + INDIRECT_NEXT, chain[k+1]);
+        for (j=0;j<INDIRECT_RUNS && i<count;j++,i++){
+            putU32(block + INDIRECT_HEADER + j*RUN_SIZE, runs[i].start);
+            putU32(block + INDIRECT_HEADER + j*RUN_SIZE + 4, runs[i].len);
+        }
+        err_code = metaWrite(chain[k],block);
+        if (err_code < 0){
+            break;
+        }
+    }
+    putU32(inode_block + INODE_RUNS, count);
+    putU32(inode_block + INODE_INDIRECT, chain[0]);
+    free(block);
+    free(chain);
+    return err_code;
+}
+
+// takes count data blocks for a file in as few runs as the bitmap
+// allows, starting the search at goal
+// returns the number of runs put in the malloc'd array
+static int allocRuns(int goal, int count, Run** runs){
+    Run* map = (Run*)malloc((count + 1) * sizeof(Run));
+    int num = 0;
+    int got = 0;
+    int i;
+    while (got < count){
+        int start;
+        int len = allocBlocksNear(goal, count - got, &start);
+        if (len < 0){
+            // writeAll lends the old runs of the file to this search,
+            // what was found goes back at once so they can be taken
+            // back too
+            for (i=0;i<num;i++){
+                returnBlocks(map[i].start,map[i].len);
+            }
+            free(map);
+            return len;
+        }
+        map[num].start = start;
+        map[num].len = len;
+        num++;
+        got += len;
+        goal = start + len;
+    }
+    *runs = map;
+    return num;
+}
+
+// grows or shrinks the extent map to hold blocks data blocks
+// blocks past the new end go back to the bitmap, new ones are taken
+// right after the last run (or from goal for an empty file) and their
+// contents are left to the caller
+static int resizeRuns(Run** runs, int* count, int blocks, int goal){
+    Run* map = *runs;
+    int num = *count;
+    int have = 0;
+    int i;
+    for (i=0;i<num;i++){
+        have += map[i].len;
+    }
+    if (blocks < have){
+        int keep = 0;
+        int total = 0;
+        while (total < blocks){
+            total += map[keep].len;
+            keep++;
+        }
+        if (total > blocks){
+            // cut the last run we keep
+            int cut = total - blocks;
+            freeBlocks(map[keep-1].start + map[keep-1].len - cut, cut);
+            map[keep-1].len -= cut;
+        }
+        for (i=keep;i<num;i++){
+            freeBlocks(map[i].start,map[i].len);
+        }
+        *count = keep;
+    }else if (blocks > have){
+        Run* more;
+        if (num > 0){
+            goal = map[num-1].start + map[num-1].len;
+        }
+        int added = allocRuns(goal, blocks - have, &more);
+        if (added < 0){
+            return added;
+        }
+        map = (Run*)realloc(map, (num + added + 1) * sizeof(Run));
+        for (i=0;i<added;i++){
+            if (num > 0 && map[num-1].start + map[num-1].len == more[i].start){
+                map[num-1].len += more[i].len;
+            }else{
+                map[num++] = more[i];
+            }
+        }
+        free(more);
+        *runs = map;
+        *count = num;
+    }
+    return 0;
+}
+
+// finds the run holding block fileBlock of the file
+// searching from run index, which starts at file block *first
+// returns the run index, *first is updated to match
+static int findRun(Run* runs, int count, int fileBlock, int index, int* first){
+    if (index < 0 || index >= count || *first > fileBlock){
+        index = 0;
+        *first = 0;
+    }
+    while (index < count && fileBlock >= *first + runs[index].len){
+        *first += runs[index].len;
+        index++;
+    }
+    if (index >= count){
+        return ERR_INVALID_TINYFS;
+    }
+    return index;
+}
+
+// moves the data of an inline file into a block of its own so the file
+// can grow past INLINE_MAX, the caller writes the inode
+// returns the number of data blocks the file has now
+static int spillInline(char* inode_block, int file_size, Run** runs, int* count, int goal){
+    if (file_size == 0){
+        return 0;
+    }
+    int err_code = resizeRuns(runs,count,1,goal);
+    if (err_code < 0){
+        return err_code;
+    }
+    char* block = (char*)calloc(fs->blockSize, sizeof(char));
+    memcpy(block, inode_block + INODE_MAP, file_size);
+    err_code = dataWrite((*runs)[0].start,block);
+    free(block);
+    if (err_code < 0){
+        resizeRuns(runs,count,0,0);
+        return err_code;
+    }
+    memset(inode_block + INODE_MAP, 0x00, INLINE_MAX);
+    return 1;
+}
+
+
+// DIRECTORY INDEX
+// a directory is an extendible hash table: its inode holds a table of
+// 2^depth leaf blocks, stored like the data of a file (inline while it
+// fits), and name lives in the leaf of slot dirHash(name) mod 2^depth.
+// a leaf of local depth L is shared by the slots that agree on their
+// low L bits, when it fills up it is split in two on bit L, doubling
+// the table first if L is its depth. leaves are never merged
+#define DIR_MAX_DEPTH 20
+
+// depth of the table of a directory inode
+static int tableDepth(char* inode_block){
+    int slots = getU32(inode_block + INODE_SIZE) / 4;
+    int depth = 0;
+    while ((1 << depth) < slots){
+        depth++;
+    }
+    return depth;
+}
+
+// reads the table of a directory inode into a malloc'd array
+// returns the number of slots
+static int loadTable(char* inode_block, int** table){
+    int size = getU32(inode_block + INODE_SIZE);
+    int slots = size / 4;
+    int i, k, err_code = 0;
+    if (size <= INLINE_MAX){
+        int* map = (int*)malloc((slots + 1) * sizeof(int));
+        for (i=0;i<slots;i++){
+            map[i] = getU32(inode_block + INODE_MAP + i*4);
+        }
+        *table = map;
+        return slots;
+    }
+    Run* runs;
+    int count = loadRuns(inode_block,&runs);
+    if (count < 0){
+        return count;
+    }
+    // one read per run, the table is a whole number of blocks
+    char* data = (char*)malloc(size * sizeof(char));
+    int done = 0;
+    for (k=0;k<count && err_code == 0;k++){
+        if (done + runs[k].len > size / fs->blockSize){
+            err_code = ERR_INVALID_TINYFS;
+            break;
+        }
+        err_code = metaReadBlocks(runs[k].start,runs[k].len,data + done*fs->blockSize);
+        done += runs[k].len;
+    }
+    free(runs);
+    if (err_code == 0 && done != size / fs->blockSize){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    if (err_code < 0){
+        free(data);
+        return err_code;
+    }
+    int* map = (int*)malloc((slots + 1) * sizeof(int));
+    for (i=0;i<slots;i++){
+        map[i] = getU32(data + i*4);
+    }
+    free(data);
+    *table = map;
+    return slots;
+}
+
+// reads slot of the table, or points it at leaf when leaf is not 0
+// an inline table is changed in inode_block, the caller writes it
+// returns the leaf block of the slot
+static int tableSlot(char* inode_block, int slot, int leaf){
+    int pos = slot * 4;
+    if ((int)getU32(inode_block + INODE_SIZE) <= INLINE_MAX){
+        if (leaf != 0){
+            putU32(inode_block + INODE_MAP + pos, leaf);
+        }
+        return getU32(inode_block + INODE_MAP + pos);
+    }
+    Run* runs;
+    int first = 0;
+    int count = loadRuns(inode_block,&runs);
+    if (count < 0){
+        return count;
+    }
+    int index = findRun(runs,count,pos / fs->blockSize,0,&first);
+    int bNum = (index < 0) ? 0 : runs[index].start + pos / fs->blockSize - first;
+    free(runs);
+    if (index < 0){
+        return index;
+    }
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    int err_code = metaRead(bNum,block);
+    if (err_code == 0 && leaf != 0){
+        putU32(block + pos % fs->blockSize, leaf);
+        err_code = metaWrite(bNum,block);
+    }
+    int result = (err_code < 0) ? err_code : (int)getU32(block + pos % fs->blockSize);
+    free(block);
+    return result;
+}
+
+// doubles the table of a directory inode, the new half is a copy of
+// the old one, the caller writes the inode
+// goal is where to look for blocks if the table was inline
+static int doubleTable(char* inode_block, int goal){
+    int size = getU32(inode_block + INODE_SIZE);
+    int i, k, err_code = 0;
+    if (2 * size <= INLINE_MAX){
+        memcpy(inode_block + INODE_MAP + size, inode_block + INODE_MAP, size);
+        putU32(inode_block + INODE_SIZE, 2 * size);
+        return 0;
+    }
+    int* table;
+    int slots = loadTable(inode_block,&table);
+    if (slots < 0){
+        return slots;
+    }
+    Run* runs;
+    int count = loadRuns(inode_block,&runs);
+    if (count < 0){
+        free(table);
+        return count;
+    }
+    // an inline table is at most half a block, so both halves
+    // together are always a whole number of blocks
+    int blocks = (size <= INLINE_MAX) ? 0 : size / fs->blockSize;
+    int grown = 2 * size / fs->blockSize;
+    err_code = resizeRuns(&runs,&count,grown,goal);
+    if (err_code < 0){
+        free(runs);
+        free(table);
+        return err_code;
+    }
+    char* data = (char*)malloc(grown * fs->blockSize * sizeof(char));
+    for (i=0;i<2*slots;i++){
+        putU32(data + i*4, table[i % slots]);
+    }
+    free(table);
+
+    // only the blocks past the old table are written
+    int first = 0;
+    for (k=0;k<count && err_code == 0;k++){
+        int skip = (blocks > first) ? blocks - first : 0;
+        if (skip < runs[k].len){
+            err_code = metaWriteBlocks(runs[k].start + skip,runs[k].len - skip,data + (first + skip)*fs->blockSize);
+        }
+        first += runs[k].len;
+    }
+    free(data);
+    if (err_code == 0){
+        err_code = storeRuns(inode_block,runs,count);
+    }
+    if (err_code < 0){
+        resizeRuns(&runs,&count,blocks,0);
+        free(runs);
+        return err_code;
+    }
+    free(runs);
+    if (blocks == 0){
+        memset(inode_block + INODE_MAP + RUN_SIZE, 0x00, INLINE_MAX - RUN_SIZE);
+    }
+    putU32(inode_block + INODE_SIZE, 2 * size);
+    return 0;
+}
+
+
+// libTiny function implementation
+
+
+// this overwrites any existing files
+// with the same name
+// layout: superblock, allocation bitmap, journal, root inode, root directory
+int tfs_mkfs(char* filename, int nBytes){
+    return tfs_mkfsBlockSize(filename, nBytes, BLOCKSIZE);
+}
+
+// size is a power of two from 256 bytes to 64 KB
+int tfs_mkfsBlockSize(char* filename, int nBytes, int size){
+    if (size < DISK_MIN_BLOCKSIZE || size > DISK_MAX_BLOCKSIZE || (size & (size - 1)) != 0){
+        return ERR_BLOCKSIZE;
+    }
+    int numBlocks = ((nBytes - (nBytes % size)) / size);
+    int numBitmap = (numBlocks + BITMAP_BITS(size) - 1) / BITMAP_BITS(size);
+    int numJournal = numBlocks / 32;
+    if (numJournal > JOURNAL_MAX_BYTES / size){
+        numJournal = JOURNAL_MAX_BYTES / size;
+    }
+    if (numJournal < JOURNAL_MIN){
+        numJournal = JOURNAL_MIN;
+    }
+    int rootInode = 1 + numBitmap + numJournal;
+    int rootDir = rootInode + 1;
+    int err_code;
+    int i;
+
+    if (numBlocks < rootDir + 1){
+        return ERR_DISK_SMALL;
+    }
+    int diskNum = openDisk(filename,numBlocks*size);
+    if (diskNum < 0){
+        return diskNum;
+    }
+    err_code = setDiskBlockSize(diskNum,size);
+    if (err_code == 0){
+        // blocks left from an earlier image would fail their checksums
+        err_code = eraseDisk(diskNum);
+    }
+    if (err_code < 0){
+        closeDisk(diskNum);
+        return err_code;
+    }
+    char* write_block = malloc(size * sizeof(char));
+    uint64_t* bits = (uint64_t*)calloc((numBlocks + 63) / 64, sizeof(uint64_t));
+
+    // free blocks are only marked in the bitmap, writing
+    // the last one makes the image its full size
+    memset(write_block,0x00,size);
+    err_code = writeBlock(diskNum,numBlocks-1,write_block);
+    if (err_code < 0){
+        free(write_block);
+        free(bits);
+        closeDisk(diskNum);
+        return err_code; 
+    }
+
+    // set the superblock
+    memset(write_block,0x00,size);
+    write_block[0] = '0';
+    write_block[1] = MAGIC_NUMBER;
+    write_block[SB_CLEAN] = 1;  //nothing to check on a quick mount
+    write_block[4] = MAGIC_NUMBER;//magic number
+    putU32(write_block + SB_VERSION, FORMAT_VERSION);
+    putU32(write_block + SB_ROOT_INODE, rootInode);//pointer to root inode directory
+    putU32(write_block + SB_NUM_BLOCKS, numBlocks); //size of the disk
+    putU32(write_block + SB_BITMAP_START, 1); //first bitmap block
+    putU32(write_block + SB_BITMAP_BLOCKS, numBitmap);
+    putU32(write_block + SB_BLOCK_SIZE, size);
+    putU32(write_block + SB_JOURNAL_START, 1 + numBitmap);
+    putU32(write_block + SB_JOURNAL_BLOCKS, numJournal);
+    err_code = writeBlock(diskNum,0,write_block);
+
+    // an empty journal, nothing left over in the log can look valid
+    memset(write_block,0x00,size);
+    for (i=1;i<numJournal && err_code == 0;i++){
+        err_code = writeBlock(diskNum,1+numBitmap+i,write_block);
+    }
+    if (err_code == 0){
+        write_block[0] = '8';
+        write_block[1] = MAGIC_NUMBER;
+        putU32(write_block + JOURNAL_SEQUENCE, 1);
+        err_code = writeBlock(diskNum,1+numBitmap,write_block);
+    }
+
+    // the bitmap has the superblock, itself, the journal and the root in use
+    for (i=0;i<=rootDir;i++){
+        bits[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    for (i=0;i<numBitmap && err_code == 0;i++){
+        packBitmap(bits,numBlocks,i,write_block,size);
+        err_code = writeBlock(diskNum,1+i,write_block);
+    }
+
+    //set the root_directory_inode
+    if (err_code == 0){
+        memset(write_block,0x00,size);
+        write_block[0] = '5';
+        write_block[1] = MAGIC_NUMBER;
+        putU32(write_block + INODE_SIZE, 4); // a table of one slot
+        putU32(write_block + INODE_MAP, rootDir); // pointing at the only leaf
+        write_block[INODE_NAME] = '/'; // name of directory
+        err_code = writeBlock(diskNum,rootInode,write_block);
+    }
+
+    //set the root directory leaf
+    if (err_code == 0){
+        memset(write_block,0x00,size);
+        write_block[0] = '3';
+        write_block[1] = MAGIC_NUMBER;
+        err_code = writeBlock(diskNum,rootDir,write_block);
+    }
+    free(write_block);
+    free(bits);
+    if (err_code < 0){
+        closeDisk(diskNum);
+        return err_code;
+    }
+
+    // the disk is set up
+    // lets close it for now
+    err_code = closeDisk(diskNum);
+    if (err_code < 0){
+        return err_code;
+    }
+    return SUCCESS;
+}
+
+// FULL MOUNT CHECK
+// walks the directory tree from the root inode and claims every block
+// it reaches: metadata has to carry its type and the magic number,
+// no block may be reached twice and every block has to be in use in
+// the bitmap. blocks in use that nothing reaches are given back
+
+// marks a run of blocks as reached
+static int claimBlocks(uint64_t* seen, int start, int len){
+    int b;
+    if (start <= 0 || len <= 0 || start > fs->totalBlocks - len){
+        return ERR_INVALID_TINYFS;
+    }
+    for (b=start;b<start+len;b++){
+        if (((seen[b >> 6] >> (b & 63)) & 1) || !blockInUse(b)){
+            return ERR_INVALID_TINYFS;
+        }
+        seen[b >> 6] |= (uint64_t)1 << (b & 63);
+    }
+    return 0;
+}
+
+// reads a metadata block after claiming it and checks its type
+static int claimMeta(uint64_t* seen, int bNum, char* block, char type){
+    int err_code = claimBlocks(seen,bNum,1);
+    if (err_code == 0){
+        err_code = metaRead(bNum,block);
+    }
+    if (err_code == 0 && (block[0] != type || block[1] != MAGIC_NUMBER)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    return err_code;
+}
+
+static int checkFile(uint64_t* seen, char* inode_block){
+    Run* runs;
+    int count = loadRuns(inode_block,&runs);
+    int blocks = 0;
+    int i, err_code = 0;
+    if (count < 0){
+        return count;
+    }
+    for (i=0;i<count && err_code == 0;i++){
+        err_code = claimBlocks(seen,runs[i].start,runs[i].len);
+        blocks += runs[i].len;
+    }
+    free(runs);
+    int size = getU32(inode_block + INODE_SIZE);
+    if (err_code == 0 && blocks != ((size <= INLINE_MAX) ? 0 : (size + fs->blockSize - 1) / fs->blockSize)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    // and the indirect blocks holding the runs
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    int indirect = getU32(inode_block + INODE_INDIRECT);
+    while (err_code == 0 && indirect != 0){
+        err_code = claimMeta(seen,indirect,block,'7');
+        indirect = getU32(block + INDIRECT_NEXT);
+    }
+    free(block);
+    return err_code;
+}
+
+// claims every leaf of a directory once and checks that the slots
+// sharing a leaf agree with its depth and that every entry is in the
+// right leaf, the leaves are put in a malloc'd array
+// returns the number of leaves
+static int checkTable(uint64_t* seen, char* inode_block, int** leaves){
+    int* table;
+    int slots = loadTable(inode_block,&table);
+    int depth = tableDepth(inode_block);
+    int num = 0;
+    int entries = 0;
+    int i, slot, err_code = 0;
+    char name[DIR_NAME_LEN+1];
+    if (slots < 0){
+        return slots;
+    }
+    if (slots != (1 << depth) || depth > DIR_MAX_DEPTH){
+        free(table);
+        return ERR_INVALID_TINYFS;
+    }
+    int* map = (int*)malloc((slots + 1) * sizeof(int));
+    char* leaf = (char*)malloc(fs->blockSize * sizeof(char));
+    for (slot=0;slot<slots && err_code == 0;slot++){
+        if (table[slot] <= 0 || table[slot] >= fs->totalBlocks){
+            err_code = ERR_INVALID_TINYFS;
+            break;
+        }
+        err_code = metaRead(table[slot],leaf);
+        int local = leaf[DIR_DEPTH];
+        if (err_code == 0 && (local < 0 || local > depth || table[slot] != table[slot & ((1 << local) - 1)])){
+            err_code = ERR_INVALID_TINYFS;
+        }
+        if (err_code < 0 || slot >= (1 << local)){
+            continue;
+        }
+        err_code = claimMeta(seen,table[slot],leaf,'3');
+        for (i = dirNextEntry(leaf,fs->blockSize,0); i >= 0 && err_code == 0; i = dirNextEntry(leaf,fs->blockSize,i)){
+            dirEntryName(leaf,i,name);
+            if ((int)(dirHash(name) & ((1u << local) - 1)) != slot){
+                err_code = ERR_INVALID_TINYFS;
+            }
+            entries++;
+        }
+        map[num++] = table[slot];
+    }
+    free(leaf);
+    free(table);
+    if (err_code == 0 && entries != (int)getU32(inode_block + INODE_ENTRIES)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    if (err_code < 0){
+        free(map);
+        return err_code;
+    }
+    *leaves = map;
+    return num;
+}
+
+static int checkInode(uint64_t* seen, int inode){
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    int err_code = claimBlocks(seen,inode,1);
+    int i;
+    if (err_code == 0){
+        err_code = metaRead(inode,inode_block);
+    }
+    if (err_code == 0 && inode_block[1] != MAGIC_NUMBER){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    if (err_code == 0 && inode_block[0] == '2'){
+        err_code = checkFile(seen,inode_block);
+    }else if (err_code == 0 && inode_block[0] == '5'){
+        // a directory, its table is kept like file data, then
+        // every entry of every leaf is checked in turn
+        int* leaves;
+        int num = 0;
+        int k;
+        err_code = checkFile(seen,inode_block);
+        if (err_code == 0){
+            num = checkTable(seen,inode_block,&leaves);
+            err_code = (num < 0) ? num : 0;
+        }
+        for (k=0;k<num && err_code == 0;k++){
+            err_code = metaRead(leaves[k],inode_block);
+            for (i = dirNextEntry(inode_block,fs->blockSize,0); i >= 0 && err_code == 0; i = dirNextEntry(inode_block,fs->blockSize,i)){
+                err_code = checkInode(seen,dirEntryInode(inode_block,i));
+            }
+        }
+        if (num > 0){
+            free(leaves);
+        }
+    }else if (err_code == 0){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    free(inode_block);
+    return err_code;
+}
+
+static int checkTree(int rootInode){
+    uint64_t* seen = (uint64_t*)calloc(fs->bitmapWords, sizeof(uint64_t));
+    int i;
+    // the superblock, the bitmap and the journal are always in use
+    for (i=0;i<fs->journalStart+fs->journalBlocks;i++){
+        seen[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    int err_code = checkInode(seen,rootInode);
+    if (err_code == 0){
+        for (i=0;i<fs->totalBlocks;i++){
+            if (blockInUse(i) && !((seen[i >> 6] >> (i & 63)) & 1)){
+                freeBlocks(i,1);
+            }
+        }
+    }
+    free(seen);
+    return err_code;
+}
+
+int tfs_mount(char* diskname){
+    return tfs_mountMode(diskname, TFS_MOUNT_QUICK);
+}
+
+// a quick mount replays the journal and loads the bitmap, a full
+// mount also checks the whole tree, and so does a quick one when the
+// clean flag says a write in place was cut short
+static int mountDisk(char* diskname, int mode){
+    char* read_block;
+    int diskNum; 
+    int err_code;
+    int clean;
+    int rootInode;
+
+    if (fs->diskNum != -1){
+        return ERR_DISK_MOUNTED;
+    }    
+    // another context has it mounted
+    tfs_ctx* other;
+    for (other=mountedCtxs;other!=NULL;other=other->next){
+        if (strcmp(other->diskName,diskname) == 0){
+            return ERR_DISK_MOUNTED;
+        }
+    }
+
+    diskNum = openDisk(diskname, 0); 
+    if (diskNum < 0){
+        return diskNum;
+    }
+    //lets read the superblock, it fits in the smallest block size
+    read_block = malloc(DISK_MIN_BLOCKSIZE * sizeof(char));
+    err_code = readBlock(diskNum,0,read_block);
+    if (err_code == ERR_CHECKSUM){
+        // it is sealed with the block size it records, which isn't
+        // known yet, the whole block is checked once it is
+        err_code = 0;
+    }
+    if (err_code == 0 && (read_block[1] != MAGIC_NUMBER || read_block[0] != '0')){
+        err_code = ERR_INVALID_TINYFS; 
+    }
+    if (err_code < 0){
+        free(read_block);
+        closeDisk(diskNum);
+        return err_code;
+    }
+    // images from before the version field read as 0 or 1 here
+    if (getU32(read_block + SB_VERSION) != FORMAT_VERSION){
+        free(read_block);
+        closeDisk(diskNum);
+        return ERR_OLD_FORMAT;
+    }
+    fs->blockSize = getU32(read_block + SB_BLOCK_SIZE);
+    if (setDiskBlockSize(diskNum,fs->blockSize) < 0){
+        free(read_block);
+        closeDisk(diskNum);
+        return ERR_INVALID_TINYFS;
+    }
+    clean = read_block[SB_CLEAN];
+    rootInode = getU32(read_block + SB_ROOT_INODE);
+    fs->totalBlocks = getU32(read_block + SB_NUM_BLOCKS);
+    fs->bitmapStart = getU32(read_block + SB_BITMAP_START);
+    fs->bitmapBlocks = getU32(read_block + SB_BITMAP_BLOCKS);
+    fs->journalStart = getU32(read_block + SB_JOURNAL_START);
+    fs->journalBlocks = getU32(read_block + SB_JOURNAL_BLOCKS);
+    if (fs->totalBlocks <= 0 || fs->bitmapStart <= 0 || fs->bitmapBlocks <= 0
+        || (long)fs->bitmapBlocks * BITMAP_BITS(fs->blockSize) < fs->totalBlocks
+        || fs->bitmapStart + fs->bitmapBlocks > fs->totalBlocks
+        || fs->journalStart != fs->bitmapStart + fs->bitmapBlocks
+        || fs->journalBlocks < JOURNAL_MIN || fs->journalBlocks > fs->totalBlocks - fs->journalStart
+        || (long)fs->totalBlocks * fs->blockSize > 0x7fffffff){
+        free(read_block);
+        closeDisk(diskNum);
+        return ERR_INVALID_TINYFS;
+    }
+    free(read_block);
+    read_block = malloc(fs->blockSize * sizeof(char));
+
+    // the superblock against its checksum, and the image has to hold
+    // every block, a damaged last block only fails when it is used
+    err_code = readBlock(diskNum,0,read_block);
+    if (err_code == 0){
+        err_code = readBlock(diskNum,fs->totalBlocks-1,read_block);
+        if (err_code == ERR_CHECKSUM){
+            err_code = 0;
+        }
+    }
+    if (err_code < 0){
+        free(read_block);
+        closeDisk(diskNum);
+        return err_code;
+    }
+
+    // ok now we know the disk size
+    // reopen disk for writing
+    err_code = closeDisk(diskNum);
+    if (err_code < 0){
+        free(read_block);
+        return err_code;
+    }
+    diskNum = openDisk(diskname, fs->totalBlocks*fs->blockSize);
+    if (diskNum < 0){
+        free(read_block);
+        return diskNum;
+    }
+    setDiskBlockSize(diskNum,fs->blockSize);
+    // nothing cached under this disk number is valid for this image
+    cacheInvalidate(diskNum);
+    fs->diskNum = diskNum;
+
+    // finish what was committed before a crash, then the bitmap is
+    // up to date
+    err_code = replayJournal();
+    if (err_code == 0){
+        err_code = loadBitmap(diskNum,read_block);
+    }
+    if (err_code == 0 && (!blockInUse(0) || findBlock(fs->bitmapStart,false) < fs->journalStart + fs->journalBlocks)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    free(read_block);
+
+    // check the whole tree if asked to or if a transaction too big
+    // for the journal was cut short
+    if (err_code == 0 && (mode != TFS_MOUNT_QUICK || !clean)){
+        err_code = checkTree(rootInode);
+    }
+    if (err_code == 0 && !clean){
+        err_code = setClean(1);
+    }
+    if (err_code < 0){
+        cacheInvalidate(diskNum);
+        closeDisk(diskNum);
+        fs->diskNum = -1;
+        return err_code;
+    }
+    dentryFlush();
+    fs->rootDirectory = 0;
+
+    fs->diskName = strdup(diskname);
+    if (fs->diskName == NULL){
+        perror("malloc: "); 
+        exit(1);
+    }
+    fs->next = mountedCtxs;
+    mountedCtxs = fs;
+    return SUCCESS;
+
+}
+
+static int mountCtx(tfs_ctx* ctx, char* diskname, int mode){
+    useCtx(ctx);
+    pthread_mutex_lock(&ctx->flusherLock);
+    lockNamespace(true);
+    pthread_mutex_lock(&mountLock);
+    int err_code = mountDisk(diskname, mode);
+    pthread_mutex_unlock(&mountLock);
+    unlockNamespace();
+    startFlusher(ctx);
+    pthread_mutex_unlock(&ctx->flusherLock);
+    return err_code;
+}
+
+int tfs_mountMode(char* diskname, int mode){
+    return mountCtx(&defaultCtx, diskname, mode);
+}
+
+tfs_ctx* tfs_mount_ctx(char* diskname){
+    return tfs_mountMode_ctx(diskname, TFS_MOUNT_QUICK, NULL);
+}
+
+// a new context with diskname mounted on it, NULL with the
+// error code in err (if not NULL) when the mount fails
+tfs_ctx* tfs_mountMode_ctx(char* diskname, int mode, int* err){
+    tfs_ctx* ctx = newCtx();
+    int err_code = mountCtx(ctx, diskname, mode);
+    if (err != NULL){
+        *err = err_code;
+    }
+    if (err_code < 0){
+        freeCtx(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int closeFile(fileDescriptor FD){
+    Node* node = findNode(FD);
+    int err_code;
+    if (node == NULL){
+        return ERR_NO_FILE;
+    }
+    // the file pointer only lives in memory while
+    // the file is open, persist it in the inode now
+    char* read_block = (char*)malloc(fs->blockSize * sizeof(char));
+    err_code = metaRead(node->inode,read_block);
+    if (err_code == 0 && getStoredPointer(read_block) != node->offset){
+        setStoredPointer(read_block,node->offset);
+        err_code = metaWrite(node->inode,read_block);
+    }
+    free(read_block);
+    if (err_code < 0){
+        return err_code;
+    }
+    // remove the node from our open list
+    err_code = deleteNode(FD);
+    if (err_code < 0){
+        return err_code;
+    }
+    return SUCCESS;
+}
+
+int tfs_closeFile(fileDescriptor FD){
+    return tfs_closeFile_ctx(&defaultCtx, FD);
+}
+
+int tfs_closeFile_ctx(tfs_ctx* ctx, fileDescriptor FD){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    lockNamespace(true);
+    int err_code = closeFile(FD);
+    unlockNamespace();
+    return err_code;
+}
+
+
+static int unmountDisk(void){
+    // lets unmount the currently mounted file
+    //close all the open files
+    int i;
+    int err_code;
+    for (i=0;i<fs->openedCapacity && fs->openedCount > 0;i++){
+        if (fs->openedFiles[i].FD != 0){
+            err_code = closeFile(fs->openedFiles[i].FD);
+            if (err_code < 0){
+                return err_code;
+            }
+        }
+    } 
+
+    // commit, write everything in place, empty the journal
+    // and release the disk descriptor
+    if (fs->diskNum != -1){
+        err_code = settleJournal();
+        if (err_code < 0){
+            return err_code;
+        }
+        cacheInvalidate(fs->diskNum);
+        err_code = closeDisk(fs->diskNum);
+        if (err_code < 0){
+            return err_code;
+        }
+    }
+    // forget the mount
+    pthread_mutex_lock(&mountLock);
+    tfs_ctx** link = &mountedCtxs;
+    while (*link != NULL){
+        if (*link == fs){
+            *link = fs->next;
+            break;
+        }
+        link = &(*link)->next;
+    }
+    pthread_mutex_unlock(&mountLock);
+    fs->diskNum = -1;
+    fs->unsynced = 0;
+    free(fs->diskName);
+    fs->diskName = NULL;
+    dentryFlush();
+    fs->rootDirectory = 0;
+    return SUCCESS;     
+
+}
+
+int tfs_unmount(void){
+    return tfs_unmount_ctx(&defaultCtx);
+}
+
+// frees ctx once its disk is unmounted
+int tfs_unmount_ctx(tfs_ctx* ctx){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    // the flusher takes the namespace lock, it is stopped first
+    pthread_mutex_lock(&ctx->flusherLock);
+    stopFlusher(ctx);
+    lockNamespace(true);
+    int err_code = unmountDisk();
+    unlockNamespace();
+    startFlusher(ctx);
+    pthread_mutex_unlock(&ctx->flusherLock);
+    if (err_code == 0 && ctx != &defaultCtx){
+        freeCtx(ctx);
+    }
+    return err_code;
+}
+
+// sets how changes reach the disk, see DURABILITY. the policy stays
+// with the context across mounts, ms and blocks only matter for
+// TFS_DURABLE_GROUP
+int tfs_setDurability(int policy, int ms, int blocks){
+    return tfs_setDurability_ctx(&defaultCtx, policy, ms, blocks);
+}
+
+int tfs_setDurability_ctx(tfs_ctx* ctx, int policy, int ms, int blocks){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    if (policy < TFS_DURABLE_NONE || policy > TFS_DURABLE_GROUP
+            || (policy == TFS_DURABLE_GROUP && (ms <= 0 || blocks <= 0))){
+        return ERR_DURABILITY;
+    }
+    pthread_mutex_lock(&ctx->flusherLock);
+    stopFlusher(ctx);
+    lockNamespace(true);
+    pthread_mutex_lock(&fs->txLock);
+    fs->durability = policy;
+    fs->syncMs = ms;
+    fs->syncBlocks = blocks;
+    pthread_mutex_unlock(&fs->txLock);
+    unlockNamespace();
+    startFlusher(ctx);
+    pthread_mutex_unlock(&ctx->flusherLock);
+    return SUCCESS;
+}
+
+// makes the file durable: its data, its inode and every name leading
+// to it. libCache has no per file flush, so this syncs the whole disk
+int tfs_sync(fileDescriptor FD){
+    return tfs_sync_ctx(&defaultCtx, FD);
+}
+
+int tfs_sync_ctx(tfs_ctx* ctx, fileDescriptor FD){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int err_code = ERR_FILE_UNOPEN;
+    lockNamespace(true);
+    if (findNode(FD) != NULL){
+        err_code = syncNow();
+    }
+    unlockNamespace();
+    return err_code;
+}
+
+// commits the running transaction, writes every cached block back
+// and syncs the disk
+int tfs_syncfs(void){
+    return tfs_syncfs_ctx(&defaultCtx);
+}
+
+int tfs_syncfs_ctx(tfs_ctx* ctx){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int err_code = ERR_DISK_CLOSED;
+    lockNamespace(true);
+    if (fs->diskNum != -1){
+        err_code = syncNow();
+    }
+    unlockNamespace();
+    return err_code;
+}
+
+// reads directory inode dir into inode_block and the leaf that would
+// hold name into leaf, returns the leaf block
+static int findLeaf(int dir, char* name, char* inode_block, char* leaf){
+    int err_code = metaRead(dir,inode_block);
+    if (err_code < 0){
+        return err_code;
+    }
+    if (inode_block[0] != '5' || inode_block[1] != MAGIC_NUMBER){
+        return ERR_INVALID_TINYFS;
+    }
+    int slot = dirHash(name) & ((1u << tableDepth(inode_block)) - 1);
+    int bNum = tableSlot(inode_block,slot,0);
+    if (bNum <= 0 || bNum >= fs->totalBlocks){
+        return (bNum < 0) ? bNum : ERR_INVALID_TINYFS;
+    }
+    err_code = metaRead(bNum,leaf);
+    if (err_code == 0 && (leaf[0] != '3' || leaf[1] != MAGIC_NUMBER)){
+        err_code = ERR_INVALID_TINYFS;
+    }
+    return (err_code < 0) ? err_code : bNum;
+}
+
+// returns the inode of name in directory dir, 0 if it is not there
+static int dirLookup(int dir, char* name){
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    char* leaf = (char*)malloc(fs->blockSize * sizeof(char));
+    int result = findLeaf(dir,name,inode_block,leaf);
+    if (result >= 0){
+        int offset = dirFindEntry(leaf,fs->blockSize,name);
+        result = (offset < 0) ? 0 : dirEntryInode(leaf,offset);
+    }
+    free(inode_block);
+    free(leaf);
+    return result;
+}
+
+// adds name to directory dir, splitting leaves until its leaf has room
+static int dirInsert(int dir, char* name, int inode){
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    char* leaf = (char*)malloc(fs->blockSize * sizeof(char));
+    char* split = (char*)malloc(fs->blockSize * sizeof(char));
+    char entry[DIR_NAME_LEN+1];
+    int err_code, i;
+
+    while (true){
+        int bNum = findLeaf(dir,name,inode_block,leaf);
+        if (bNum < 0){
+            err_code = bNum;
+            break;
+        }
+        int offset = dirFindFree(leaf,fs->blockSize);
+        if (offset >= 0){
+            dirSetEntry(leaf,offset,name,inode);
+            err_code = metaWrite(bNum,leaf);
+            if (err_code == 0){
+                putU32(inode_block + INODE_ENTRIES, getU32(inode_block + INODE_ENTRIES) + 1);
+                err_code = metaWrite(dir,inode_block);
+            }
+            break;
+        }
+
+        // the leaf is full, split it on the next bit of the hash
+        int depth = leaf[DIR_DEPTH];
+        if (depth == tableDepth(inode_block)){
+            if (depth == DIR_MAX_DEPTH){
+                err_code = ERR_DIRECTORY_FULL;
+                break;
+            }
+            err_code = doubleTable(inode_block,dir);
+            if (err_code == 0){
+                err_code = metaWrite(dir,inode_block);
+            }
+            if (err_code < 0){
+                break;
+            }
+        }
+        int other = allocBlockNear(bNum);
+        if (other < 0){
+            err_code = other;
+            break;
+        }
+        memset(split,0x00,fs->blockSize);
+        split[0] = '3';
+        split[1] = MAGIC_NUMBER;
+        split[DIR_DEPTH] = depth + 1;
+        leaf[DIR_DEPTH] = depth + 1;
+        for (i = dirNextEntry(leaf,fs->blockSize,0); i >= 0; i = dirNextEntry(leaf,fs->blockSize,i)){
+            dirEntryName(leaf,i,entry);
+            if ((dirHash(entry) >> depth) & 1){
+                dirSetEntry(split,i,entry,dirEntryInode(leaf,i));
+                dirClearEntry(leaf,i);
+            }
+        }
+        err_code = metaWrite(other,split);
+        if (err_code == 0){
+            err_code = metaWrite(bNum,leaf);
+        }
+        // every slot of the old leaf with the bit set moves over
+        int step = 1 << (depth + 1);
+        int slots = 1 << tableDepth(inode_block);
+        int slot = (dirHash(name) & ((1u << depth) - 1)) | (1 << depth);
+        for (;slot < slots && err_code == 0;slot += step){
+            err_code = tableSlot(inode_block,slot,other);
+            err_code = (err_code < 0) ? err_code : 0;
+        }
+        if (err_code == 0){
+            err_code = metaWrite(dir,inode_block);
+        }
+        if (err_code < 0){
+            break;
+        }
+    }
+    free(inode_block);
+    free(leaf);
+    free(split);
+    return err_code;
+}
+
+// takes name out of directory dir
+static int dirRemove(int dir, char* name){
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    char* leaf = (char*)malloc(fs->blockSize * sizeof(char));
+    int err_code = 0;
+    int bNum = findLeaf(dir,name,inode_block,leaf);
+    int offset = (bNum < 0) ? -1 : dirFindEntry(leaf,fs->blockSize,name);
+    if (bNum < 0){
+        err_code = bNum;
+    }else if (offset < 0){
+        err_code = ERR_NOT_IN_DIR;
+    }else{
+        dirClearEntry(leaf,offset);
+        err_code = metaWrite(bNum,leaf);
+    }
+    if (err_code == 0){
+        putU32(inode_block + INODE_ENTRIES, getU32(inode_block + INODE_ENTRIES) - 1);
+        err_code = metaWrite(dir,inode_block);
+    }
+    free(inode_block);
+    free(leaf);
+    return err_code;
+}
+
+// renames the entry of name in directory dir to newName
+// in place when both names belong in the same leaf, otherwise the new
+// name goes in first so a full disk leaves the old one
+static int dirRename(int dir, char* name, char* newName){
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    char* leaf = (char*)malloc(fs->blockSize * sizeof(char));
+    int bNum = findLeaf(dir,newName,inode_block,leaf);
+    int err_code = (bNum < 0) ? bNum : 0;
+    if (err_code == 0 && dirFindEntry(leaf,fs->blockSize,newName) >= 0){
+        err_code = ERR_FILE_EXISTS;
+    }
+    int offset = (err_code < 0) ? -1 : dirFindEntry(leaf,fs->blockSize,name);
+    if (offset >= 0){
+        dirSetEntry(leaf,offset,newName,dirEntryInode(leaf,offset));
+        err_code = metaWrite(bNum,leaf);
+    }else if (err_code == 0){
+        int inode = dirLookup(dir,name);
+        if (inode == 0){
+            inode = ERR_NOT_IN_DIR;
+        }
+        err_code = (inode < 0) ? inode : dirInsert(dir,newName,inode);
+        if (err_code == 0){
+            err_code = dirRemove(dir,name);
+        }
+    }
+    free(inode_block);
+    free(leaf);
+    return err_code;
+}
+
+
+// inode of the root directory
+static int getRootDirectory(void){
+    char* read_block;
+    if (fs->rootDirectory != 0){
+        return fs->rootDirectory;
+    }
+    read_block = (char*)malloc(fs->blockSize * sizeof(char));
+    metaRead(0,read_block);
+    fs->rootDirectory = getU32(read_block + SB_ROOT_INODE);
+    free(read_block);
+    if (fs->rootDirectory == 0){
+        return ERR_DISK_FULL;
+    }
+    return fs->rootDirectory;
+}
+
+// looks name up in the directory with inode dir
+static Dentry* lookupEntry(int dir, char* name){
+    Dentry* d = dentryLookup(dir,name);
+    if (d != NULL){
+        return d;
+    }
+    int inode = dirLookup(dir,name);
+    if (inode < 0){
+        return NULL;
+    }
+    return dentryInsert(dir,name,inode);
+}
+
+// returns the inode of directory name inside dir
+static int enterDirectory(int dir, char* name){
+    Dentry* d = lookupEntry(dir,name);
+    if (d == NULL || d->inode == 0){
+        return ERR_INVALID_PATH;
+    }
+    if (!d->dir){
+        char* read_block = (char*)malloc(fs->blockSize * sizeof(char));
+        metaRead(d->inode,read_block);
+        if (read_block[0] != '5'){
+            free(read_block);
+            return ERR_INVALID_PATH;
+        }
+        d->dir = true;
+        free(read_block);
+    }
+    return d->inode;
+}
+
+// walks every directory of path
+// the last component is copied into filename and the
+// inode of the directory holding it into parent
+// return values:
+// if < 0 --> can't find a directory or other error
+// if = 0 --> can't find the filename
+// if > 0 --> this is the inode associated with file
+static int searchForFile(char* path, char* filename, int* parent){
+    int anchor = 1;
+    int i;
+    int len = strlen(path);
+    char dirName[DIR_NAME_LEN+1];
+
+    if (path[0] != '/'){
+        return ERR_INVALID_PATH;
+    }
+    int cur_directory = getRootDirectory();
+    if (cur_directory < 0){
+        return cur_directory;
+    }
+    for (i=1;i<len;i++){
+        if (path[i] == '/'){
+            //directory name 
+            if (i - anchor < 1 || i - anchor > DIR_NAME_LEN){
+                return ERR_INVALID_PATH;
+            }
+            memcpy(dirName,path+anchor,i-anchor);
+            dirName[i-anchor] = '\0';
+            cur_directory = enterDirectory(cur_directory,dirName);
+            if (cur_directory < 0){
+                return cur_directory;
+            }
+            anchor = i+1;
+        }   
+    }
+    if (len - anchor > DIR_NAME_LEN){
+        return ERR_FILENAME_BIG; //  not a possible filename
+    }
+    if (len - anchor < 1){
+        return ERR_INVALID_PATH;
+    }
+    memcpy(filename,path+anchor,len-anchor);
+    filename[len-anchor] = '\0';
+    if (parent != NULL){
+        *parent = cur_directory;
+    }
+    Dentry* d = lookupEntry(cur_directory,filename);
+    if (d == NULL){
+        return ERR_FREAD;
+    }
+    return d->inode;
+}
+
+
+// returns the inode of the directory holding
+// the last component of path
+static int getRecentDirectory(char* path){
+    char filename[DIR_NAME_LEN+1];
+    int parent;
+    int err_code = searchForFile(path,filename,&parent);
+    if (err_code < 0){
+        return err_code;
+    }
+    return parent;
+}
+
+
+
+// copies the last component of path into filename
+static void lastComponent(char* path, char* filename){
+    char* name = strrchr(path,'/');
+    name = (name == NULL) ? path : name + 1;
+    strncpy(filename,name,DIR_NAME_LEN);
+    filename[DIR_NAME_LEN] = '\0';
+}
+
+static int createFile(char* name){
+
+    // inode
+    char* inode_block;
+    char filename[DIR_NAME_LEN+1];
+    int subDir;
+    int err_code;
+    int i;
+
+    int inode = searchForFile(name,filename,&subDir);
+    if (inode < 0){
+        return inode;
+    }else if (inode > 0){
+        return ERR_FILE_EXISTS; 
+    }
+
+    inode_block = malloc(fs->blockSize * sizeof(char));
+    memset(inode_block,0x00,fs->blockSize);
+    inode_block[0] = '2';
+    inode_block[1] = MAGIC_NUMBER;
+    for (i=0;i<8;i++){
+        if (filename[i] == '\0'){
+            break;
+        }
+        inode_block[INODE_NAME+i] = filename[i];
+    }   
+    putU32(inode_block + INODE_SIZE, 0); // size of the new file
+
+    // take a block for the inode from the bitmap
+    int freeBlock = allocBlock();
+    if (freeBlock < 0){
+        free(inode_block);
+        return freeBlock;
+    }
+
+    // for directory implementation we are adding the filename
+    // to the directory that holds it
+    err_code = dirInsert(subDir,filename,freeBlock);
     if (err_code < 0){
+        freeBlocks(freeBlock,1);
         free(inode_block);
-        free(read_block);
         return err_code;
     }
-
-    // add the fdGlobal to the linked list 
-    err_code = insert(fdGlobal, name);
+    dentryInsert(subDir,filename,freeBlock);
+    
+    // add the inode block
+    err_code = metaWrite(freeBlock,inode_block);
     if (err_code < 0){
         free(inode_block);
-        free(read_block);
         return err_code;
     }
+
+    // add the new file to the open file table
+    fileDescriptor fd = insert(name, freeBlock);
     free(inode_block);
-    free(read_block);
-    return fdGlobal++;
+    return fd;
 }
 
 
 
-fileDescriptor tfs_openFile(char* name){
+static fileDescriptor openFile(char* name){
     // open the file
     // search thru file system
     // if not there, create
     // if its there
-    // save the FD into the linked list
+    // save the FD into the table
     int err_code;
-    char* read_block = (char*)malloc(BLOCKSIZE * sizeof(char));
-    if (mountedDiskNum == -1){
+    if (fs->diskNum == -1){
        return ERR_DISK_MOUNTED; 
     } 
     // check our table
     Node* node = findNodeFilename(name);
-    if (node == NULL){
-        // create it
-        char* filename = malloc(9 * sizeof(char));
-        readBlock(mountedDiskNum,0,read_block);
-        int root_inode = read_block[5];
-        readBlock(mountedDiskNum,root_inode,read_block);
-        int cur_directory = read_block[2];
-        if (cur_directory == 0){
-            free(read_block);
-            free(filename);
-            return ERR_DISK_FULL;
-        }
-        readBlock(mountedDiskNum,cur_directory,read_block);
-        int inode;
-        inode = searchForFile(name,read_block,filename);
-        if (inode < 0){
-            // invalid path name or other error
-            free(read_block);
-            free(filename);
-            return inode;
-        }else if (inode == 0){
-            // add a new file
-            // note that read_block should contain contents of 
-            // the last subdirectory
-            fileDescriptor newFd = addNewFile(name);
-            if (newFd < 0){
-                return newFd; 
-            }
-            free(read_block);
-            free(filename);
-            return newFd; 
-        }else{
-            // add to openedfilesi
-            err_code = insert(fdGlobal, name);
-            if (err_code < 0){
-                free(read_block);
-                return err_code;
-            }
-            free(read_block);
-            free(filename);
-            return fdGlobal++;
-        }
-    }else{
-        free(read_block);
+    if (node != NULL){
         return node->FD;
     }
-
+    char filename[DIR_NAME_LEN+1];
+    int inode = searchForFile(name,filename,NULL);
+    if (inode < 0){
+        // invalid path name or other error
+        return inode;
+    }else if (inode == 0){
+        // add a new file
+        return createFile(name);
+    }
+    // add to openedfiles, picking up the stored file pointer
+    char* read_block = (char*)malloc(fs->blockSize * sizeof(char));
+    fileDescriptor fd = insert(name, inode);
+    err_code = metaRead(inode,read_block);
+    if (err_code < 0){
+        deleteNode(fd);
+        free(read_block);
+        return err_code;
+    }
+    findNode(fd)->offset = getStoredPointer(read_block);
+    findNode(fd)->raNext = findNode(fd)->offset;
+    free(read_block);
+    return fd;
 }   
 
-int tfs_writeFile(fileDescriptor FD, char* buffer, int size){
-    Node* node = findNode(FD); 
-    char* block = (char*)malloc(BLOCKSIZE * sizeof(char));
-    char* read_block = (char*)malloc(BLOCKSIZE * sizeof(char));
+int addNewFile(char* name){
+    useCtx(&defaultCtx);
+    lockNamespace(true);
+    int err_code = createFile(name);
+    unlockNamespace();
+    return err_code;
+}
+
+fileDescriptor tfs_openFile(char* name){
+    return tfs_openFile_ctx(&defaultCtx, name);
+}
+
+fileDescriptor tfs_openFile_ctx(tfs_ctx* ctx, char* name){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    lockNamespace(true);
+    fileDescriptor fd = openFile(name);
+    unlockNamespace();
+    return fd;
+}
+
+// writes the buffers of iov (size bytes in all) into runs with one disk
+// write per run, the end of the last block is padded with zeros
+static int writeRunsv(Run* runs, int count, const struct iovec* iov, int iovcnt, int size){
+    struct iovec* parts = (struct iovec*)malloc(sizeof(struct iovec) * (iovcnt + 1));
+    char* zeros = (char*)calloc(fs->blockSize, sizeof(char));
+    int err_code = 0;
     int i;
-    int free_block;
+    int v = 0;
+    size_t used = 0; // bytes of iov[v] already written
+    int done = 0;
 
-    if (node == NULL){
-        return ERR_FILE_UNOPEN; 
+    for (i=0;i<count && err_code == 0;i++){
+        int want = runs[i].len * fs->blockSize;
+        int left = (size - done < want) ? size - done : want;
+        int n = 0;
+        // the run takes the next left bytes of iov, split where the
+        // buffers split
+        while (left > 0){
+            size_t len = iov[v].iov_len - used;
+            if (len > (size_t)left){
+                len = left;
+            }
+            if (len > 0){
+                parts[n].iov_base = (char*)iov[v].iov_base + used;
+                parts[n].iov_len = len;
+                n++;
+            }
+            used += len;
+            left -= len;
+            done += len;
+            want -= len;
+            if (used == iov[v].iov_len){
+                v++;
+                used = 0;
+            }
+        }
+        if (want > 0){
+            parts[n].iov_base = zeros;
+            parts[n].iov_len = want;
+            n++;
+        }
+        err_code = dataWriteBlocksv(runs[i].start,runs[i].len,parts,n);
     }
-    char* path = node->fileName;
+    free(zeros);
+    free(parts);
+    return err_code;
+}
+
+// replaces the contents of the file with the buffers of iov, one after
+// the other
+static int writeAll(Node* node, const struct iovec* iov, int iovcnt, int size){
+    Run* old;
+    Run* runs;
     int err_code;
-    
-    // we want to search the directory for the filename
-    
-    char* filename = malloc(9 * sizeof(char));
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
+    int i;
+
+    int inode = node->inode;
+    int num_blocks = (size + fs->blockSize - 1) / fs->blockSize;
+    char* read_block = (char*)malloc(fs->blockSize * sizeof(char));
+
+    err_code = metaRead(inode,read_block);
+    int old_count = (err_code < 0) ? err_code : loadRuns(read_block,&old);
+    if (old_count < 0){
         free(read_block);
-        free(block);
-        free(filename);
-        return ERR_DISK_FULL;
+        return old_count;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
-    
-    int inode;
-    inode = searchForFile(path,read_block,filename);
-    if (inode < 0){
+
+    // give the old runs back to the bitmap, their contents don't matter,
+    // and take the new ones right after the inode if there is room
+    // the old runs are taken again right away so no other file gets
+    // them before the new contents are in place
+    lockAllocator();
+    for (i=0;i<old_count;i++){
+        markBlocks(old[i].start,old[i].len,false);
+    }
+    // a small file goes in the inode and takes no blocks at all
+    runs = NULL;
+    int count = 0;
+    if (size > INLINE_MAX){
+        count = allocRuns(inode + 1, num_blocks, &runs);
+    }
+    for (i=0;i<old_count;i++){
+        markBlocks(old[i].start,old[i].len,true);
+    }
+    unlockAllocator();
+    if (count < 0){
+        // nothing was written yet, so the old file is still intact
+        free(old);
         free(read_block);
-        free(block);
-        free(filename);
-        return inode; // invalid diretory or other 
-    }else if (inode == 0){
+        return count;
+    }
+
+    err_code = (count > 0) ? writeRunsv(runs,count,iov,iovcnt,size) : 0;
+    if (err_code == 0){
+        err_code = storeRuns(read_block,runs,count);
+    }
+    // the file keeps one set of runs, new runs may share blocks with old ones
+    Run* drop = (err_code < 0) ? runs : old;
+    Run* keep = (err_code < 0) ? old : runs;
+    int dropCount = (err_code < 0) ? count : old_count;
+    int keepCount = (err_code < 0) ? old_count : count;
+    lockAllocator();
+    for (i=0;i<dropCount;i++){
+        markBlocks(drop[i].start,drop[i].len,false);
+    }
+    for (i=0;i<keepCount;i++){
+        markBlocks(keep[i].start,keep[i].len,true);
+    }
+    if (err_code == 0){
+        // old blocks the new runs didn't take stay in use until the
+        // new inode is committed
+        for (i=0;i<old_count;i++){
+            int b;
+            for (b=old[i].start;b<old[i].start+old[i].len;b++){
+                if (!blockInUse(b)){
+                    markBlocks(b,1,true);
+                    freeBlocks(b,1);
+                }
+            }
+        }
+    }
+    unlockAllocator();
+    if (err_code < 0){
+        free(runs);
+        free(old);
         free(read_block);
-        free(block);
-        free(filename);
-        return ERR_NO_FILE; //cant find filename
-    }
-    readBlock(mountedDiskNum,inode,read_block);
-    int file_extent = read_block[2];
-    if (file_extent == 0){
-        // get the next free block
-        err_code = readBlock(mountedDiskNum,0,block);
-        if (err_code < 0){
-            free(read_block);
-            free(block);
-            free(filename);
-            return err_code;
+        return err_code;
+    }
+
+    if (count == 0){
+        char* at = read_block + INODE_MAP;
+        memset(at, 0x00, INLINE_MAX);
+        for (i=0;i<iovcnt;i++){
+            memcpy(at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
         }
-        free_block = block[2];
-        //lets write to this inodes next
-        read_block[2] = free_block;
-        read_block[12] = size % (BLOCKSIZE-4); // size of last block
-        if (read_block[12] == 0){
-            read_block[13] = size / (BLOCKSIZE-4); // number of bytes
-        }else{
-            read_block[13] = size / (BLOCKSIZE-4) + 1; // number of bytes
+    }
+    putU32(read_block + INODE_SIZE, size);
+    setStoredPointer(read_block,0);
+    err_code = metaWrite(inode,read_block);
+    free(runs);
+    free(old);
+    free(read_block);
+    if (err_code < 0){
+        return err_code;
+    }
+    
+    // the file pointer goes back to the start of the new content
+    node->offset = 0;
+    node->runIndex = -1;
+    node->raNext = 0;
+    node->raWindow = 0;
+    node->raBlock = 0;
+    return SUCCESS;
+
+}
+
+int tfs_writeFile(fileDescriptor FD, char* buffer, int size){
+    return tfs_writeFile_ctx(&defaultCtx, FD, buffer, size);
+}
+
+int tfs_writeFile_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    struct iovec iov;
+    int err_code;
+    int tries = 0;
+    do{
+        Node* node = lockFile(FD,true); 
+        if (node == NULL){
+            return ERR_FILE_UNOPEN; 
+        }
+        err_code = ERR_NBYTES;
+        if (size >= 0){
+            iov.iov_base = buffer;
+            iov.iov_len = size;
+            err_code = writeAll(node,&iov,1,size);
+        }
+        unlockFile(node);
+    }while (tries++ == 0 && reclaimForIO(err_code));
+    return err_code;
+}
+
+// replaces the contents of the file with the buffers of iov gathered
+// together, each run of blocks is written with one disk write
+int tfs_writev(fileDescriptor FD, const struct iovec* iov, int iovcnt){
+    return tfs_writev_ctx(&defaultCtx, FD, iov, iovcnt);
+}
+
+int tfs_writev_ctx(tfs_ctx* ctx, fileDescriptor FD, const struct iovec* iov, int iovcnt){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    long size = 0;
+    int i;
+    if (iovcnt < 0){
+        return ERR_NBYTES;
+    }
+    for (i=0;i<iovcnt;i++){
+        if (iov[i].iov_len > 0x7fffffff){
+            return ERR_NBYTES;
+        }
+        size += iov[i].iov_len;
+        if (size > 0x7fffffff){
+            return ERR_NBYTES;
+        }
+    }
+    int err_code;
+    int tries = 0;
+    do{
+        Node* node = lockFile(FD,true); 
+        if (node == NULL){
+            return ERR_FILE_UNOPEN; 
+        }
+        err_code = writeAll(node,iov,iovcnt,size);
+        unlockFile(node);
+    }while (tries++ == 0 && reclaimForIO(err_code));
+    return err_code;
+}
+
+// writes size bytes of buffer at offset, growing the file if the write
+// goes past its end, only the blocks written to are touched
+// the file pointer does not move
+// returns the number of bytes written
+static int pwriteAt(Node* node, char* buffer, int size, int offset){
+    Run* runs;
+    int err_code;
+
+    if (offset < 0 || size < 0 || offset > 0x7fffffff - size){
+        return ERR_NBYTES;
+    }
+    if (size == 0){
+        return 0;
+    }
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    err_code = metaRead(node->inode,inode_block);
+    int count = (err_code < 0) ? err_code : loadRuns(inode_block,&runs);
+    if (count < 0){
+        free(inode_block);
+        return count;
+    }
+    int file_size = getU32(inode_block + INODE_SIZE);
+    int end = offset + size;
+    if (count == 0 && end <= INLINE_MAX){
+        // still fits in the inode
+        memcpy(inode_block + INODE_MAP + offset, buffer, size);
+        if (end > file_size){
+            putU32(inode_block + INODE_SIZE, end);
+        }
+        err_code = metaWrite(node->inode,inode_block);
+        free(runs);
+        free(inode_block);
+        return (err_code < 0) ? err_code : size;
+    }
+    int oldBlocks = (file_size + fs->blockSize - 1) / fs->blockSize;
+    int keepBlocks = oldBlocks; // what a failed write shrinks back to
+    if (count == 0){
+        oldBlocks = spillInline(inode_block,file_size,&runs,&count,node->inode + 1);
+        keepBlocks = 0;
+        if (oldBlocks < 0){
+            free(runs);
+            free(inode_block);
+            return oldBlocks;
         }
-        read_block[14] = 0; // cur byte file pointer
-        read_block[15] = 0; // cur block file pointer
-        err_code = writeBlock(mountedDiskNum,inode,read_block);
+    }
+    int newBlocks = (end + fs->blockSize - 1) / fs->blockSize;
+    if (newBlocks > oldBlocks){
+        err_code = resizeRuns(&runs,&count,newBlocks,node->inode + 1);
         if (err_code < 0){
-            free(read_block);
-            free(block);
-            free(filename);
+            resizeRuns(&runs,&count,keepBlocks,0);
+            free(runs);
+            free(inode_block);
             return err_code;
         }
-        readBlock(mountedDiskNum,free_block,read_block);
-    }else{
-        // delete existing blocks
-        // update the inode contents to be correct
-        readBlock(mountedDiskNum, file_extent, read_block);
-        int prev_block = file_extent;
-        int next_block = read_block[2];
-        while (read_block[0] == '3'){
-            memset(read_block,0x00,BLOCKSIZE);
-            read_block[0] = '4';
-            read_block[1] = MAGIC_NUMBER;
-            read_block[2] = next_block;
-            writeBlock(mountedDiskNum, file_extent,read_block);
-            readBlock(mountedDiskNum, file_extent, read_block);
-            prev_block = next_block;
-            next_block = read_block[2];
-        }
-        // set the superblock to file extent and prev block to superblock
-        
-        readBlock(mountedDiskNum, 0, read_block);
-        int last_block = read_block[2];
-        read_block[2] = file_extent;
-        writeBlock(mountedDiskNum, 0, read_block);
-   
-        readBlock(mountedDiskNum, prev_block, read_block);
-        read_block[2] = last_block;
-        writeBlock(mountedDiskNum, prev_block, read_block);
-                
-        // now read the inode file, grab the first file extent content 
-        readBlock(mountedDiskNum,file_extent,read_block);
     }
-    // at this point, read_block contain first file extent content
 
-    int next_block = read_block[2];
-    if (next_block == 0){
-        return ERR_DISK_FULL;
+    // start at the first block written, or at the old end of the
+    // file if the write leaves a hole that has to read back as zeros
+    // (the bytes past the end of the last block are always zero)
+    int fileBlock = offset / fs->blockSize;
+    if (fileBlock > oldBlocks){
+        fileBlock = oldBlocks;
     }
-    // now the rest of the buffer can be
-    int j=1;
-    for (i=0; i<size; i++){
-        if ((i+4*j) % BLOCKSIZE == 0){
-            read_block[0] = '3';
-            read_block[1] = MAGIC_NUMBER;
-            //write this block and set up the next one
-            err_code = writeBlock(mountedDiskNum,free_block,read_block);
-            if (err_code < 0){
-                free(read_block);
-                free(block);
-                free(filename);
-                return err_code;
-            }
-            
-            free_block = next_block;
-            err_code = readBlock(mountedDiskNum,free_block,read_block);
-            if (err_code < 0){
-                free(read_block);
-                free(block);
-                free(filename);
-                return err_code;
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    int index = -1;
+    int first = 0;
+    for (; (long)fileBlock*fs->blockSize < end && err_code == 0; fileBlock++){
+        int blockStart = fileBlock * fs->blockSize;
+        int from = (offset > blockStart) ? offset - blockStart : 0;
+        int to = (end < blockStart + fs->blockSize) ? end - blockStart : fs->blockSize;
+        index = findRun(runs,count,fileBlock,index,&first);
+        if (index < 0){
+            err_code = index;
+            break;
+        }
+        int bNum = runs[index].start + fileBlock - first;
+        if (from == 0 && to == fs->blockSize){
+            // whole blocks are written straight from buffer, as many
+            // as the run holds
+            int whole = (end - blockStart) / fs->blockSize;
+            if (whole > runs[index].len - (fileBlock - first)){
+                whole = runs[index].len - (fileBlock - first);
             }
-            next_block = read_block[2];
-            if (next_block == 0){
-                return ERR_DISK_FULL;
+            err_code = dataWriteBlocks(bNum,whole,buffer + blockStart - offset);
+            fileBlock += whole - 1;
+            continue;
+        }
+        if (from > 0 || to < fs->blockSize){
+            // only part of the block is written
+            if (fileBlock < oldBlocks){
+                err_code = cacheReadBlock(fs->diskNum,bNum,block);
+            }else{
+                memset(block,0x00,fs->blockSize);
             }
-            j+=1;
         }
-        read_block[(i+4*j) % BLOCKSIZE] = buffer[i];
+        if (err_code == 0 && to > from){
+            memcpy(block + from, buffer + blockStart + from - offset, to - from);
+        }
+        if (err_code == 0){
+            err_code = dataWrite(bNum,block);
+        }
     }
+    free(block);
 
-    // write the last block
-    block[0] = '3';
-    block[1] = MAGIC_NUMBER;
-    //write this block and set up the next one
-    err_code = writeBlock(mountedDiskNum,free_block,read_block);
+    if (err_code == 0 && newBlocks > keepBlocks){
+        err_code = storeRuns(inode_block,runs,count);
+    }
     if (err_code < 0){
-        free(read_block);
-        free(block);
-        free(filename);
+        if (newBlocks > keepBlocks){
+            resizeRuns(&runs,&count,keepBlocks,0);
+        }
+        free(runs);
+        free(inode_block);
         return err_code;
     }
-    
-    free_block = read_block[2];
-    if (free_block == 0){
-        return ERR_DISK_FULL;
+    free(runs);
+    if (end > file_size){
+        putU32(inode_block + INODE_SIZE, end);
+        err_code = metaWrite(node->inode,inode_block);
     }
-    
-    // set the next free node in the superblock
-    err_code = readBlock(mountedDiskNum,0,block);
+    free(inode_block);
     if (err_code < 0){
-        free(read_block);
-        free(block);
-        free(filename);
         return err_code;
     }
-    block[2] = free_block;
-    
-    err_code = writeBlock(mountedDiskNum,0,block);
-    if (err_code < 0){
-        free(read_block);
-        free(block);
-        free(filename);
+    return size;
+}
+
+int tfs_pwrite(fileDescriptor FD, char* buffer, int size, int offset){
+    return tfs_pwrite_ctx(&defaultCtx, FD, buffer, size, offset);
+}
+
+int tfs_pwrite_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size, int offset){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int err_code;
+    int tries = 0;
+    do{
+        Node* node = lockFile(FD,true);
+        if (node == NULL){
+            return ERR_FILE_UNOPEN; 
+        }
+        err_code = pwriteAt(node, buffer, size, offset);
+        unlockFile(node);
+    }while (tries++ == 0 && reclaimForIO(err_code));
+    return err_code;
+}
+
+// writes size bytes of buffer at the end of the file
+// the file pointer does not move
+int tfs_append(fileDescriptor FD, char* buffer, int size){
+    return tfs_append_ctx(&defaultCtx, FD, buffer, size);
+}
+
+int tfs_append_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int err_code;
+    int tries = 0;
+    do{
+        Node* node = lockFile(FD,true);
+        if (node == NULL){
+            return ERR_FILE_UNOPEN; 
+        }
+        char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+        err_code = metaRead(node->inode,inode_block);
+        int file_size = getU32(inode_block + INODE_SIZE);
+        free(inode_block);
+        if (err_code == 0){
+            err_code = pwriteAt(node, buffer, size, file_size);
+        }
+        unlockFile(node);
+    }while (tries++ == 0 && reclaimForIO(err_code));
+    return err_code;
+}
+
+// sets the size of a file that ends up small enough to be inline,
+// a file that had blocks takes its first bytes back from the first one
+// and gives them all up, the caller writes the inode
+static int truncateInline(char* inode_block, Run* runs, int count, int file_size, int size){
+    char* at = inode_block + INODE_MAP;
+    int err_code = 0;
+    if (count == 0){
+        if (size < file_size){
+            memset(at + size, 0x00, file_size - size);
+        }
+        putU32(inode_block + INODE_SIZE, size);
+        return 0;
+    }
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+    if (size > 0){
+        err_code = cacheReadBlock(fs->diskNum,runs[0].start,block);
+    }
+    if (err_code == 0){
+        err_code = storeRuns(inode_block,NULL,0);
+    }
+    if (err_code == 0){
+        resizeRuns(&runs,&count,0,0);
+        memset(at, 0x00, INLINE_MAX);
+        memcpy(at, block, size);
+        putU32(inode_block + INODE_SIZE, size);
+    }
+    free(block);
+    return err_code;
+}
+
+// cuts the file down to size bytes or grows it with zeros
+static int truncateFile(Node* node, int size){
+    Run* runs;
+    int err_code;
+    int i;
+
+    if (size < 0){
+        return ERR_NBYTES;
+    }
+    char* inode_block = (char*)malloc(fs->blockSize * sizeof(char));
+    err_code = metaRead(node->inode,inode_block);
+    int count = (err_code < 0) ? err_code : loadRuns(inode_block,&runs);
+    if (count < 0){
+        free(inode_block);
+        return count;
+    }
+    int file_size = getU32(inode_block + INODE_SIZE);
+    if (size <= INLINE_MAX){
+        err_code = truncateInline(inode_block,runs,count,file_size,size);
+        free(runs);
+        if (err_code == 0){
+            err_code = metaWrite(node->inode,inode_block);
+        }
+        free(inode_block);
+        node->runIndex = -1;
+        node->raBlock = 0;
         return err_code;
     }
-    
-    free(read_block);
+    int oldBlocks = (file_size + fs->blockSize - 1) / fs->blockSize;
+    int storedBlocks = oldBlocks; // blocks in the map the inode holds now
+    if (count == 0){
+        oldBlocks = spillInline(inode_block,file_size,&runs,&count,node->inode + 1);
+        storedBlocks = 0;
+        if (oldBlocks < 0){
+            free(runs);
+            free(inode_block);
+            return oldBlocks;
+        }
+    }
+    int newBlocks = (size + fs->blockSize - 1) / fs->blockSize;
+    char* block = (char*)malloc(fs->blockSize * sizeof(char));
+
+    err_code = resizeRuns(&runs,&count,newBlocks,node->inode + 1);
+    if (err_code == 0 && size < file_size && size % fs->blockSize != 0){
+        // the bytes past the new end of the last block are zeroed
+        // so growing the file again reads them back as zeros
+        int first = 0;
+        int index = findRun(runs,count,newBlocks-1,-1,&first);
+        int bNum = runs[index].start + newBlocks - 1 - first;
+        err_code = cacheReadBlock(fs->diskNum,bNum,block);
+        if (err_code == 0){
+            memset(block + size % fs->blockSize, 0x00, fs->blockSize - size % fs->blockSize);
+            err_code = dataWrite(bNum,block);
+        }
+    }else if (err_code == 0 && newBlocks > oldBlocks){
+        // new blocks read back as zeros
+        int first = 0;
+        int index = -1;
+        memset(block,0x00,fs->blockSize);
+        for (i=oldBlocks;i<newBlocks && err_code == 0;i++){
+            index = findRun(runs,count,i,index,&first);
+            err_code = dataWrite(runs[index].start + i - first,block);
+        }
+    }
     free(block);
-    free(filename);
-    return SUCCESS;
+    if (err_code == 0 && newBlocks != storedBlocks){
+        err_code = storeRuns(inode_block,runs,count);
+    }
+    free(runs);
+    if (err_code == 0){
+        putU32(inode_block + INODE_SIZE, size);
+        err_code = metaWrite(node->inode,inode_block);
+    }
+    free(inode_block);
+    node->runIndex = -1;
+    node->raBlock = 0;
+    return err_code;
+}
 
+int tfs_truncate(fileDescriptor FD, int size){
+    return tfs_truncate_ctx(&defaultCtx, FD, size);
 }
 
-int tfs_deleteFile(fileDescriptor FD)
-{
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* write_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* temp_fil = (char*)malloc(sizeof(char) * 9);
+int tfs_truncate_ctx(tfs_ctx* ctx, fileDescriptor FD, int size){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int err_code;
+    int tries = 0;
+    do{
+        Node* node = lockFile(FD,true);
+        if (node == NULL){
+            return ERR_FILE_UNOPEN; 
+        }
+        err_code = truncateFile(node, size);
+        unlockFile(node);
+    }while (tries++ == 0 && reclaimForIO(err_code));
+    return err_code;
+}
 
+static int deleteFile(fileDescriptor FD)
+{
+    char* read_block;
+    char temp_fil[DIR_NAME_LEN+1];
     int err_code;
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory== 0){
-        free(read_block);
-        free(write_block);
-        free(temp_fil);
-        return ERR_DISK_FULL;
-    }
-    readBlock(mountedDiskNum,cur_directory,read_block);
 
     //find inode block based on file descriptor
     Node* fil = findNode(FD);
     if (fil == NULL){
-        free(read_block);
-        free(write_block);
-        free(temp_fil);
         return ERR_NO_FILE;
     }
     char* path = fil->fileName;
-    int inode = searchForFile(path, read_block, temp_fil);
+    int inode = fil->inode;
+    int dir_inode = getRecentDirectory(path);
+    if (dir_inode < 0){
+        return dir_inode;
+    }
+    lastComponent(path, temp_fil);
 
-    //read_block contains inode block for file to delete
-    readBlock(mountedDiskNum, inode, read_block);
+    read_block = (char*)malloc(sizeof(char) * fs->blockSize);
 
-    int file_extent = read_block[2];
-    if (file_extent == 0){
+    //read_block contains inode block for file to delete
+    err_code = metaRead(inode, read_block);
+    if (err_code < 0){
         free(read_block);
-        free(write_block);
-        free(temp_fil);
-        return ERR_DISK_FULL;
+        return err_code;
     }
-    
-    //will 0 out every node, and make it into a free block
-    memset(write_block, 0x00, BLOCKSIZE);
-    write_block[0] = '4';
-    write_block[1] = MAGIC_NUMBER;
-    write_block[2] = file_extent;
-    writeBlock(mountedDiskNum, inode, write_block);
-    readBlock(mountedDiskNum, file_extent, read_block);
-    int tracker = read_block[0];
 
-    int prev_extent = inode;
-    while (tracker == '3')
-    {
-        //keep same link
-        write_block[2] = read_block[2];
-        //write in same file extent, the new buffer
-        writeBlock(mountedDiskNum, file_extent, write_block);
-        //update to next file_extent file
-        prev_extent = file_extent;
-        file_extent = read_block[2];
-        readBlock(mountedDiskNum, file_extent, read_block);
-        tracker = read_block[0];
-    }
-
-    //read superblock again and update it to old inode block
-    readBlock(mountedDiskNum, 0, read_block);
-    int new_free = read_block[2];
-    if (new_free == 0){
+    Run* runs;
+    int count = loadRuns(read_block, &runs);
+    if (count < 0){
         free(read_block);
-        free(write_block);
-        free(temp_fil);
-        return ERR_DISK_FULL;
-    }
-    
-    read_block[2] = inode;
-    writeBlock(mountedDiskNum, 0, read_block);
-    
-    //rewrite the last deleted file to point to what superblock was pointing to
-    readBlock(mountedDiskNum, prev_extent, read_block);
-    read_block[2] = new_free;
-    writeBlock(mountedDiskNum, prev_extent, read_block);
-
-    //HAVE TO DELETE IT FROM LAST DIRECTORY STILL
-       
-    readBlock(mountedDiskNum,cur_directory,read_block);
-    int dir_inode = getRecentDirectory(path,read_block);
-    if (dir_inode <= 0){
-        dir_inode = cur_directory;// assume its the root 
+        return count;
     }
- 
-    // we know have the most recent directory in read_block 
-    readBlock(mountedDiskNum,dir_inode,read_block);
-    
-    err_code = modifyFileFromDirectory(temp_fil,read_block,NULL);
+
+    //delete it from the directory holding it, the blocks are only
+    //given up once nothing points at them
+    err_code = dirRemove(dir_inode,temp_fil);
     if (err_code < 0){
+        free(runs);
         free(read_block);
-        free(write_block);
-        free(temp_fil);
         return err_code;
     }
-    writeBlock(mountedDiskNum,dir_inode,read_block); 
- 
-    free(read_block);
-    free(write_block);
-    free(temp_fil);
-    return 0;
+    dentryInvalidate(dir_inode,temp_fil);
+
+    //clear the bits of the inode, every run and the indirect blocks
+    freeMeta(inode,1);
+    int k;
+    for (k=0;k<count;k++){
+        freeBlocks(runs[k].start, runs[k].len);
+    }
+    free(runs);
+    // a chain that can't be read any more is left for the full check
+    err_code = freeIndirect(read_block);
+
+    // the descriptor no longer refers to a file
+    deleteNode(FD);
+ 
+    free(read_block);
+    return err_code;
+}
+
+int tfs_deleteFile(fileDescriptor FD)
+{
+    return tfs_deleteFile_ctx(&defaultCtx, FD);
+}
+
+int tfs_deleteFile_ctx(tfs_ctx* ctx, fileDescriptor FD)
+{
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    lockNamespace(true);
+    int err_code = deleteFile(FD);
+    unlockNamespace();
+    return err_code;
+}
+static int readdir_helper(int cur_directory, int tab);
+
+// lists the entries of one leaf of a directory
+static void readdir_leaf(char* leaf, int tab)
+{
+    int i, j, inode;
+    char filename[DIR_NAME_LEN+1];
+    char* temp_inode_reader = (char*)malloc(sizeof(char) * fs->blockSize);
+
+    for (i = dirNextEntry(leaf,fs->blockSize,0); i >= 0; i = dirNextEntry(leaf,fs->blockSize,i))
+    {
+        dirEntryName(leaf, i, filename);
+        inode = dirEntryInode(leaf, i);
+        metaRead(inode, temp_inode_reader);
+        if (temp_inode_reader[0] != '2' && temp_inode_reader[0] != '5'){
+            continue;
+        }
+        for (j=0;j<tab;j++){
+            printf("----");
+        }
+        if(temp_inode_reader[0] == '2')
+        {
+            printf("%s\n", filename);
+        }
+        else
+        {
+            printf("d: %s\n", filename);
+            readdir_helper(inode, tab+1);
+        }
+    }
+    free(temp_inode_reader);
 }
+
 static int readdir_helper(int cur_directory, int tab)
 {
-    int i, inode;
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* temp_inode_reader = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* filename = (char*)malloc(sizeof(char) * 9);
+    int slot;
+    int* table;
 
-    
-    //read from superblock, get curr directory file
     if (cur_directory == 0){
         return ERR_DISK_FULL;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
+    char* read_block = (char*)malloc(sizeof(char) * fs->blockSize);
+    metaRead(cur_directory,read_block);
+    int slots = loadTable(read_block,&table);
+    if (slots < 0){
+        free(read_block);
+        return slots;
+    }
 
-    int j;
-    char* tab_space;
-    for (i = 4; i < BLOCKSIZE; i += 9)
+    // every leaf is listed once, from the first slot pointing at it
+    for (slot = 0; slot < slots; slot++)
     {
-        filename = substring(read_block, i, i + 8);
-        if (filename[0] != '\0'){
-            inode = read_block[i + 8];
-            readBlock(mountedDiskNum, inode, temp_inode_reader);
-            if(temp_inode_reader[0] == '2')
-            {
-                tab_space = (char*)malloc(sizeof(char) * tab*4 + 20);
-                memset(tab_space,0,tab*4+20);
-                for (j=0;j<tab;j++){
-                     strncat(tab_space,"----", 4);
-                }
-                if (filename[0] != '\0'){
-                    printf("%s%s\n", tab_space, filename);
-                }
-                free(tab_space);
-            }
-            else if(temp_inode_reader[0] == '5')
-            {
-                //WILL DO SOMETHING DIFFERENT FOR DIRECTORIES
-                int j;
-                tab_space = (char*)malloc(sizeof(char) * tab*4 + 20);
-                memset(tab_space,0,tab*4+20);
-                for (j=0;j<tab;j++){
-                     strncat(tab_space,"----", 4);
-                }
-                if (filename[0] != '\0'){
-                    printf("%sd: %s\n", tab_space, filename);
-                }
-                free(tab_space);
-                cur_directory = temp_inode_reader[2];
-                readdir_helper(cur_directory, ++tab);
-            }
+        metaRead(table[slot],read_block);
+        if (read_block[DIR_DEPTH] <= DIR_MAX_DEPTH && slot < (1 << read_block[DIR_DEPTH])){
+            readdir_leaf(read_block, tab);
         }
     }
+    free(table);
     free(read_block);
-    free(temp_inode_reader);
-    free(filename);
     return 1;
 }
 
 int tfs_readdir()
 {
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
+    return tfs_readdir_ctx(&defaultCtx);
+}
 
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        return ERR_DISK_FULL;
+int tfs_readdir_ctx(tfs_ctx* ctx)
+{
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
     }
-    readdir_helper(cur_directory,0);
+    lockNamespace(false);
+    char* read_block = (char*)malloc(sizeof(char) * fs->blockSize);
+
+    //read from superblock, get curr directory file
+    metaRead(0,read_block);
+    int root_inode = getU32(read_block + SB_ROOT_INODE);
+    readdir_helper(root_inode,0);
     
     free(read_block);
+    unlockNamespace();
     return 1;
 
 }
 
-int tfs_rename(fileDescriptor FD, char* newName)
+static int renameFile(fileDescriptor FD, char* newName)
 {
-    if (strlen(newName) > 8)
+    if (strlen(newName) > DIR_NAME_LEN)
     {
         return ERR_FILENAME_BIG;
     }
     int i;
     int err_code;
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* temp_fil = (char*)malloc(sizeof(char) * 9);
-
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        free(read_block);
-        free(temp_fil);
-        return ERR_DISK_FULL;
-    }
-    readBlock(mountedDiskNum,cur_directory,read_block);
+    char temp_fil[DIR_NAME_LEN+1];
 
      //find inode block based on file descriptor
     Node* fil = findNode(FD);
     if (fil == NULL)
     {
-        free(read_block);
-        free(temp_fil);
         return ERR_NO_FILE;
     }
 
-    
     char* path = fil->fileName;
-    int len = strlen(path);
-
-    // lets change the global node block to reflect our new name
-    // only need to change the last part of the file
-    int k;
-    for (k=strlen(path);k>=0;k--){
-        if (path[k] == '/'){
-            break;
-        }
-    }
-    char* newPath = (char*)malloc(strlen(path) * sizeof(char));
-    strncpy(newPath,path,len);   
-    for (i=0;i<strlen(newName);i++){
-        newPath[i+k+1] = newName[i]; 
+    int inode = fil->inode;
+    int dir_inode = getRecentDirectory(path);
+    if (dir_inode < 0){
+        return dir_inode;
     }
-    newPath[i+k+1] = '\0';
-    
-    modifyFilename(FD, newPath);
-      
-    //retrieve inode block and change the name within the inode block
-    int inode = searchForFile(path, read_block, temp_fil);
-    if (inode < 0){
-        free(read_block);
-        free(temp_fil);
-        return inode; // invalid diretory or other 
-    }else if (inode == 0){
-        free(read_block);
-        free(temp_fil);
-        return ERR_NO_FILE;
+    lastComponent(path, temp_fil);
+    if (strcmp(temp_fil,newName) != 0){
+        err_code = dirRename(dir_inode,temp_fil,newName);
+        if (err_code < 0){
+            return err_code;
+        }
+        dentryInvalidate(dir_inode,temp_fil);
+        dentryInvalidate(dir_inode,newName);
     }
+
+    // lets build the new path of the open file entry
+    // only need to change the last part of the file
+    int k = strrchr(path,'/') - path;
+    char* newPath = (char*)malloc((k + strlen(newName) + 2) * sizeof(char));
+    strncpy(newPath,path,k+1);   
+    strcpy(newPath+k+1,newName);
     
-    readBlock(mountedDiskNum, inode, read_block);
+    char* read_block = (char*)malloc(sizeof(char) * fs->blockSize);
+
+    //change the name within the inode block
+    metaRead(inode, read_block);
     for (i = 0; i < 8; i++)
     {
         if (newName[i] == '\0')
         {
             break;
         }
-        read_block[4+i] = newName[i];
+        read_block[INODE_NAME+i] = newName[i];
     }
    
     //if name is less than 8, put null characs at the end
     while (i < 8)
     {
-        read_block[4+i] = '\0';
+        read_block[INODE_NAME+i] = '\0';
         i = i + 1;
     }
     
-    writeBlock(mountedDiskNum, inode, read_block);
-  
-    //HAVE TO STILL GO TO LAST DIRECTORY AND CHANGE THE NAME IN THERE
-    
-    int dir_inode = getRecentDirectory(path,read_block);
-    if (dir_inode <= 0){
-        dir_inode = cur_directory;// assume its the root 
-    }
- 
-    // we know have the most recent directory in read_block 
-    readBlock(mountedDiskNum,dir_inode,read_block);
-    err_code = modifyFileFromDirectory(temp_fil,read_block,newName);
-    if (err_code < 0){
-        free(read_block);
-        free(temp_fil);
-        return err_code;
-    }
-    writeBlock(mountedDiskNum,dir_inode,read_block);
+    metaWrite(inode, read_block);
+
+    // lets change the open file entry to reflect our new name
+    modifyFilename(FD, newPath);
 
+    free(newPath);
     free(read_block);
-    free(temp_fil);
     return 1;
 }
 
-// returns the inode of this 
-int tfs_createDir(char* dirPath){
-    // we want to create a directory if it doesn't exist already
-    char* dirName = (char*)malloc(sizeof(char) * 9);
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
+int tfs_rename(fileDescriptor FD, char* newName)
+{
+    return tfs_rename_ctx(&defaultCtx, FD, newName);
+}
 
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    int free_block = read_block[2];
-    if (free_block == 0){
-        free(dirName);
-        free(read_block);
-        return ERR_DISK_FULL;
-    }
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        free(dirName);
-        free(read_block);
-        return ERR_DISK_FULL;
+int tfs_rename_ctx(tfs_ctx* ctx, fileDescriptor FD, char* newName)
+{
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
+    lockNamespace(true);
+    int err_code = renameFile(FD, newName);
+    unlockNamespace();
+    return err_code;
+}
 
+static int createDir(char* dirPath){
+    // we want to create a directory if it doesn't exist already
+    char dirName[DIR_NAME_LEN+1];
+    int dir_inode;
 
-    int inode = searchForFile(dirPath,read_block,dirName);
+    int inode = searchForFile(dirPath,dirName,&dir_inode);
     if (inode < 0){
-        free(dirName);
-        free(read_block);
         return inode; // invalid diretory or other 
-    }else if (inode == 0){
-         //create directory
-    }else{
-        free(dirName);
-        free(read_block);
+    }else if (inode > 0){
         return inode; // the inode of this directory
     }
 
-    readBlock(mountedDiskNum,cur_directory,read_block);
-    int dir_inode = getRecentDirectory(dirPath,read_block);
-    if (dir_inode == 0){
-        dir_inode = cur_directory;// assume its the root 
-    }else if(dir_inode < 0){
-        free(dirName);
-        free(read_block);
-        return dir_inode;
+    //take blocks for the inode and its first leaf from the bitmap
+    int free_block = allocBlock();
+    if (free_block < 0){
+        return free_block;
+    }
+    int content_block = allocBlock();
+    if (content_block < 0){
+        freeBlocks(free_block,1);
+        return content_block;
     }
+    char* read_block = (char*)malloc(sizeof(char) * fs->blockSize);
 
-    readBlock(mountedDiskNum,dir_inode,read_block);
-    // we know have the most recent directory in read_block
-    
-    // we want to write the filename + inode number to this block
-    // find an empty spot and then write to the directory
-    addFileToBuffer(dirName,read_block,free_block);
-    writeBlock(mountedDiskNum,dir_inode,read_block);
+    // add the filename + inode number to the directory holding it
+    int err_code = dirInsert(dir_inode,dirName,free_block);
+    if (err_code < 0){
+        freeBlocks(free_block,1);
+        freeBlocks(content_block,1);
+        free(read_block);
+        return err_code;
+    }
 
-    // directory inode content
-    readBlock(mountedDiskNum,free_block,read_block);
+    // directory inode, a table of one slot pointing at the leaf
+    memset(read_block,0x00,fs->blockSize);
     read_block[0] = '5';
     read_block[1] = MAGIC_NUMBER;
-    int next_free = read_block[2] ; // defaults to next free_block - use for the directory content
-    if (next_free == 0){
-        free(dirName);
-        free(read_block);
-        return ERR_DISK_FULL;
-    }
-    read_block[3] = 0;
-   
+    putU32(read_block + INODE_SIZE, 4);
+    putU32(read_block + INODE_MAP, content_block);
     int i; 
     for (i=0;i<8;i++){
         if (dirName[i] == '\0'){
             break;
         }
-        read_block[4+i] = dirName[i];
+        read_block[INODE_NAME+i] = dirName[i];
     }   
-    writeBlock(mountedDiskNum,free_block,read_block);
+    metaWrite(free_block,read_block);
 
-    // directory content
-    free_block = next_free;
-    readBlock(mountedDiskNum,free_block,read_block);
+    // its leaf, empty and of depth 0
+    memset(read_block,0x00,fs->blockSize);
     read_block[0] = '3';
     read_block[1] = MAGIC_NUMBER;
-    next_free = read_block[2] ; // defaults to next free_block - save to superblock
-    if (next_free == 0){
-        free(dirName);
-        free(read_block);
-        return ERR_DISK_FULL;
-    }
-    read_block[3] = 0;
-    writeBlock(mountedDiskNum,free_block,read_block);
-     
-    // write to the superblock
-    readBlock(mountedDiskNum,0,read_block);
-    read_block[2] = next_free;
-    writeBlock(mountedDiskNum,0,read_block);
+    metaWrite(content_block,read_block);
+
+    Dentry* d = dentryInsert(dir_inode,dirName,free_block);
+    d->dir = true;
 
-    free(dirName);
     free(read_block);
     return 0;
 }
 
-int tfs_removeDir(char *dirname)
-{
-    int i, inode;
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* buffer = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* temp_fil = (char*)malloc(sizeof(char) * 9);
+int tfs_createDir(char* dirPath){
+    return tfs_createDir_ctx(&defaultCtx, dirPath);
+}
 
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        return ERR_DISK_FULL;
+int tfs_createDir_ctx(tfs_ctx* ctx, char* dirPath){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
+    lockNamespace(true);
+    int err_code = createDir(dirPath);
+    unlockNamespace();
+    return err_code;
+}
+
+static int removeDir(char *dirname)
+{
+    int inode;
+    char temp_fil[DIR_NAME_LEN+1];
+    int dir_inode;
 
-    //search for directory in root direc and get inode num for it
-    inode = searchForFile(dirname, read_block, temp_fil);
-    readBlock(mountedDiskNum, inode, read_block);
+    //search for directory and get inode num for it
+    inode = searchForFile(dirname, temp_fil, &dir_inode);
+    if (inode < 0){
+        return inode;
+    }else if (inode == 0){
+        return ERR_NO_FILE;
+    }
+    char* read_block = (char*)malloc(sizeof(char) * fs->blockSize);
     //check if it's a directory
-    if (read_block[0] != '5' || read_block[1] != 0x44)
+    if (metaRead(inode, read_block) < 0 || read_block[0] != '5' || read_block[1] != MAGIC_NUMBER)
     {
+        free(read_block);
         return ERR_INVALID_TINYFS;
     }
-    //set the buffer to be a free block ready to overwrite the deleted directory block
-    buffer[0] = '4';
-    buffer[1] = 0x44;
-    buffer[2] = read_block[2];
-    //Bytes 4-12 is reserved for directory name
-    for (i = 13; i < BLOCKSIZE; i++)
+
+    //the directory has to be empty
+    if (getU32(read_block + INODE_ENTRIES) != 0)
     {
-        //error if we somehow reach a non-null character
-        if (read_block[i] != 0x00)
-        {
-            return ERR_INVALID_TINYFS;
+        free(read_block);
+        return ERR_DIR_NOT_EMPTY;
+    }
+    int* table;
+    Run* runs;
+    int slots = loadTable(read_block, &table);
+    if (slots < 0){
+        free(read_block);
+        return slots;
+    }
+    int count = loadRuns(read_block, &runs);
+    if (count < 0){
+        free(table);
+        free(read_block);
+        return count;
+    }
+
+    //delete the directory from the directory holding it
+    int err_code = dirRemove(dir_inode, temp_fil);
+    if (err_code < 0){
+        free(table);
+        free(runs);
+        free(read_block);
+        return err_code;
+    }
+
+    //the inode, the table and every leaf go back to the bitmap
+    int i;
+    for (i=0;i<count;i++){
+        freeMeta(runs[i].start, runs[i].len);
+    }
+    free(runs);
+    freeIndirect(read_block);
+    freeMeta(inode,1);
+    for (i=0;i<slots;i++){
+        metaRead(table[i], read_block);
+        if (read_block[DIR_DEPTH] <= DIR_MAX_DEPTH && i < (1 << read_block[DIR_DEPTH])){
+            freeMeta(table[i],1);
         }
     }
-    //HAVE TO DELETE DIRECTORY FROM ROOT DIRECTORY SOMEHOW SOMEWAY
-    //if pass through, directory is empty 
-    memset(buffer, 0x00, BLOCKSIZE);
-    writeBlock(mountedDiskNum, inode, buffer);
+    free(table);
+
+    // anything cached below this directory is gone too
+    dentryFlush();
 
     free(read_block);
-    free(buffer);
-    free(temp_fil);
     return 1;
 }
 
-int tfs_seek(fileDescriptor FD, int offset){
+int tfs_removeDir(char *dirname)
+{
+    return tfs_removeDir_ctx(&defaultCtx, dirname);
+}
+
+int tfs_removeDir_ctx(tfs_ctx* ctx, char *dirname)
+{
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    lockNamespace(true);
+    int err_code = removeDir(dirname);
+    unlockNamespace();
+    return err_code;
+}
 
-    char* temp_fil = (char*)malloc(sizeof(char) * 9);
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
+int tfs_seek(fileDescriptor FD, int offset){
+    return tfs_seek_ctx(&defaultCtx, FD, offset);
+}
 
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        free(temp_fil);
-        free(read_block);
-        return ERR_DISK_FULL;
+int tfs_seek_ctx(tfs_ctx* ctx, fileDescriptor FD, int offset){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
-    //find filename from filedescriptor and find correct inode file
-    Node* node = findNode(FD);
+    Node* node = lockFile(FD,true);
     if (node == NULL){
-        free(temp_fil);
-        free(read_block);
         return ERR_NO_FILE;    
     }
-    char* filename = node -> fileName;
-    int inode = searchForFile(filename, read_block, temp_fil);
-   
-    readBlock(mountedDiskNum, inode, read_block); 
-    //set file_pointer to offset
-    int blocksToRead = (offset - (offset % (BLOCKSIZE-4))) / (BLOCKSIZE-4);
-    int currByte = offset % (BLOCKSIZE - 4);
-    
-    read_block[14] = currByte;
-    read_block[15] = blocksToRead;
-    return writeBlock(mountedDiskNum, inode, read_block);
+    if (offset < 0){
+        unlockFile(node);
+        return ERR_PAST_EOF;
+    }
+    // the pointer is kept in memory until the file is closed
+    node->offset = offset;
+    if (node->runFirst > offset / fs->blockSize){
+        // the cached run is past the new pointer
+        node->runIndex = -1;
+    }
+    unlockFile(node);
+    return SUCCESS;
 }
 
-int tfs_readByte(fileDescriptor FD, char* buffer){
-    char* read_block = (char*)malloc(sizeof(char) * BLOCKSIZE);
-    char* temp_fil = (char*)malloc(sizeof(char) * 9);
-    int blocksToRead, currByte;
+// starts fetching the blocks after a read of done bytes at offset
+// into the cache when the file is being read sequentially
+// each sequential read doubles the window, anything else resets it
+static void readAhead(Node* fil, Run* runs, int count, int file_size, int offset, int done){
+    int index = -1;
+    int first = 0;
+    int last = (offset + done - 1) / fs->blockSize;
+    int fileBlocks = (file_size + fs->blockSize - 1) / fs->blockSize;
 
-    //read from superblock, get curr directory file
-    readBlock(mountedDiskNum,0,read_block);
-    int root_inode = read_block[5];
-    readBlock(mountedDiskNum,root_inode,read_block);
-    int cur_directory = read_block[2];
-    if (cur_directory == 0){
-        free(temp_fil);
-        free(read_block);
-        return ERR_DISK_FULL;
+    if (offset != fil->raNext || done / fs->blockSize >= READ_AHEAD_MAX){
+        // random access, or reads big enough that they already go to
+        // the disk a run at a time
+        fil->raNext = offset + done;
+        fil->raWindow = 0;
+        fil->raBlock = 0;
+        return;
     }
-    readBlock(mountedDiskNum,cur_directory,read_block);
-
-    //find filename from filedescriptor and find correct inode file
-    Node* fil = (findNode(FD));
-    if (fil == NULL)
-    {
-        free(read_block);
-        free(temp_fil); 
-        return ERR_NO_FILE;
+    fil->raNext = offset + done;
+    fil->raWindow = (fil->raWindow == 0) ? READ_AHEAD_MIN : fil->raWindow * 2;
+    if (fil->raWindow > READ_AHEAD_MAX){
+        fil->raWindow = READ_AHEAD_MAX;
+    }
+    int from = (fil->raBlock > last + 1) ? fil->raBlock : last + 1;
+    int to = last + 1 + fil->raWindow;
+    if (to > fileBlocks){
+        to = fileBlocks;
+    }
+    // top the window up once half of it has been read, so the
+    // requests stay a few blocks long
+    if (to - from < fil->raWindow / 2 && to < fileBlocks){
+        return;
+    }
+    while (from < to){
+        index = findRun(runs,count,from,index,&first);
+        if (index < 0){
+            break;
+        }
+        int n = runs[index].len - (from - first);
+        if (n > to - from){
+            n = to - from;
+        }
+        cachePrefetch(fs->diskNum, runs[index].start + from - first, n);
+        from += n;
     }
-    char* filename = fil->fileName;
-    int inode = searchForFile(filename, read_block, temp_fil);
-    readBlock(mountedDiskNum,inode,read_block);
+    fil->raBlock = from;
+}
 
-    //get size of file, file_pointer, and first file_extent from inode 
-    int file_size;
-    if (read_block[12] == 0){
-        file_size = (read_block[13]) * (BLOCKSIZE-4);
-    }else{
-        file_size = read_block[12] + ((read_block[13]-1) * (BLOCKSIZE-4));
-    }
-     
-    char fp_bytes = read_block[14];
-    char fp_blocks = read_block[15];
-    int file_pointer = fp_bytes + fp_blocks*(BLOCKSIZE-4); 
-    int file_extent = read_block[2];
-    if (file_extent == 0){
-        free(temp_fil);
+// reads up to size bytes at offset into buffer
+// *index and *first are where to start looking in the extent map
+// (-1 if unknown) and are left at the run last read from
+// reads through the file pointer pass readAhead
+static int readAt(Node* fil, char* buffer, int size, int offset, int* index, int* first, bool readahead){
+    char* read_block;
+    Run* runs;
+    int err_code;
+
+    if (size <= 0){
+        return 0;
+    }
+    read_block = (char*)malloc(sizeof(char) * fs->blockSize);
+    err_code = metaRead(fil->inode,read_block);
+    if (err_code < 0){
         free(read_block);
-        return ERR_DISK_FULL;
+        return err_code;
     }
 
-    if (file_pointer >= file_size)
-    {
-        //error if file pointer past the end of the file
+    //get size of file from inode 
+    int file_size = getU32(read_block + INODE_SIZE);
+    if (offset >= file_size){
+        //error if reading from past the end of the file
+        free(read_block);
         return ERR_PAST_EOF;
     }
-    else
-    {
-        //change file_pointer to += 1 and write it back to disk
-        tfs_seek(FD, file_pointer + 1);
-
-        //if 0-251, 0 blocks, if 252-503, 1 blocks, etc...
-        blocksToRead = (file_pointer - (file_pointer % (BLOCKSIZE-4))) / (BLOCKSIZE-4);
-        currByte = file_pointer % (BLOCKSIZE - 4);
-        
+    if (size > file_size - offset){
+        size = file_size - offset;
+    }
+    if (file_size <= INLINE_MAX){
+        // the data is right here in the inode
+        memcpy(buffer, read_block + INODE_MAP + offset, size);
+        free(read_block);
+        return size;
+    }
+    int count = loadRuns(read_block,&runs);
+    if (count < 0){
+        free(read_block);
+        return count;
+    }
 
-        // reads the first file extent and continues if necessary 
-        while (blocksToRead >= 0)
-        {
-            //now read_block contains next file_extent 
-            readBlock(mountedDiskNum, file_extent, read_block);
-            file_extent = read_block[2]; //next file_extent file if needed
-            if (file_extent == 0){
-                free(temp_fil);
-                free(read_block);
-                return ERR_DISK_FULL;
+    // whole blocks go straight into buffer, as many as the run holds
+    // in one disk read, partial blocks at either end are copied out
+    int fileBlock = offset / fs->blockSize;
+    int currByte = offset % fs->blockSize;
+    int done = 0;
+    int chunk;
+    while (done < size){
+        *index = findRun(runs,count,fileBlock,*index,first);
+        if (*index < 0){
+            err_code = *index;
+            *index = -1;
+            free(runs);
+            free(read_block);
+            return err_code;
+        }
+        int bNum = runs[*index].start + fileBlock - *first;
+        int whole = (currByte == 0) ? (size - done) / fs->blockSize : 0;
+        if (whole > runs[*index].len - (fileBlock - *first)){
+            whole = runs[*index].len - (fileBlock - *first);
+        }
+        if (whole > 0){
+            err_code = cacheReadBlocks(fs->diskNum, bNum, whole, buffer + done);
+            chunk = whole * fs->blockSize;
+        }else{
+            err_code = cacheReadBlock(fs->diskNum, bNum, read_block);
+            whole = 1;
+            chunk = fs->blockSize - currByte;
+            if (chunk > size - done){
+                chunk = size - done;
             }
-            blocksToRead = blocksToRead - 1;
+            if (err_code == 0){
+                memcpy(buffer + done, read_block + currByte, chunk);
+            }
+        }
+        if (err_code < 0){
+            *index = -1;
+            free(runs);
+            free(read_block);
+            return err_code;
         }
+        done += chunk;
+        currByte = 0;
+        fileBlock += whole;
+    }
+    if (readahead){
+        readAhead(fil,runs,count,file_size,offset,done);
+    }
+    free(runs);
+    free(read_block);
+    return done;
+}
 
-        //copies the current byte pointed by filepointer into buffer?
-        buffer[0] = read_block[currByte+4];
-        buffer[1] = '\0';
-        return 1;
+// reads up to size bytes from the file pointer into buffer
+// returns the number of bytes read
+int tfs_read(fileDescriptor FD, char* buffer, int size){
+    return tfs_read_ctx(&defaultCtx, FD, buffer, size);
+}
 
+int tfs_read_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    Node* fil = lockFile(FD,true);
+    if (fil == NULL){
+        return ERR_NO_FILE;
+    }
+    // start from the run we stopped at last time
+    int done = readAt(fil, buffer, size, fil->offset, &fil->runIndex, &fil->runFirst, true);
+    if (done > 0){
+        // move the file pointer once, past everything we read
+        fil->offset += done;
     }
+    unlockFile(fil);
+    return done;
 }
 
-/*
-int main(){
-    printf("%d\n",tfs_mkfs("disk0.dsk",25620));
-    tfs_mount("disk0.dsk");
-    fileDescriptor fd = tfs_openFile("/ritvik");
-    printf("fd %d\n",fd);
-    fileDescriptor fd2 = tfs_openFile("/joel");
-    printf("fd %d\n",fd);
-    fileDescriptor fd3 = tfs_openFile("/joel");
-    char* message = "hi my name is Joel. Tymon is an asshole! What does life mean? Computer Science is the worst major in the world!AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAABBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB";
-    printf("strlen %d\n", strlen(message));
-    int err = tfs_writeFile(fd,message,strlen(message));
-    printf("writeFile %d\n",err);
-    tfs_readdir(); 
-    
-    char* buffer = (char *)malloc(sizeof(char) * 2);
-    tfs_readByte(fd,buffer);
-    printf("buffer: %s\n",buffer); 
-    tfs_readByte(fd,buffer);
-    printf("buffer: %s\n",buffer); 
-    tfs_seek(fd,509); 
-    tfs_readByte(fd,buffer);
-    printf("buffer: %s\n",buffer); 
-    err = tfs_readByte(fd,buffer);
-    printf("%d\n",err);
-    tfs_deleteFile(fd);
-
-    tfs_createDir("/temp");
-    fileDescriptor fd4 = tfs_openFile("/temp/test");
-    //printf("%d\n",fd4);
-    err = tfs_createDir("/temp/subdir");
-    
-    fileDescriptor fd5 = tfs_openFile("/temp/subdir/anothe");
-    printf("err subdir %d\n", err);
-    err = tfs_rename(fd2,"tymon");
-    printf("err %d\n", err);
-    
-    tfs_readdir(); 
-    tfs_unmount();
-    return 0;
+// reads up to size bytes at offset into buffer
+// the file pointer and anything else in the open file entry stay as they
+// are, so reads of the same file can run side by side
+int tfs_pread(fileDescriptor FD, char* buffer, int size, int offset){
+    return tfs_pread_ctx(&defaultCtx, FD, buffer, size, offset);
+}
+
+int tfs_pread_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size, int offset){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int index = -1;
+    int first = 0;
+    int done = ERR_PAST_EOF;
+    Node* fil = lockFile(FD,false);
+    if (fil == NULL){
+        return ERR_NO_FILE;
+    }
+    if (offset >= 0){
+        done = readAt(fil, buffer, size, offset, &index, &first, false);
+    }
+    unlockFile(fil);
+    return done;
+}
+
+// reads from the file pointer into each buffer of iov in turn, stopping
+// early at the end of the file
+// returns the number of bytes read
+int tfs_readv(fileDescriptor FD, const struct iovec* iov, int iovcnt){
+    return tfs_readv_ctx(&defaultCtx, FD, iov, iovcnt);
+}
+
+int tfs_readv_ctx(tfs_ctx* ctx, fileDescriptor FD, const struct iovec* iov, int iovcnt){
+    if (useCtx(ctx) < 0){
+        return ERR_DISK_CLOSED;
+    }
+    int i;
+    int done = 0;
+    Node* fil = lockFile(FD,true);
+    if (fil == NULL){
+        return ERR_NO_FILE;
+    }
+    for (i=0;i<iovcnt;i++){
+        int n = readAt(fil, iov[i].iov_base, iov[i].iov_len, fil->offset, &fil->runIndex, &fil->runFirst, true);
+        if (n < 0){
+            done = (done > 0) ? done : n;
+            break;
+        }
+        fil->offset += n;
+        done += n;
+        if (n < (int)iov[i].iov_len){
+            break;
+        }
+    }
+    unlockFile(fil);
+    return done;
+}
+
+int tfs_readByte(fileDescriptor FD, char* buffer){
+    return tfs_readByte_ctx(&defaultCtx, FD, buffer);
+}
+
+int tfs_readByte_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer){
+    int err_code = tfs_read_ctx(ctx, FD, buffer, 1);
+    if (err_code < 0){
+        return err_code;
+    }
+    return 1;
 }
-*/
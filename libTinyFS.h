@@ -1,16 +1,37 @@
+#include <sys/uio.h>
+
 #define BLOCKSIZE 256
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
+#define TFS_MOUNT_FULL 0
+#define TFS_MOUNT_QUICK 1
+// durability policies for tfs_setDurability
+#define TFS_DURABLE_NONE 0 // synced by tfs_sync, tfs_syncfs and tfs_unmount
+#define TFS_DURABLE_SYNC 1 // every call that changes the disk syncs it
+#define TFS_DURABLE_GROUP 2 // synced within ms or once blocks are waiting
 typedef int fileDescriptor;
+typedef struct tfs_ctx tfs_ctx;
 
 extern int tfs_mkfs(char* filename, int nBytes);
+extern int tfs_mkfsBlockSize(char* filename, int nBytes, int blockSize);
 extern int tfs_mount(char* diskname);
+extern int tfs_mountMode(char* diskname, int mode);
 extern int tfs_closeFile(fileDescriptor FD);
 extern int tfs_unmount(void);
+extern int tfs_setDurability(int policy, int ms, int blocks);
+extern int tfs_sync(fileDescriptor FD);
+extern int tfs_syncfs(void);
 extern int addNewFile(char* name);
 extern fileDescriptor tfs_openFile(char* name);
 extern int tfs_writeFile(fileDescriptor FD, char* buffer, int size);
+extern int tfs_writev(fileDescriptor FD, const struct iovec* iov, int iovcnt);
+extern int tfs_pwrite(fileDescriptor FD, char* buffer, int size, int offset);
+extern int tfs_append(fileDescriptor FD, char* buffer, int size);
+extern int tfs_truncate(fileDescriptor FD, int size);
 extern int tfs_deleteFile(fileDescriptor FD);
+extern int tfs_read(fileDescriptor FD, char* buffer, int size);
+extern int tfs_pread(fileDescriptor FD, char* buffer, int size, int offset);
+extern int tfs_readv(fileDescriptor FD, const struct iovec* iov, int iovcnt);
 extern int tfs_readByte(fileDescriptor FD, char* buffer);
 extern int tfs_seek(fileDescriptor FD, int offset);
 extern int tfs_readdir();
@@ -18,3 +39,27 @@ extern int tfs_removeAll(char *dirname);
 extern int tfs_removeDir(char *dirname);
 extern int tfs_createDir(char *dirname);
 extern int tfs_rename(fileDescriptor fd, char* newName);
+
+extern tfs_ctx* tfs_mount_ctx(char* diskname);
+extern tfs_ctx* tfs_mountMode_ctx(char* diskname, int mode, int* err);
+extern int tfs_unmount_ctx(tfs_ctx* ctx);
+extern int tfs_setDurability_ctx(tfs_ctx* ctx, int policy, int ms, int blocks);
+extern int tfs_sync_ctx(tfs_ctx* ctx, fileDescriptor FD);
+extern int tfs_syncfs_ctx(tfs_ctx* ctx);
+extern fileDescriptor tfs_openFile_ctx(tfs_ctx* ctx, char* name);
+extern int tfs_closeFile_ctx(tfs_ctx* ctx, fileDescriptor FD);
+extern int tfs_writeFile_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size);
+extern int tfs_writev_ctx(tfs_ctx* ctx, fileDescriptor FD, const struct iovec* iov, int iovcnt);
+extern int tfs_pwrite_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size, int offset);
+extern int tfs_append_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size);
+extern int tfs_truncate_ctx(tfs_ctx* ctx, fileDescriptor FD, int size);
+extern int tfs_deleteFile_ctx(tfs_ctx* ctx, fileDescriptor FD);
+extern int tfs_read_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size);
+extern int tfs_pread_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer, int size, int offset);
+extern int tfs_readv_ctx(tfs_ctx* ctx, fileDescriptor FD, const struct iovec* iov, int iovcnt);
+extern int tfs_readByte_ctx(tfs_ctx* ctx, fileDescriptor FD, char* buffer);
+extern int tfs_seek_ctx(tfs_ctx* ctx, fileDescriptor FD, int offset);
+extern int tfs_readdir_ctx(tfs_ctx* ctx);
+extern int tfs_removeDir_ctx(tfs_ctx* ctx, char *dirname);
+extern int tfs_createDir_ctx(tfs_ctx* ctx, char *dirname);
+extern int tfs_rename_ctx(tfs_ctx* ctx, fileDescriptor fd, char* newName);
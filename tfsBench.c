@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libDisk.h"
+#include "libCache.h"
+#include "libDir.h"
+#include "libTinyFS.h"
+
+#define DIRSCAN_ROUNDS 200000
+#define MOUNT_ROUNDS 2000
+#define MOUNT_DISK "benchMount.dsk"
+#define BLOCKSIZE_DISK "benchBlockSize.dsk"
+#define BLOCKSIZE_FILE (8 << 20)
+#define BLOCKSIZE_CHUNK (64 << 10)
+#define APPEND_DISK "benchAppend.dsk"
+#define APPEND_LINES 2000
+#define APPEND_LINE 64
+#define BATCH_DISK "benchBatch.dsk"
+#define BATCH_BYTES (8 << 20)
+#define BATCH_BLOCKS 256
+#define QDEPTH_DISK "benchQdepth.dsk"
+#define QDEPTH_BYTES (64 << 20)
+#define QDEPTH_BLOCK 4096
+#define QDEPTH_READS 32768
+#define READAHEAD_DISK "benchReadahead.dsk"
+#define READAHEAD_FILE (8 << 20)
+#define READAHEAD_CHUNK 128
+#define SMALL_DISK "benchSmall.dsk"
+#define SMALL_FILES 20
+#define SMALL_ROUNDS 2000
+#define BIGDIR_DISK "benchBigdir.dsk"
+#define BIGDIR_LOOKUPS 20000
+#define THREADS_DISK "benchThreads.dsk"
+#define THREADS_MAX 8
+#define THREADS_FILE (1 << 20)
+#define THREADS_CHUNK 512
+#define THREADS_OPS 200000
+#define DURABILITY_DISK "benchDurability.dsk"
+#define DURABILITY_OPS 2000
+#define DURABILITY_WRITE 64
+#define DURABILITY_MS 10
+#define DURABILITY_BLOCKS 64
+#define CHECKSUM_BYTES (1 << 20)
+#define CHECKSUM_ROUNDS 512
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the directory scan libTinyFS used before libDir: one malloc'd
+ * substring per entry and a prefix compare */
+static char *legacySubstring(char *string, int start, int end)
+{
+    int len = end - start;
+    char *sub = (char *) malloc(sizeof(char) * (len + 1));
+    memcpy(sub, string + start, len);
+    sub[len] = '\0';
+    return sub;
+}
+
+static int legacyCheckDirectory(char *name, char *buffer)
+{
+    int i;
+    char *entry;
+    int len;
+    for (i = DIR_HEADER; i + DIR_ENTRY_SIZE <= BLOCKSIZE; i += DIR_ENTRY_SIZE)
+    {
+        entry = legacySubstring(buffer, i, i + 8);
+        len = strlen(name);
+        if (strncmp(name, entry, len) == 0)
+        {
+            free(entry);
+            return buffer[i + 8];
+        }
+        free(entry);
+    }
+    return 0;
+}
+
+/* lookup cost per directory: every name of a full directory
+ * block plus one missing name, old scan against libDir */
+static void benchDirscan(void)
+{
+    char block[BLOCKSIZE];
+    char names[32][DIR_NAME_LEN + 1];
+    int numNames = 0;
+    int offset;
+    int index, round;
+    long found = 0;
+    double start, legacy, current;
+
+    memset(block, 0, BLOCKSIZE);
+    while ((offset = dirFindFree(block, BLOCKSIZE)) >= 0)
+    {
+        sprintf(names[numNames], "file%d", numNames);
+        dirSetEntry(block, offset, names[numNames], numNames + 3);
+        numNames++;
+    }
+    strcpy(names[numNames++], "missing");
+
+    start = now();
+    for (round = 0; round < DIRSCAN_ROUNDS; round++)
+        for (index = 0; index < numNames; index++)
+            found += legacyCheckDirectory(names[index], block);
+    legacy = now() - start;
+
+    start = now();
+    for (round = 0; round < DIRSCAN_ROUNDS; round++)
+        for (index = 0; index < numNames; index++)
+            found += dirFindEntry(block, BLOCKSIZE, names[index]) >= 0;
+    current = now() - start;
+
+    printf("] dirscan: %d entries per block, %d lookups each\n", numNames - 1,
+           DIRSCAN_ROUNDS * numNames);
+    printf("] malloc+strncmp scan: %.1f ns/lookup\n", legacy * 1e9 / (DIRSCAN_ROUNDS * numNames));
+    printf("] in place scan:       %.1f ns/lookup\n", current * 1e9 / (DIRSCAN_ROUNDS * numNames));
+    if (found == 0)
+        printf("] nothing found\n");
+}
+
+/* mount latency of a nearly full disk, full scan against
+ * a quick mount that trusts the clean flag */
+static void benchMount(void)
+{
+    char data[BLOCKSIZE * 8];
+    char path[16];
+    int index, round;
+    double start, full, quick;
+
+    memset(data, 'm', sizeof(data));
+    tfs_mkfs(MOUNT_DISK, 255 * BLOCKSIZE);
+    tfs_mount(MOUNT_DISK);
+    for (index = 0; index < 20; index++)
+    {
+        sprintf(path, "/f%d", index);
+        tfs_writeFile(tfs_openFile(path), data, sizeof(data));
+    }
+    tfs_unmount();
+
+    start = now();
+    for (round = 0; round < MOUNT_ROUNDS; round++)
+    {
+        tfs_mountMode(MOUNT_DISK, TFS_MOUNT_FULL);
+        tfs_unmount();
+    }
+    full = now() - start;
+
+    start = now();
+    for (round = 0; round < MOUNT_ROUNDS; round++)
+    {
+        tfs_mountMode(MOUNT_DISK, TFS_MOUNT_QUICK);
+        tfs_unmount();
+    }
+    quick = now() - start;
+    remove(MOUNT_DISK);
+
+    printf("] mount: 255 block disk, %d mount+unmount rounds\n", MOUNT_ROUNDS);
+    printf("] full scan:   %.1f us/mount\n", full * 1e6 / MOUNT_ROUNDS);
+    printf("] quick mount: %.1f us/mount\n", quick * 1e6 / MOUNT_ROUNDS);
+}
+
+/* write and read back one large file at 256 B, 4 KB and 64 KB blocks,
+ * reads come through tfs_read in 64 KB chunks after a remount */
+static void benchBlockSize(void)
+{
+    int sizes[] = { 256, 4096, 65536 };
+    char *data = malloc(BLOCKSIZE_FILE);
+    char *chunk = malloc(BLOCKSIZE_CHUNK);
+    int index, done, got, fd;
+    double start, writeTime, readTime;
+
+    memset(data, 'b', BLOCKSIZE_FILE);
+    printf("] blocksize: %d MB file, read in %d KB chunks\n", BLOCKSIZE_FILE >> 20,
+           BLOCKSIZE_CHUNK >> 10);
+    for (index = 0; index < 3; index++)
+    {
+        tfs_mkfsBlockSize(BLOCKSIZE_DISK, 4 * BLOCKSIZE_FILE, sizes[index]);
+        tfs_mount(BLOCKSIZE_DISK);
+
+        start = now();
+        fd = tfs_openFile("/big");
+        tfs_writeFile(fd, data, BLOCKSIZE_FILE);
+        tfs_sync(fd);
+        writeTime = now() - start;
+        tfs_unmount();
+
+        tfs_mountMode(BLOCKSIZE_DISK, TFS_MOUNT_QUICK);
+        start = now();
+        fd = tfs_openFile("/big");
+        done = 0;
+        while ((got = tfs_read(fd, chunk, BLOCKSIZE_CHUNK)) > 0)
+            done += got;
+        readTime = now() - start;
+        tfs_unmount();
+
+        if (done != BLOCKSIZE_FILE)
+            printf("] short read: %d bytes\n", done);
+        printf("] %5d byte blocks: write %7.1f MB/s, read %7.1f MB/s\n", sizes[index],
+               BLOCKSIZE_FILE / writeTime / 1e6, BLOCKSIZE_FILE / readTime / 1e6);
+    }
+    remove(BLOCKSIZE_DISK);
+    free(data);
+    free(chunk);
+}
+
+/* a log file grown one line at a time: rewriting the whole
+ * file with tfs_writeFile against tfs_append */
+static void benchAppend(void)
+{
+    char *log = malloc(APPEND_LINES * APPEND_LINE);
+    int line, fd;
+    double start, rewrite, append;
+
+    memset(log, 'l', APPEND_LINES * APPEND_LINE);
+    tfs_mkfs(APPEND_DISK, 4 << 20);
+    tfs_mount(APPEND_DISK);
+
+    fd = tfs_openFile("/rewrite");
+    start = now();
+    for (line = 1; line <= APPEND_LINES; line++)
+        tfs_writeFile(fd, log, line * APPEND_LINE);
+    rewrite = now() - start;
+
+    fd = tfs_openFile("/append");
+    start = now();
+    for (line = 1; line <= APPEND_LINES; line++)
+        tfs_append(fd, log, APPEND_LINE);
+    append = now() - start;
+
+    tfs_unmount();
+    remove(APPEND_DISK);
+    free(log);
+
+    printf("] append: %d lines of %d bytes\n", APPEND_LINES, APPEND_LINE);
+    printf("] tfs_writeFile of the whole file: %.2f us/line\n", rewrite * 1e6 / APPEND_LINES);
+    printf("] tfs_append:                      %.2f us/line\n", append * 1e6 / APPEND_LINES);
+}
+
+/* the same 8 MB of 256 byte blocks moved through libDisk one
+ * block per call and BATCH_BLOCKS blocks per call */
+static void benchBatch(void)
+{
+    int blocks = BATCH_BYTES / BLOCKSIZE;
+    char *data = malloc(BATCH_BYTES);
+    int disk, bNum;
+    double start, single[2], batched[2];
+
+    memset(data, 'v', BATCH_BYTES);
+    disk = openDisk(BATCH_DISK, BATCH_BYTES);
+
+    start = now();
+    for (bNum = 0; bNum < blocks; bNum++)
+        writeBlock(disk, bNum, data + bNum * BLOCKSIZE);
+    single[0] = now() - start;
+    start = now();
+    for (bNum = 0; bNum < blocks; bNum++)
+        readBlock(disk, bNum, data + bNum * BLOCKSIZE);
+    single[1] = now() - start;
+
+    start = now();
+    for (bNum = 0; bNum < blocks; bNum += BATCH_BLOCKS)
+        writeBlocks(disk, bNum, BATCH_BLOCKS, data + bNum * BLOCKSIZE);
+    batched[0] = now() - start;
+    start = now();
+    for (bNum = 0; bNum < blocks; bNum += BATCH_BLOCKS)
+        readBlocks(disk, bNum, BATCH_BLOCKS, data + bNum * BLOCKSIZE);
+    batched[1] = now() - start;
+
+    closeDisk(disk);
+    remove(BATCH_DISK);
+    free(data);
+
+    printf("] batch: %d MB in %d byte blocks\n", BATCH_BYTES >> 20, BLOCKSIZE);
+    printf("] 1 block per call:   write %7.1f MB/s, read %7.1f MB/s\n",
+           BATCH_BYTES / single[0] / 1e6, BATCH_BYTES / single[1] / 1e6);
+    printf("] %d blocks per call: write %7.1f MB/s, read %7.1f MB/s\n", BATCH_BLOCKS,
+           BATCH_BYTES / batched[0] / 1e6, BATCH_BYTES / batched[1] / 1e6);
+}
+
+/* QDEPTH_READS random 4 KB reads kept depth at a time in flight,
+ * owner[buf] is the token of the read using buffer buf */
+static double qdepthRun(int disk, char *bufs, int depth)
+{
+    DiskCompletion done[DISK_ASYNC_DEPTH];
+    int blocks = QDEPTH_BYTES / QDEPTH_BLOCK;
+    int owner[DISK_ASYNC_DEPTH];
+    int submitted = 0, finished = 0, index, buf, got;
+    double start = now();
+
+    srand(17);
+    for (buf = 0; buf < depth; buf++)
+    {
+        owner[buf] = submitRead(disk, rand() % blocks, 1, bufs + (size_t) buf * QDEPTH_BLOCK);
+        submitted++;
+    }
+    while (finished < QDEPTH_READS)
+    {
+        got = waitCompletions(done, 1, DISK_ASYNC_DEPTH);
+        finished += got;
+        /* each finished read frees its buffer for the next one */
+        for (index = 0; index < got && submitted < QDEPTH_READS; index++)
+        {
+            for (buf = 0; owner[buf] != done[index].token; buf++)
+                ;
+            owner[buf] = submitRead(disk, rand() % blocks, 1, bufs + (size_t) buf * QDEPTH_BLOCK);
+            submitted++;
+        }
+    }
+    return now() - start;
+}
+
+/* random reads against a local image at queue depth 1 to 128,
+ * through io_uring and the worker pool, and readBlock for reference */
+static void benchQdepth(void)
+{
+    int depths[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    int engines[] = { DISK_ASYNC_URING, DISK_ASYNC_THREADS };
+    char *names[] = { "io_uring", "threads" };
+    char *bufs = malloc((size_t) DISK_ASYNC_DEPTH * QDEPTH_BLOCK);
+    int blocks = QDEPTH_BYTES / QDEPTH_BLOCK;
+    DiskCompletion first;
+    int disk, engine, index;
+    double start, elapsed;
+
+    memset(bufs, 'q', (size_t) DISK_ASYNC_DEPTH * QDEPTH_BLOCK);
+    disk = openDisk(QDEPTH_DISK, QDEPTH_BYTES);
+    setDiskBlockSize(disk, QDEPTH_BLOCK);
+    for (index = 0; index < blocks; index++)
+        writeBlock(disk, index, bufs);
+    syncDisk(disk);
+
+    printf("] qdepth: %d random %d KB reads from a %d MB image\n", QDEPTH_READS,
+           QDEPTH_BLOCK >> 10, QDEPTH_BYTES >> 20);
+    srand(17);
+    start = now();
+    for (index = 0; index < QDEPTH_READS; index++)
+        readBlock(disk, rand() % blocks, bufs);
+    elapsed = now() - start;
+    printf("] readBlock:          %8.0f reads/s\n", QDEPTH_READS / elapsed);
+
+    for (engine = 0; engine < 2; engine++)
+    {
+        if (setDiskAsync(engines[engine]) < 0 || submitRead(disk, 0, 1, bufs) < 0)
+        {
+            printf("] %s: not available\n", names[engine]);
+            continue;
+        }
+        /* the first submit starts the engine, reap it before timing */
+        waitCompletions(&first, 1, 1);
+        for (index = 0; index < 8; index++)
+        {
+            elapsed = qdepthRun(disk, bufs, depths[index]);
+            printf("] %-8s depth %3d: %8.0f reads/s\n", names[engine], depths[index],
+                   QDEPTH_READS / elapsed);
+        }
+    }
+    setDiskAsync(DISK_ASYNC_AUTO);
+    closeDisk(disk);
+    remove(QDEPTH_DISK);
+    free(bufs);
+}
+
+/* asks the kernel to forget its cached copy of the image so the
+ * next scan has to go to the device */
+static void dropImage(char *name)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/* a large file scanned front to back in small reads, through
+ * tfs_read (with read-ahead) and tfs_pread at the same offsets
+ * (without), from a cold and a warm page cache */
+static void benchReadahead(void)
+{
+    char *data = malloc(READAHEAD_FILE);
+    char chunk[READAHEAD_CHUNK];
+    int pass, offset, fd;
+    double start, elapsed[2][2];
+
+    memset(data, 'r', READAHEAD_FILE);
+    tfs_mkfs(READAHEAD_DISK, 2 * READAHEAD_FILE);
+    tfs_mount(READAHEAD_DISK);
+    tfs_writeFile(tfs_openFile("/scan"), data, READAHEAD_FILE);
+    tfs_unmount();
+
+    for (pass = 0; pass < 4; pass++)
+    {
+        if (pass < 2)
+            dropImage(READAHEAD_DISK);
+        tfs_mountMode(READAHEAD_DISK, TFS_MOUNT_QUICK);
+        fd = tfs_openFile("/scan");
+        start = now();
+        for (offset = 0; offset < READAHEAD_FILE; offset += READAHEAD_CHUNK)
+        {
+            if (pass % 2 == 0)
+                tfs_pread(fd, chunk, READAHEAD_CHUNK, offset);
+            else
+                tfs_read(fd, chunk, READAHEAD_CHUNK);
+        }
+        elapsed[pass / 2][pass % 2] = now() - start;
+        tfs_unmount();
+    }
+    remove(READAHEAD_DISK);
+    free(data);
+
+    printf("] readahead: %d MB file in %d byte reads, %d byte blocks\n", READAHEAD_FILE >> 20,
+           READAHEAD_CHUNK, BLOCKSIZE);
+    printf("] cold tfs_pread: %7.1f MB/s, tfs_read: %7.1f MB/s\n",
+           READAHEAD_FILE / elapsed[0][0] / 1e6, READAHEAD_FILE / elapsed[0][1] / 1e6);
+    printf("] warm tfs_pread: %7.1f MB/s, tfs_read: %7.1f MB/s\n",
+           READAHEAD_FILE / elapsed[1][0] / 1e6, READAHEAD_FILE / elapsed[1][1] / 1e6);
+}
+
+/* a directory of config-sized files read back after each mount,
+ * inline (150 bytes) against just too big to be inline */
+static void benchSmall(void)
+{
+    int sizes[] = { 150, BLOCKSIZE + 44 };
+    char data[BLOCKSIZE * 2];
+    char path[16];
+    int index, file, round, fd;
+    long misses;
+    double start, elapsed;
+    CacheStats stats;
+
+    memset(data, 's', sizeof(data));
+    printf("] small: %d files, %d mount + read all rounds\n", SMALL_FILES, SMALL_ROUNDS);
+    for (index = 0; index < 2; index++)
+    {
+        tfs_mkfs(SMALL_DISK, 255 * BLOCKSIZE);
+        tfs_mount(SMALL_DISK);
+        for (file = 0; file < SMALL_FILES; file++)
+        {
+            sprintf(path, "/c%d", file);
+            tfs_writeFile(tfs_openFile(path), data, sizes[index]);
+        }
+        tfs_unmount();
+
+        misses = 0;
+        elapsed = 0;
+        for (round = 0; round < SMALL_ROUNDS; round++)
+        {
+            tfs_mountMode(SMALL_DISK, TFS_MOUNT_QUICK);
+            resetCacheStats();
+            start = now();
+            for (file = 0; file < SMALL_FILES; file++)
+            {
+                sprintf(path, "/c%d", file);
+                fd = tfs_openFile(path);
+                tfs_pread(fd, data, sizes[index], 0);
+                tfs_closeFile(fd);
+            }
+            elapsed += now() - start;
+            getCacheStats(&stats);
+            misses += stats.misses;
+            tfs_unmount();
+        }
+        printf("] %3d byte files: %.2f block reads/file, %.2f us/file\n", sizes[index],
+               (double) misses / SMALL_ROUNDS / SMALL_FILES,
+               elapsed * 1e6 / SMALL_ROUNDS / SMALL_FILES);
+    }
+    remove(SMALL_DISK);
+}
+
+/* name lookups in one directory of 1k to 100k entries, block
+ * reads per tfs_openFile (the file inode included) should not
+ * grow with the directory */
+static void benchBigdir(void)
+{
+    int sizes[] = { 1000, 10000, 100000 };
+    char path[48];
+    int index, entry, lookup, fd;
+    double start, created, elapsed;
+    CacheStats stats;
+
+    printf("] bigdir: %d lookups of random names per directory\n", BIGDIR_LOOKUPS);
+    for (index = 0; index < 3; index++)
+    {
+        tfs_mkfs(BIGDIR_DISK, 48 << 20);
+        tfs_mount(BIGDIR_DISK);
+        tfs_createDir("/big");
+        start = now();
+        for (entry = 0; entry < sizes[index]; entry++)
+        {
+            sprintf(path, "/big/entry_with_a_long_name_%d", entry);
+            tfs_closeFile(tfs_openFile(path));
+        }
+        created = now() - start;
+        tfs_unmount();
+
+        tfs_mountMode(BIGDIR_DISK, TFS_MOUNT_QUICK);
+        srand(index);
+        resetCacheStats();
+        start = now();
+        for (lookup = 0; lookup < BIGDIR_LOOKUPS; lookup++)
+        {
+            sprintf(path, "/big/entry_with_a_long_name_%d", rand() % sizes[index]);
+            fd = tfs_openFile(path);
+            tfs_closeFile(fd);
+        }
+        elapsed = now() - start;
+        getCacheStats(&stats);
+        tfs_unmount();
+        printf("] %6d entries: %.2f block reads/lookup (%.2f misses), %.2f us/lookup, %.2f us/create\n",
+               sizes[index], (double) (stats.hits + stats.misses) / BIGDIR_LOOKUPS,
+               (double) stats.misses / BIGDIR_LOOKUPS, elapsed * 1e6 / BIGDIR_LOOKUPS,
+               created * 1e6 / sizes[index]);
+    }
+    remove(BIGDIR_DISK);
+}
+
+typedef struct
+{
+    int fd;
+    int writeEvery; /* every nth op is a tfs_pwrite, 0 for none */
+    unsigned seed;
+} ThreadsArgs;
+
+static void *threadsWorker(void *arg)
+{
+    ThreadsArgs *args = arg;
+    char chunk[THREADS_CHUNK];
+    int op, offset;
+
+    memset(chunk, 'w', THREADS_CHUNK);
+    for (op = 0; op < THREADS_OPS; op++)
+    {
+        offset = rand_r(&args->seed) % (THREADS_FILE / THREADS_CHUNK) * THREADS_CHUNK;
+        if (args->writeEvery && op % args->writeEvery == 0)
+            tfs_pwrite(args->fd, chunk, THREADS_CHUNK, offset);
+        else
+            tfs_pread(args->fd, chunk, THREADS_CHUNK, offset);
+    }
+    return NULL;
+}
+
+/* random reads (and a 1 in 4 write mix) from 1 to THREADS_MAX
+ * threads, each on its own file of one mounted disk */
+static void benchThreads(void)
+{
+    char *data = malloc(THREADS_FILE);
+    char path[16];
+    int mix, threads, index;
+    int fds[THREADS_MAX];
+    pthread_t ids[THREADS_MAX];
+    ThreadsArgs args[THREADS_MAX];
+    double start, elapsed;
+
+    memset(data, 't', THREADS_FILE);
+    tfs_mkfs(THREADS_DISK, 2 * THREADS_MAX * THREADS_FILE);
+    tfs_mount(THREADS_DISK);
+    for (index = 0; index < THREADS_MAX; index++)
+    {
+        sprintf(path, "/t%d", index);
+        fds[index] = tfs_openFile(path);
+        tfs_writeFile(fds[index], data, THREADS_FILE);
+    }
+
+    printf("] threads: %d ops of %d bytes per thread, one %d KB file each\n", THREADS_OPS,
+           THREADS_CHUNK, THREADS_FILE >> 10);
+    for (mix = 0; mix < 2; mix++)
+    {
+        for (threads = 1; threads <= THREADS_MAX; threads *= 2)
+        {
+            start = now();
+            for (index = 0; index < threads; index++)
+            {
+                args[index].fd = fds[index];
+                args[index].writeEvery = mix ? 4 : 0;
+                args[index].seed = index + 1;
+                pthread_create(&ids[index], NULL, threadsWorker, &args[index]);
+            }
+            for (index = 0; index < threads; index++)
+                pthread_join(ids[index], NULL);
+            elapsed = now() - start;
+            printf("] %s %d threads: %10.0f ops/s\n", mix ? "read+write" : "read      ", threads,
+                   (double) threads * THREADS_OPS / elapsed);
+        }
+    }
+    tfs_unmount();
+    remove(THREADS_DISK);
+    free(data);
+}
+
+/* small appends under each durability policy, the time includes
+ * a final tfs_syncfs so every policy ends with the data on disk */
+static void benchDurability(void)
+{
+    static const int policies[3] = {TFS_DURABLE_NONE, TFS_DURABLE_SYNC, TFS_DURABLE_GROUP};
+    static const char *names[3] = {"none ", "sync ", "group"};
+    char line[DURABILITY_WRITE];
+    int index, op, fd;
+    double start, elapsed;
+
+    memset(line, 'd', DURABILITY_WRITE);
+    printf("] durability: %d appends of %d bytes, group commit every %d ms or %d blocks\n",
+           DURABILITY_OPS, DURABILITY_WRITE, DURABILITY_MS, DURABILITY_BLOCKS);
+    for (index = 0; index < 3; index++)
+    {
+        tfs_mkfs(DURABILITY_DISK, 4 << 20);
+        tfs_setDurability(policies[index], DURABILITY_MS, DURABILITY_BLOCKS);
+        tfs_mount(DURABILITY_DISK);
+        fd = tfs_openFile("/log");
+
+        start = now();
+        for (op = 0; op < DURABILITY_OPS; op++)
+            tfs_append(fd, line, DURABILITY_WRITE);
+        tfs_syncfs();
+        elapsed = now() - start;
+        printf("] %s %10.0f appends/s\n", names[index], DURABILITY_OPS / elapsed);
+
+        tfs_unmount();
+        remove(DURABILITY_DISK);
+    }
+    tfs_setDurability(TFS_DURABLE_NONE, 0, 0);
+}
+
+/* CRC32C throughput of each kernel the CPU has, over CHECKSUM_BYTES
+ * cut into buffers of a block or more, CHECKSUM_ROUNDS times */
+static void benchChecksum(void)
+{
+    int kernels[] = { DISK_CRC_HARDWARE, DISK_CRC_SLICING };
+    char *names[] = { "sse4.2   ", "slicing-8" };
+    int sizes[] = { 256, 4096, 65536 };
+    char *data = malloc(CHECKSUM_BYTES);
+    unsigned int crc = 0;
+    int kernel, index, round, at;
+    double start, elapsed;
+
+    for (at = 0; at < CHECKSUM_BYTES; at++)
+        data[at] = (char) (at * 31 + 7);
+    printf("] checksum: CRC32C over %d MB, %d times\n", CHECKSUM_BYTES >> 20, CHECKSUM_ROUNDS);
+    for (kernel = 0; kernel < 2; kernel++)
+    {
+        if (setDiskCrc(kernels[kernel]) < 0)
+        {
+            printf("] %s not on this CPU\n", names[kernel]);
+            continue;
+        }
+        for (index = 0; index < 3; index++)
+        {
+            start = now();
+            for (round = 0; round < CHECKSUM_ROUNDS; round++)
+                for (at = 0; at < CHECKSUM_BYTES; at += sizes[index])
+                    crc ^= crc32c(0, data + at, sizes[index]);
+            elapsed = now() - start;
+            printf("] %s %6d byte buffers: %6.2f GB/s\n", names[kernel], sizes[index],
+                   (double) CHECKSUM_BYTES * CHECKSUM_ROUNDS / elapsed / 1e9);
+        }
+    }
+    setDiskCrc(DISK_CRC_AUTO);
+    /* keeps the loops from being optimized away */
+    if (crc == 1)
+        printf("\n");
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    char *which = (argc > 1) ? argv[1] : "all";
+    int ran = 0;
+
+    if (strcmp(which, "dirscan") == 0 || strcmp(which, "all") == 0)
+    {
+        benchDirscan();
+        ran = 1;
+    }
+    if (strcmp(which, "mount") == 0 || strcmp(which, "all") == 0)
+    {
+        benchMount();
+        ran = 1;
+    }
+    if (strcmp(which, "blocksize") == 0 || strcmp(which, "all") == 0)
+    {
+        benchBlockSize();
+        ran = 1;
+    }
+    if (strcmp(which, "append") == 0 || strcmp(which, "all") == 0)
+    {
+        benchAppend();
+        ran = 1;
+    }
+    if (strcmp(which, "batch") == 0 || strcmp(which, "all") == 0)
+    {
+        benchBatch();
+        ran = 1;
+    }
+    if (strcmp(which, "qdepth") == 0 || strcmp(which, "all") == 0)
+    {
+        benchQdepth();
+        ran = 1;
+    }
+    if (strcmp(which, "readahead") == 0 || strcmp(which, "all") == 0)
+    {
+        benchReadahead();
+        ran = 1;
+    }
+    if (strcmp(which, "small") == 0 || strcmp(which, "all") == 0)
+    {
+        benchSmall();
+        ran = 1;
+    }
+    if (strcmp(which, "bigdir") == 0 || strcmp(which, "all") == 0)
+    {
+        benchBigdir();
+        ran = 1;
+    }
+    if (strcmp(which, "threads") == 0 || strcmp(which, "all") == 0)
+    {
+        benchThreads();
+        ran = 1;
+    }
+    if (strcmp(which, "durability") == 0 || strcmp(which, "all") == 0)
+    {
+        benchDurability();
+        ran = 1;
+    }
+    if (strcmp(which, "checksum") == 0 || strcmp(which, "all") == 0)
+    {
+        benchChecksum();
+        ran = 1;
+    }
+    if (!ran)
+    {
+        printf("] usage: %s [all|dirscan|mount|blocksize|append|batch|qdepth|readahead|small|bigdir|threads|durability|checksum]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -1,21 +1,46 @@
-/* TinyFS demo file
- *  * Foaad Khosmood, Cal Poly / modified Winter 2014
- *   */
+/* TinyFS test program
+ * exits with the number of failed checks
+ */
 
+#define _GNU_SOURCE		/* memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
-#include "tinyFS.h"
+#include "libDisk.h"
+#include "libCache.h"
 #include "libTinyFS.h"
 #include "TinyFS_errno.h"
 
+#define TEST_DISK "tfsTest.dsk"
+#define TEST_DISK_SIZE (256 * 4096)
+#define TEST_DISK2 "tfsTest2.dsk"
+#define CRASH_FILES 40
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do \
+    { \
+      if (!(cond)) \
+	{ \
+	  printf ("] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+	  failures++; \
+	} \
+    } \
+  while (0)
+
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
 int
 fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
 {
   int index = 0, i;
-  if (!inPhrase || !Buffer || size <= 0 || size < strlen (inPhrase))
+  if (!inPhrase || !Buffer || size <= 0 || size < (int) strlen (inPhrase))
     return -1;
 
   while (index < size)
@@ -28,136 +53,1419 @@ fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
   return 0;
 }
 
-/* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
-int main ()
+/* fills buf with a pattern that depends on seed, so files can be told apart */
+static void
+fillPattern (char *buf, int size, int seed)
+{
+  int i;
+  for (i = 0; i < size; i++)
+    buf[i] = (char) ('a' + (i + seed * 7) % 26);
+}
+
+/* 1 if the file holds exactly size bytes of want */
+static int
+fileHolds (char *name, char *want, int size)
+{
+  char *got = malloc (size + 1);
+  int same;
+  fileDescriptor fd = tfs_openFile (name);
+  if (fd < 0)
+    {
+      free (got);
+      return 0;
+    }
+  /* pread leaves the file pointer, which is kept on disk, alone */
+  same = tfs_pread (fd, got, size + 1, 0) == size
+    && memcmp (got, want, size) == 0;
+  tfs_closeFile (fd);
+  free (got);
+  return same;
+}
+
+/* blocks written through one descriptor are there after the disk is
+ * closed and opened again with the other backend */
+static void
+diskWith (int backend)
+{
+  char block[BLOCKSIZE], got[BLOCKSIZE];
+  int disk, i;
+
+  unlink (TEST_DISK);
+  disk = openDiskBackend (TEST_DISK, BLOCKSIZE * 8, backend);
+  CHECK (disk >= 0);
+  for (i = 0; i < 8; i++)
+    {
+      fillPattern (block, BLOCKSIZE, i);
+      CHECK (writeBlock (disk, i, block) == 0);
+    }
+  CHECK (readBlock (disk, 8, got) < 0);
+  CHECK (syncDisk (disk) == 0);
+  CHECK (closeDisk (disk) == 0);
+  CHECK (readBlock (disk, 0, got) < 0);
+
+  /* nBytes 0 opens what is there */
+  disk = openDiskBackend (TEST_DISK, 0, backend == DISK_BACKEND_FILE
+			  ? DISK_BACKEND_MMAP : DISK_BACKEND_FILE);
+  CHECK (disk >= 0);
+  for (i = 7; i >= 0; i--)
+    {
+      fillPattern (block, BLOCKSIZE, i);
+      CHECK (readBlock (disk, i, got) == 0);
+      CHECK (memcmp (got, block, BLOCKSIZE) == 0);
+    }
+  CHECK (closeDisk (disk) == 0);
+}
+
+static void
+testDisk (void)
+{
+  diskWith (DISK_BACKEND_FILE);
+  diskWith (DISK_BACKEND_MMAP);
+  CHECK (openDiskBackend (TEST_DISK, 0, DISK_BACKEND_MMAP + 1) ==
+	 ERR_NO_BACKEND);
+  CHECK (setDiskBackend (DISK_BACKEND_MMAP + 1) == ERR_NO_BACKEND);
+}
+
+/* cached writes reach the disk when flushed or evicted, and reads of
+ * a cached block don't go to the disk */
+static void
+testCache (void)
+{
+  char block[BLOCKSIZE], got[BLOCKSIZE];
+  CacheStats stats;
+  int disk, i, blocks = CACHE_BLOCKS * 2;
+
+  unlink (TEST_DISK);
+  disk = openDisk (TEST_DISK, BLOCKSIZE * blocks);
+  CHECK (disk >= 0);
+  memset (block, 0, BLOCKSIZE);
+  CHECK (writeBlock (disk, 1, block) == 0);
+  fillPattern (block, BLOCKSIZE, 1);
+  CHECK (cacheWriteBlock (disk, 1, block) == 0);
+  CHECK (readBlock (disk, 1, got) == 0);
+  CHECK (got[0] == 0);
+  CHECK (cacheFlush (disk) == 0);
+  CHECK (readBlock (disk, 1, got) == 0);
+  CHECK (memcmp (got, block, BLOCKSIZE) == 0);
+
+  resetCacheStats ();
+  CHECK (cacheReadBlock (disk, 1, got) == 0);
+  getCacheStats (&stats);
+  CHECK (stats.hits == 1 && stats.misses == 0);
+
+  /* twice as many blocks as the cache holds */
+  for (i = 0; i < blocks; i++)
+    {
+      fillPattern (block, BLOCKSIZE, i);
+      CHECK (cacheWriteBlock (disk, i, block) == 0);
+    }
+  getCacheStats (&stats);
+  CHECK (stats.evictions >= blocks - CACHE_BLOCKS);
+  for (i = 0; i < blocks; i++)
+    {
+      fillPattern (block, BLOCKSIZE, i);
+      CHECK (cacheReadBlock (disk, i, got) == 0);
+      CHECK (memcmp (got, block, BLOCKSIZE) == 0);
+    }
+  CHECK (cacheFlush (disk) == 0);
+  CHECK (cacheInvalidate (disk) == 0);
+  CHECK (closeDisk (disk) == 0);
+
+  disk = openDisk (TEST_DISK, 0);
+  for (i = 0; i < blocks; i++)
+    {
+      fillPattern (block, BLOCKSIZE, i);
+      CHECK (readBlock (disk, i, got) == 0);
+      CHECK (memcmp (got, block, BLOCKSIZE) == 0);
+    }
+  CHECK (closeDisk (disk) == 0);
+  CHECK (tfs_syncfs () == ERR_DISK_CLOSED);
+}
+
+/* the demo: two files written, read back after a remount and deleted */
+static void
+testFiles (void)
 {
-  char readBuffer;
   char *afileContent, *bfileContent;	/* buffers to store file content */
   int afileSize = 200;		/* sizes in bytes */
   int bfileSize = 1000;
-
   char phrase1[] = "hello world from (a) file ";
   char phrase2[] = "(b) file content ";
-
+  char readBuffer;
   fileDescriptor aFD, bFD;
-  int i, returnValue;
 
-/* try to mount the disk */
-  if (tfs_mount (DEFAULT_DISK_NAME) < 0)	/* if mount fails */
+  afileContent = (char *) malloc (afileSize * sizeof (char));
+  bfileContent = (char *) malloc (bfileSize * sizeof (char));
+  CHECK (fillBufferWithPhrase (phrase1, afileContent, afileSize) == 0);
+  CHECK (fillBufferWithPhrase (phrase2, bfileContent, bfileSize) == 0);
+
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  aFD = tfs_openFile ("/afile");
+  bFD = tfs_openFile ("/bfile");
+  CHECK (aFD >= 0 && bFD >= 0);
+  /* new files are empty */
+  CHECK (tfs_readByte (aFD, &readBuffer) < 0);
+  CHECK (tfs_writeFile (aFD, afileContent, afileSize) == 0);
+  CHECK (tfs_writeFile (bFD, bfileContent, bfileSize) == 0);
+  CHECK (tfs_closeFile (aFD) == 0);
+  /* aFD is no longer valid */
+  CHECK (tfs_deleteFile (aFD) < 0);
+  CHECK (tfs_closeFile (bFD) == 0);
+  CHECK (fileHolds ("/afile", afileContent, afileSize));
+  CHECK (fileHolds ("/bfile", bfileContent, bfileSize));
+  CHECK (tfs_sync (bFD) == ERR_FILE_UNOPEN);
+  CHECK (tfs_syncfs () == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (fileHolds ("/afile", afileContent, afileSize));
+  CHECK (fileHolds ("/bfile", bfileContent, bfileSize));
+  aFD = tfs_openFile ("/afile");
+  CHECK (tfs_seek (aFD, 0) == 0);
+  CHECK (tfs_readByte (aFD, &readBuffer) >= 0 && readBuffer == 'h');
+  CHECK (tfs_deleteFile (aFD) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  /* the delete made it to disk */
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  aFD = tfs_openFile ("/afile");
+  CHECK (tfs_readByte (aFD, &readBuffer) < 0);
+  tfs_closeFile (aFD);
+  CHECK (fileHolds ("/bfile", bfileContent, bfileSize));
+  CHECK (tfs_unmount () == 0);
+
+  free (bfileContent);
+  free (afileContent);
+}
+
+/* tfs_read goes on from the file pointer, stops at the end of the
+ * file and fails once it is there */
+static void
+testRead (void)
+{
+  char buf[1500], got[1500], c;
+  fileDescriptor fd;
+
+  fillPattern (buf, sizeof (buf), 6);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/r");
+  CHECK (tfs_read (fd, got, 10) == ERR_PAST_EOF);
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_seek (fd, 0) == 0);
+  CHECK (tfs_read (fd, got, 100) == 100);
+  /* across several blocks */
+  CHECK (tfs_read (fd, got + 100, 700) == 700);
+  CHECK (tfs_readByte (fd, got + 800) >= 0);
+  CHECK (tfs_read (fd, got + 801, sizeof (got)) == sizeof (buf) - 801);
+  CHECK (memcmp (got, buf, sizeof (buf)) == 0);
+  CHECK (tfs_read (fd, got, 1) == ERR_PAST_EOF);
+  CHECK (tfs_readByte (fd, &c) == ERR_PAST_EOF);
+  CHECK (tfs_seek (fd, 1499) == 0);
+  CHECK (tfs_read (fd, got, 10) == 1 && got[0] == buf[1499]);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (tfs_read (fd, got, 1) < 0);
+  CHECK (tfs_unmount () == 0);
+}
+
+/* the file pointer is kept while the file is open and stored when it
+ * is closed, rewriting a file replaces its data */
+static void
+testOpenFile (void)
+{
+  char buf[900], got[900];
+  fileDescriptor fd;
+
+  fillPattern (buf, sizeof (buf), 7);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/o");
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_seek (fd, 0) == 0);
+  CHECK (tfs_read (fd, got, 300) == 300);
+  CHECK (tfs_closeFile (fd) == 0);
+  fd = tfs_openFile ("/o");
+  CHECK (tfs_read (fd, got + 300, sizeof (got)) == sizeof (buf) - 300);
+  CHECK (memcmp (got, buf, sizeof (buf)) == 0);
+
+  /* shorter, then longer again */
+  CHECK (tfs_writeFile (fd, buf + 500, 100) == 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/o", buf + 500, 100));
+  fd = tfs_openFile ("/o");
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/o", buf, sizeof (buf)));
+
+  /* an empty file can be deleted, and its descriptor goes with it */
+  fd = tfs_openFile ("/empty");
+  CHECK (fd >= 0);
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (tfs_closeFile (fd) < 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (fileHolds ("/o", buf, sizeof (buf)));
+  CHECK (tfs_unmount () == 0);
+}
+
+/* a path open twice has one descriptor, and closed descriptors are
+ * handed out again */
+static void
+testDescriptors (void)
+{
+  char name[16], path[16];
+  fileDescriptor fds[12], fd;
+  int i;
+
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  for (i = 0; i < 12; i++)
+    {
+      sprintf (name, "/d%d", i);
+      fds[i] = tfs_openFile (name);
+      CHECK (fds[i] > 0);
+      CHECK (i == 0 || fds[i] != fds[i - 1]);
+    }
+  strcpy (path, "/d5");
+  CHECK (tfs_openFile (path) == fds[5]);
+  CHECK (tfs_closeFile (fds[5]) == 0);
+  CHECK (tfs_closeFile (fds[5]) < 0);
+  fd = tfs_openFile ("/d5");
+  CHECK (fd == fds[5]);
+
+  /* a renamed file is found under its new name */
+  CHECK (tfs_rename (fds[3], "e3") >= 0);
+  CHECK (tfs_openFile ("/e3") == fds[3]);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_closeFile (fds[0]) < 0);
+}
+
+/* names looked up before they exist, deleted or renamed resolve to
+ * what is on disk now */
+static void
+testDentries (void)
+{
+  char buf[300], got[300];
+  fileDescriptor fd;
+
+  fillPattern (buf, sizeof (buf), 8);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (tfs_openFile ("/a/b/f") < 0);
+  CHECK (tfs_createDir ("/a") >= 0);
+  CHECK (tfs_createDir ("/a/b") >= 0);
+  fd = tfs_openFile ("/a/b/f");
+  CHECK (fd >= 0);
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/a/b/f", buf, sizeof (buf)));
+
+  /* the old name is free once renamed */
+  fd = tfs_openFile ("/a/b/f");
+  CHECK (tfs_rename (fd, "g") >= 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/a/b/g", buf, sizeof (buf)));
+  fd = tfs_openFile ("/a/b/f");
+  CHECK (tfs_read (fd, got, 1) == ERR_PAST_EOF);
+  CHECK (tfs_deleteFile (fd) == 0);
+
+  CHECK (tfs_removeDir ("/a/b") == ERR_DIR_NOT_EMPTY);
+  fd = tfs_openFile ("/a/b/g");
+  CHECK (tfs_deleteFile (fd) == 0);
+  fd = tfs_openFile ("/a/b/g");
+  CHECK (tfs_read (fd, got, 1) == ERR_PAST_EOF);
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (tfs_removeDir ("/a/b") >= 0);
+  CHECK (tfs_openFile ("/a/b/g") < 0);
+  CHECK (tfs_unmount () == 0);
+
+  /* the image is still whole */
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (tfs_openFile ("/a/b/g") < 0);
+  CHECK (tfs_createDir ("/a/b") >= 0);
+  CHECK (tfs_openFile ("/a/b/g") >= 0);
+  CHECK (tfs_unmount () == 0);
+}
+
+/* a name only matches an entry of the same length */
+static void
+testDirScan (void)
+{
+  char one[40], two[40], three[40];
+  fileDescriptor fd;
+
+  fillPattern (one, sizeof (one), 9);
+  fillPattern (two, sizeof (two), 10);
+  fillPattern (three, sizeof (three), 11);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/dlong");
+  CHECK (tfs_writeFile (fd, one, sizeof (one)) == 0);
+  fd = tfs_openFile ("/d");
+  CHECK (tfs_read (fd, one, 1) == ERR_PAST_EOF);
+  CHECK (tfs_writeFile (fd, two, sizeof (two)) == 0);
+  fd = tfs_openFile ("/dlon");
+  CHECK (tfs_writeFile (fd, three, sizeof (three)) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fillPattern (one, sizeof (one), 9);
+  CHECK (fileHolds ("/dlong", one, sizeof (one)));
+  CHECK (fileHolds ("/d", two, sizeof (two)));
+  CHECK (fileHolds ("/dlon", three, sizeof (three)));
+  CHECK (tfs_unmount () == 0);
+}
+
+/* a write that doesn't fit leaves the file as it was, and blocks a
+ * deleted file gave up can be used again */
+static void
+testAllocator (void)
+{
+  int big = TEST_DISK_SIZE * 2, step = TEST_DISK_SIZE / 40, size, fits = 0;
+  char *buf = malloc (big);
+  fileDescriptor fd, other;
+
+  fillPattern (buf, big, 12);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/a");
+  CHECK (tfs_writeFile (fd, buf, step * 2) == 0);
+  CHECK (tfs_writeFile (fd, buf, big) == ERR_DISK_FULL);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/a", buf, step * 2));
+
+  /* the most the other file can take */
+  other = tfs_openFile ("/b");
+  for (size = step; size < big; size += step)
+    {
+      if (tfs_writeFile (other, buf, size) < 0)
+	break;
+      fits = size;
+    }
+  CHECK (fits > 0);
+  CHECK (tfs_writeFile (other, buf, fits + step) == ERR_DISK_FULL);
+  fd = tfs_openFile ("/a");
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (tfs_writeFile (other, buf, fits + step) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (fileHolds ("/b", buf, fits + step));
+  CHECK (tfs_unmount () == 0);
+  free (buf);
+}
+
+/* a quick mount takes a cleanly unmounted disk as it is and checks
+ * one that was left mounted */
+static void
+testQuickMount (void)
+{
+  char buf[500];
+  pid_t pid;
+  int status;
+
+  fillPattern (buf, sizeof (buf), 13);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_QUICK) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("/q"), buf, sizeof (buf)) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_QUICK) == 0);
+  CHECK (fileHolds ("/q", buf, sizeof (buf)));
+  CHECK (tfs_unmount () == 0);
+
+  /* the child exits with the disk still mounted */
+  pid = fork ();
+  if (pid == 0)
     {
-      tfs_mkfs (DEFAULT_DISK_NAME, DEFAULT_DISK_SIZE);	/* then make a new disk */
-      if (tfs_mount (DEFAULT_DISK_NAME) < 0)	/* if we still can't open it... */
+      if (tfs_mount (TEST_DISK) < 0)
+	_exit (1);
+      _exit (0);
+    }
+  CHECK (waitpid (pid, &status, 0) == pid);
+  CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_QUICK) == 0);
+  CHECK (fileHolds ("/q", buf, sizeof (buf)));
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (tfs_unmount () == 0);
+}
+
+/* files far past block 255 survive a remount, and an image from
+ * before the format version was stored is refused */
+static void
+testWideBlocks (void)
+{
+  int size = 300 * 1024, i, raw;
+  char *buf = malloc (size), name[8], old = 1;
+
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  for (i = 0; i < 3; i++)
+    {
+      sprintf (name, "/w%d", i);
+      fillPattern (buf, size, 14 + i);
+      CHECK (tfs_writeFile (tfs_openFile (name), buf, size) == 0);
+    }
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  for (i = 0; i < 3; i++)
+    {
+      sprintf (name, "/w%d", i);
+      fillPattern (buf, size, 14 + i);
+      CHECK (fileHolds (name, buf, size));
+    }
+  CHECK (tfs_unmount () == 0);
+
+  /* the version is a u32 at byte 8 of the superblock */
+  raw = open (TEST_DISK, O_RDWR);
+  CHECK (pwrite (raw, &old, 1, 8) == 1);
+  close (raw);
+  CHECK (tfs_mount (TEST_DISK) == ERR_OLD_FORMAT);
+  free (buf);
+}
+
+/* every power of two from 256 B to 64 KB formats, holds a file and
+ * mounts again; other sizes are refused */
+static void
+testBlockSizes (void)
+{
+  int size = 200 * 1024, bs, disk;
+  char *buf = malloc (size);
+
+  fillPattern (buf, size, 17);
+  for (bs = DISK_MIN_BLOCKSIZE; bs <= DISK_MAX_BLOCKSIZE; bs *= 4)
+    {
+      /* the journal takes at least 8 blocks */
+      disk = bs * 64 > TEST_DISK_SIZE ? bs * 64 : TEST_DISK_SIZE;
+      unlink (TEST_DISK);
+      CHECK (tfs_mkfsBlockSize (TEST_DISK, disk, bs) == 0);
+      CHECK (tfs_mount (TEST_DISK) == 0);
+      CHECK (tfs_writeFile (tfs_openFile ("/b"), buf, size) == 0);
+      CHECK (tfs_writeFile (tfs_openFile ("/s"), buf, 10) == 0);
+      CHECK (tfs_unmount () == 0);
+      CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+      CHECK (fileHolds ("/b", buf, size));
+      CHECK (fileHolds ("/s", buf, 10));
+      CHECK (tfs_unmount () == 0);
+    }
+  CHECK (tfs_mkfsBlockSize (TEST_DISK, TEST_DISK_SIZE, 128) == ERR_BLOCKSIZE);
+  CHECK (tfs_mkfsBlockSize (TEST_DISK, TEST_DISK_SIZE, 768) == ERR_BLOCKSIZE);
+  CHECK (tfs_mkfsBlockSize (TEST_DISK, TEST_DISK_SIZE, DISK_MAX_BLOCKSIZE * 2)
+	 == ERR_BLOCKSIZE);
+  free (buf);
+}
+
+/* a file written into a disk full of holes takes many runs, and is
+ * read back whole and from anywhere in it */
+static void
+testExtents (void)
+{
+  int size = 320 * 256, i, j;
+  char *buf = malloc (size), name[16], small[256], c;
+  fileDescriptor fd;
+
+  fillPattern (buf, size, 18);
+  fillPattern (small, sizeof (small), 19);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  /* an inode and a data block each, every other one deleted */
+  for (i = 0; i < 16; i++)
+    {
+      sprintf (name, "/d%d", i);
+      CHECK (tfs_createDir (name) >= 0);
+      for (j = 0; j < 16; j++)
 	{
-	  perror ("failed to open disk");	/* then just exit */
-	  return;
+	  sprintf (name, "/d%d/f%d", i, j);
+	  CHECK (tfs_writeFile (tfs_openFile (name), small, sizeof (small))
+		 == 0);
 	}
     }
+  for (i = 0; i < 16; i++)
+    for (j = 0; j < 16; j += 2)
+      {
+	sprintf (name, "/d%d/f%d", i, j);
+	CHECK (tfs_deleteFile (tfs_openFile (name)) == 0);
+      }
+  fd = tfs_openFile ("/big");
+  CHECK (tfs_writeFile (fd, buf, size) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/big", buf, size));
+  fd = tfs_openFile ("/big");
+  for (i = size - 1; i >= 0; i -= 997)
+    {
+      CHECK (tfs_seek (fd, i) == 0);
+      CHECK (tfs_readByte (fd, &c) >= 0 && c == buf[i]);
+    }
+  CHECK (tfs_deleteFile (fd) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (tfs_unmount () == 0);
+  free (buf);
+}
 
+/* partial writes, appends and truncates against a copy kept here,
+ * bytes never written read back as zero */
+static void
+testPartialWrites (void)
+{
+  int max = 4000, len = 0;
+  char *model = calloc (max, 1), *data = malloc (max), *got = malloc (max);
+  fileDescriptor fd;
 
-  afileContent = (char *) malloc (afileSize * sizeof (char));
-  if (fillBufferWithPhrase (phrase1, afileContent, afileSize) < 0)
+  fillPattern (data, max, 20);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/p");
+  CHECK (tfs_writeFile (fd, data, 1000) == 0);
+  memcpy (model, data, 1000);
+  len = 1000;
+  /* inside one block, across blocks, and past the end */
+  CHECK (tfs_pwrite (fd, data + 7, 10, 3) == 10);
+  memcpy (model + 3, data + 7, 10);
+  CHECK (tfs_pwrite (fd, data + 100, 700, 200) == 700);
+  memcpy (model + 200, data + 100, 700);
+  CHECK (tfs_pwrite (fd, data, 300, 900) == 300);
+  memcpy (model + 900, data, 300);
+  len = 1200;
+  CHECK (tfs_append (fd, data + 50, 555) == 555);
+  memcpy (model + len, data + 50, 555);
+  len += 555;
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (fileHolds ("/p", model, len));
+
+  /* shrink into a block, then grow past it again */
+  fd = tfs_openFile ("/p");
+  CHECK (tfs_seek (fd, 0) == 0);
+  CHECK (tfs_truncate (fd, 333) == 0);
+  memset (model + 333, 0, len - 333);
+  len = 333;
+  CHECK (tfs_truncate (fd, 600) == 0);
+  len = 600;
+  CHECK (tfs_pwrite (fd, data, 10, 2500) == 10);
+  memcpy (model + 2500, data, 10);
+  len = 2510;
+  CHECK (tfs_pwrite (fd, data, 0, 0) == 0);
+  CHECK (tfs_pwrite (fd, data, -1, 0) < 0);
+
+  /* none of it moved the file pointer */
+  CHECK (tfs_read (fd, got, 100) == 100);
+  CHECK (memcmp (got, model, 100) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/p", model, len));
+  fd = tfs_openFile ("/p");
+  CHECK (tfs_truncate (fd, 0) == 0);
+  CHECK (tfs_append (fd, data, 20) == 20);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/p", data, 20));
+  CHECK (tfs_unmount () == 0);
+  free (model);
+  free (data);
+  free (got);
+}
+
+/* pread reads at its offset and leaves the file pointer where tfs_read
+ * left it */
+static void
+testPread (void)
+{
+  char buf[3000], got[3000];
+  fileDescriptor fd;
+  int at;
+
+  fillPattern (buf, sizeof (buf), 21);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/r");
+  CHECK (tfs_pread (fd, got, 1, 0) == ERR_PAST_EOF);
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_seek (fd, 0) == 0);
+  CHECK (tfs_read (fd, got, 10) == 10);
+  for (at = sizeof (buf) - 700; at >= 0; at -= 311)
     {
-      perror ("failed");
-      return;
+      CHECK (tfs_pread (fd, got + at, 700, at) == 700);
+      CHECK (memcmp (got + at, buf + at, 700) == 0);
     }
+  CHECK (tfs_pread (fd, got, 100, sizeof (buf) - 40) == 40);
+  CHECK (tfs_pread (fd, got, 100, sizeof (buf)) == ERR_PAST_EOF);
+  CHECK (tfs_pread (fd, got, 100, -1) == ERR_PAST_EOF);
+  CHECK (tfs_read (fd, got, 10) == 10);
+  CHECK (memcmp (got, buf + 10, 10) == 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  CHECK (tfs_pread (fd, got, 1, 0) < 0);
+  CHECK (tfs_unmount () == 0);
+}
 
-  bfileContent = (char *) malloc (bfileSize * sizeof (char));
-  if (fillBufferWithPhrase (phrase2, bfileContent, bfileSize) < 0)
+/* runs of blocks in one call, in more buffers than one preadv takes,
+ * through both backends and the cache */
+static void
+blocksWith (int backend)
+{
+  int count = 1500, i;
+  char *buf = malloc (count * BLOCKSIZE), *got = malloc (count * BLOCKSIZE);
+  struct iovec *iov = malloc (count * 2 * sizeof (struct iovec));
+  int disk;
+
+  fillPattern (buf, count * BLOCKSIZE, 22 + backend);
+  unlink (TEST_DISK);
+  disk = openDiskBackend (TEST_DISK, count * BLOCKSIZE, backend);
+  CHECK (disk >= 0);
+  CHECK (writeBlocks (disk, 0, count, buf) == 0);
+  CHECK (readBlocks (disk, 0, count, got) == 0);
+  CHECK (memcmp (got, buf, count * BLOCKSIZE) == 0);
+  CHECK (readBlocks (disk, 1, count, got) < 0);
+
+  /* every block in two uneven halves, read back backwards */
+  for (i = 0; i < count; i++)
     {
-      perror ("failed");
-      return;
+      iov[2 * i].iov_base = buf + (count - 1 - i) * BLOCKSIZE;
+      iov[2 * i].iov_len = 100;
+      iov[2 * i + 1].iov_base = buf + (count - 1 - i) * BLOCKSIZE + 100;
+      iov[2 * i + 1].iov_len = BLOCKSIZE - 100;
     }
+  CHECK (writeBlocksv (disk, 0, iov, count * 2) == 0);
+  for (i = 0; i < count; i++)
+    iov[2 * i].iov_base = got + (count - 1 - i) * BLOCKSIZE,
+      iov[2 * i + 1].iov_base = got + (count - 1 - i) * BLOCKSIZE + 100;
+  memset (got, 0, count * BLOCKSIZE);
+  CHECK (readBlocksv (disk, 0, iov, count * 2) == 0);
+  CHECK (memcmp (got, buf, count * BLOCKSIZE) == 0);
+  iov[0].iov_len = 99;
+  CHECK (readBlocksv (disk, 0, iov, count * 2) < 0);
 
-/* print content of files for debugging */
-  printf
-    ("(a) File content: %s\n(b) File content: %s\nReady to store in TinyFS\n",
-     afileContent, bfileContent);
+  /* the cache never holds an older copy than the disk */
+  CHECK (cacheWriteBlock (disk, 5, buf) == 0);
+  CHECK (cacheReadBlocks (disk, 4, 3, got) == 0);
+  CHECK (memcmp (got + BLOCKSIZE, buf, BLOCKSIZE) == 0);
+  CHECK (cacheWriteBlocks (disk, 5, 1, buf + BLOCKSIZE) == 0);
+  CHECK (cacheReadBlock (disk, 5, got) == 0);
+  CHECK (memcmp (got, buf + BLOCKSIZE, BLOCKSIZE) == 0);
+  CHECK (cacheFlush (disk) == 0);
+  CHECK (readBlock (disk, 5, got) == 0);
+  CHECK (memcmp (got, buf + BLOCKSIZE, BLOCKSIZE) == 0);
+  CHECK (cacheInvalidate (disk) == 0);
+  CHECK (closeDisk (disk) == 0);
+  free (buf);
+  free (got);
+  free (iov);
+}
 
+/* tfs_writev replaces the file with its buffers, tfs_readv scatters
+ * from the file pointer */
+static void
+testVectored (void)
+{
+  char buf[2000], got[2000];
+  struct iovec iov[3];
+  fileDescriptor fd;
 
-/* read or write files to TinyFS */
+  blocksWith (DISK_BACKEND_FILE);
+  blocksWith (DISK_BACKEND_MMAP);
 
+  fillPattern (buf, sizeof (buf), 24);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/v");
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 3;
+  iov[1].iov_base = buf + 3;
+  iov[1].iov_len = 1500;
+  iov[2].iov_base = buf + 1503;
+  iov[2].iov_len = sizeof (buf) - 1503;
+  CHECK (tfs_writev (fd, iov, 3) == 0);
+  CHECK (fileHolds ("/v", buf, sizeof (buf)));
+  fd = tfs_openFile ("/v");
+  memset (got, 0, sizeof (got));
+  iov[0].iov_base = got;
+  iov[1].iov_base = got + 3;
+  iov[2].iov_base = got + 1503;
+  CHECK (tfs_seek (fd, 0) == 0);
+  CHECK (tfs_readv (fd, iov, 3) == sizeof (buf));
+  CHECK (memcmp (got, buf, sizeof (buf)) == 0);
+  CHECK (tfs_readv (fd, iov, 3) == ERR_PAST_EOF);
+  CHECK (tfs_seek (fd, 1000) == 0);
+  CHECK (tfs_readv (fd, iov, 3) == sizeof (buf) - 1000);
+  CHECK (memcmp (got, buf + 1000, sizeof (buf) - 1000) == 0);
+  iov[1].iov_len = -1;
+  CHECK (tfs_writev (fd, iov, 3) == ERR_NBYTES);
+  CHECK (tfs_unmount () == 0);
+}
 
-  aFD = tfs_openFile ("/afile");
+/* requests queued with submitWrite and submitRead come back once
+ * each with their own token, under the engine asked for */
+static void
+asyncWith (int engine)
+{
+  int count = 64, per = 8, i, n, seen = 0;
+  char *buf = malloc (count * BLOCKSIZE), *got = malloc (count * BLOCKSIZE);
+  char *queued = malloc (DISK_ASYNC_DEPTH * BLOCKSIZE);
+  int tokens[DISK_ASYNC_DEPTH + 1];
+  DiskCompletion done[DISK_ASYNC_DEPTH + 1];
+  int disk;
 
-  printf("%d\n",aFD);
-  if (aFD < 0)
+  CHECK (setDiskAsync (engine) == 0);
+  fillPattern (buf, count * BLOCKSIZE, 25 + engine);
+  memset (got, 0, count * BLOCKSIZE);
+  unlink (TEST_DISK);
+  disk = openDisk (TEST_DISK, count * BLOCKSIZE);
+  CHECK (disk >= 0);
+  CHECK (pollCompletions (done, 1) == 0);
+  for (i = 0; i < count / per; i++)
+    {
+      tokens[i] = submitWrite (disk, i * per, per, buf + i * per * BLOCKSIZE);
+      CHECK (tokens[i] >= 0);
+    }
+  if (engine != DISK_ASYNC_AUTO)
+    CHECK (diskAsyncEngine () == engine);
+  /* the same number of completions, each token once */
+  while (seen < count / per)
     {
-      perror ("tfs_openFile failed on afile");
+      n = waitCompletions (done, 1, count);
+      CHECK (n > 0);
+      if (n <= 0)
+	break;
+      for (i = 0; i < n; i++)
+	CHECK (done[i].result == 0 && done[i].token >= tokens[0]
+	       && done[i].token <= tokens[count / per - 1]);
+      seen += n;
     }
+  CHECK (seen == count / per);
+  for (i = 0; i < count / per; i++)
+    CHECK (submitRead (disk, i * per, per, got + i * per * BLOCKSIZE) >= 0);
+  CHECK (waitCompletions (done, count / per, count) == count / per);
+  CHECK (memcmp (got, buf, count * BLOCKSIZE) == 0);
+  CHECK (submitRead (disk, count - 1, 2, got) < 0
+	 || (waitCompletions (done, 1, 1) == 1 && done[0].result < 0));
 
-/* now, was there already a file named "afile" that had some content? If we can read from it, yes!
- *  * If we can't read from it, it presumably means the file was empty.
- *   * If the size is 0 (all new files are sized 0) then any "readByte()" should fail, so 
- *    * it's a new file and empty */
-  if (tfs_readByte (aFD, &readBuffer) < 0)
+  /* a full queue refuses more, each request with its own buffer */
+  for (i = 0; i < DISK_ASYNC_DEPTH; i++)
+    CHECK (submitRead (disk, i % count, 1, queued + i * BLOCKSIZE) >= 0);
+  CHECK (submitRead (disk, 0, 1, got) == ERR_ASYNC_FULL);
+  CHECK (setDiskAsync (engine) == ERR_ASYNC_FULL);
+  for (seen = 0; seen < DISK_ASYNC_DEPTH; seen += n)
     {
-      /* if readByte() fails, there was no afile, so we write to it */
-      if (tfs_writeFile (aFD, afileContent, afileSize) < 0)
+      n = waitCompletions (done, 1, DISK_ASYNC_DEPTH);
+      CHECK (n > 0);
+      if (n <= 0)
+	break;
+    }
+  CHECK (closeDisk (disk) == 0);
+  free (buf);
+  free (got);
+  free (queued);
+}
+
+static void
+testAsync (void)
+{
+  asyncWith (DISK_ASYNC_THREADS);
+  asyncWith (DISK_ASYNC_AUTO);
+  CHECK (setDiskAsync (DISK_ASYNC_THREADS + 1) == ERR_NO_BACKEND);
+  CHECK (setDiskAsync (DISK_ASYNC_AUTO) == 0);
+}
+
+/* sequential reads prefetch ahead and still see writes made in
+ * between, and detached requests only come back through waitRequest */
+static void
+testReadAhead (void)
+{
+  int size = 256 * 1024, at, n, token, disk;
+  char *buf = malloc (size), *got = malloc (size);
+  CacheStats stats;
+  DiskCompletion done;
+  struct iovec iov;
+  fileDescriptor fd;
+
+  fillPattern (buf, size, 27);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/ra");
+  CHECK (tfs_writeFile (fd, buf, size) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/ra");
+  CHECK (tfs_seek (fd, 0) == 0);
+  resetCacheStats ();
+  for (at = 0; at < size; at += n)
+    {
+      n = tfs_read (fd, got + at, 100);
+      CHECK (n > 0);
+      if (n <= 0)
+	break;
+      /* a block just ahead changes under the read-ahead */
+      if (at == 50 * 1000)
 	{
-	  perror ("tfs_writeFile failed");
+	  CHECK (tfs_pwrite (fd, buf + 7, 100, at + 600) == 100);
+	  memcpy (buf + at + 600, buf + 7, 100);
 	}
-      else
-	printf ("Successfully written to afile\n");
+    }
+  getCacheStats (&stats);
+  CHECK (stats.prefetches > 0);
+  CHECK (memcmp (got, buf, size) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  disk = openDisk (TEST_DISK, 0);
+  CHECK (waitRequest (12345) == ERR_BAD_TOKEN);
+  iov.iov_base = got;
+  iov.iov_len = BLOCKSIZE * 4;
+  token = submitReadvDetached (disk, 0, &iov, 1);
+  CHECK (token >= 0);
+  CHECK (pollCompletions (&done, 1) == 0);
+  CHECK (waitRequest (token) == 0);
+  CHECK (waitRequest (token) == ERR_BAD_TOKEN);
+  CHECK (closeDisk (disk) == 0);
+  free (buf);
+  free (got);
+}
+
+/* files around the inline size (blockSize - 32) keep their bytes as
+ * they move into a block and back, and pass the full check */
+static void
+testInline (void)
+{
+  int limit = BLOCKSIZE - 32;
+  char buf[1000], model[1000];
+  fileDescriptor fd;
 
-      
+  fillPattern (buf, sizeof (buf), 28);
+  memset (model, 0, sizeof (model));
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("/at"), buf, limit) == 0);
+  CHECK (tfs_writeFile (tfs_openFile ("/over"), buf, limit + 1) == 0);
+  fd = tfs_openFile ("/grow");
+  CHECK (tfs_writeFile (fd, buf, 10) == 0);
+  memcpy (model, buf, 10);
+  CHECK (tfs_pwrite (fd, buf + 1, 5, 3) == 5);
+  memcpy (model + 3, buf + 1, 5);
+  CHECK (tfs_append (fd, buf, limit - 10) == limit - 10);
+  memcpy (model + 10, buf, limit - 10);
+  CHECK (fileHolds ("/grow", model, limit));
+  /* one byte more spills it into a block */
+  fd = tfs_openFile ("/grow");
+  CHECK (tfs_append (fd, buf + 50, 1) == 1);
+  model[limit] = buf[50];
+  CHECK (tfs_pwrite (fd, buf, 300, 400) == 300);
+  memcpy (model + 400, buf, 300);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/at", buf, limit));
+  CHECK (fileHolds ("/over", buf, limit + 1));
+  CHECK (fileHolds ("/grow", model, 700));
+  /* and back in, with the bytes past the end gone */
+  fd = tfs_openFile ("/grow");
+  CHECK (tfs_truncate (fd, 100) == 0);
+  CHECK (tfs_truncate (fd, 150) == 0);
+  memset (model + 100, 0, 600);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/grow", model, 150));
+  fd = tfs_openFile ("/over");
+  CHECK (tfs_writeFile (fd, buf, 5) == 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/over", buf, 5));
+  CHECK (tfs_unmount () == 0);
+}
+
+#define BIG_DIR 1500
+
+/* long names in one directory, enough to split leaves many times and
+ * move the table out of the inode */
+static void
+testBigDirectory (void)
+{
+  char name[64], data[8];
+  fileDescriptor fd;
+  int i;
+
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (tfs_createDir ("/dir") >= 0);
+  for (i = 0; i < BIG_DIR; i++)
+    {
+      /* 28 characters after the slash */
+      sprintf (name, "/dir/entry-%022d", i);
+      fd = tfs_openFile (name);
+      CHECK (fd >= 0);
+      sprintf (data, "%d", i);
+      CHECK (tfs_writeFile (fd, data, strlen (data)) == 0);
+      CHECK (tfs_closeFile (fd) == 0);
     }
-  else
+  CHECK (tfs_openFile ("/dir/entry-00000000000000000000000") < 0);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  for (i = 0; i < BIG_DIR; i += 2)
+    {
+      sprintf (name, "/dir/entry-%022d", i);
+      CHECK (tfs_deleteFile (tfs_openFile (name)) == 0);
+    }
+  for (i = 1; i < BIG_DIR; i += 2)
     {
-      /* if yes, then just read and print the rest of afile that was already there */
-      printf ("\n*** reading afile from TinyFS: \n%c", readBuffer);	/* print the first byte already read */
-      /* now print the rest of it, byte by byte */
-      while (tfs_readByte (aFD, &readBuffer) >= 0)	/* go until readByte fails */
-	printf ("%c", readBuffer);
+      sprintf (name, "/dir/entry-%022d", i);
+      sprintf (data, "%d", i);
+      CHECK (fileHolds (name, data, strlen (data)));
+    }
+  /* a rename never clobbers a name that is there */
+  fd = tfs_openFile ("/dir/entry-0000000000000000000001");
+  CHECK (tfs_rename (fd, "entry-0000000000000000000003") < 0);
+  CHECK (tfs_rename (fd, "renamed") >= 0);
+  CHECK (fileHolds ("/dir/renamed", "1", 1));
+  CHECK (tfs_removeDir ("/dir") == ERR_DIR_NOT_EMPTY);
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/dir/renamed", "1", 1));
+  CHECK (tfs_deleteFile (tfs_openFile ("/dir/renamed")) == 0);
+  for (i = 3; i < BIG_DIR; i += 2)
+    {
+      sprintf (name, "/dir/entry-%022d", i);
+      CHECK (tfs_deleteFile (tfs_openFile (name)) == 0);
+    }
+  CHECK (tfs_removeDir ("/dir") >= 0);
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (tfs_unmount () == 0);
+}
 
-      /* close file */
-      if (tfs_closeFile (aFD) < 0)
-	perror ("tfs_closeFile failed");
+#define THREADS 8
+#define THREAD_FILES 20
+#define SHARED_PIECE 1000
 
-      /* now try to delete the file. It should fail because aFD is no longer valid */
-      if (tfs_deleteFile (aFD) < 0)
-	{
-	  aFD = tfs_openFile ("afile");	/* so we open it again */
-	  if (tfs_deleteFile (aFD) < 0)
-	    perror ("tfs_deleteFile failed");
+/* one thread's own files, and its piece of the shared one; returns the
+ * number of bad results since CHECK isn't thread safe */
+static void *
+threadWork (void *arg)
+{
+  long id = (long) arg, bad = 0;
+  char name[32], buf[SHARED_PIECE], got[SHARED_PIECE];
+  fileDescriptor fd;
+  int i, round;
 
+  fillPattern (buf, sizeof (buf), (int) id);
+  for (round = 0; round < 3; round++)
+    {
+      for (i = 0; i < THREAD_FILES; i++)
+	{
+	  sprintf (name, "/t%ld/f%d", id, i);
+	  fd = tfs_openFile (name);
+	  bad += fd < 0;
+	  bad += tfs_writeFile (fd, buf, 100 + i * 40) != 0;
+	  bad += tfs_closeFile (fd) != 0;
 	}
-      else
-	perror ("tfs_deleteFile should have failed");
-
+      for (i = 0; i < THREAD_FILES; i++)
+	{
+	  sprintf (name, "/t%ld/f%d", id, i);
+	  bad += !fileHolds (name, buf, 100 + i * 40);
+	  if (round < 2 && i % 2 == 0)
+	    bad += tfs_deleteFile (tfs_openFile (name)) != 0;
+	}
+      fd = tfs_openFile ("/shared");
+      bad += tfs_pwrite (fd, buf, sizeof (buf), id * SHARED_PIECE)
+	!= sizeof (buf);
+      bad += tfs_pread (fd, got, sizeof (got), id * SHARED_PIECE)
+	!= sizeof (got);
+      bad += memcmp (got, buf, sizeof (got)) != 0;
     }
+  return (void *) bad;
+}
 
-/* now bfile tests */
-  bFD = tfs_openFile ("/bfile");
+/* threads working in their own directories and in one shared file */
+static void
+testThreads (void)
+{
+  pthread_t threads[THREADS];
+  char *whole = calloc (THREADS, SHARED_PIECE);
+  char name[32];
+  fileDescriptor fd;
+  void *bad;
+  long i;
 
-  if (bFD < 0)
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/shared");
+  CHECK (tfs_writeFile (fd, whole, THREADS * SHARED_PIECE) == 0);
+  CHECK (tfs_closeFile (fd) == 0);
+  for (i = 0; i < THREADS; i++)
     {
-      perror ("tfs_openFile failed on bfile");
+      sprintf (name, "/t%ld", i);
+      CHECK (tfs_createDir (name) >= 0);
     }
+  for (i = 0; i < THREADS; i++)
+    CHECK (pthread_create (&threads[i], NULL, threadWork, (void *) i) == 0);
+  for (i = 0; i < THREADS; i++)
+    {
+      CHECK (pthread_join (threads[i], &bad) == 0);
+      CHECK (bad == NULL);
+      fillPattern (whole + i * SHARED_PIECE, SHARED_PIECE, (int) i);
+    }
+  CHECK (tfs_unmount () == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/shared", whole, THREADS * SHARED_PIECE));
+  CHECK (fileHolds ("/t3/f19", whole + 3 * SHARED_PIECE, 100 + 19 * 40));
+  CHECK (tfs_unmount () == 0);
+  free (whole);
+}
 
-  if (tfs_readByte (bFD, &readBuffer) < 0)
+/* two disks mounted side by side keep their own files */
+static void
+testContexts (void)
+{
+  char one[500], two[500];
+  tfs_ctx *a, *b;
+  fileDescriptor fa, fb;
+  int err = 0;
+
+  fillPattern (one, sizeof (one), 4);
+  fillPattern (two, sizeof (two), 5);
+  unlink (TEST_DISK);
+  unlink (TEST_DISK2);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mkfsBlockSize (TEST_DISK2, 512 * 200, 512) == 0);
+  a = tfs_mount_ctx (TEST_DISK);
+  b = tfs_mountMode_ctx (TEST_DISK2, TFS_MOUNT_FULL, &err);
+  CHECK (a != NULL && b != NULL && err == 0);
+  if (a == NULL || b == NULL)
+    return;
+  /* a disk is only mounted once */
+  CHECK (tfs_mountMode_ctx (TEST_DISK, TFS_MOUNT_QUICK, &err) == NULL);
+  CHECK (err == ERR_DISK_MOUNTED);
+
+  fa = tfs_openFile_ctx (a, "/same");
+  fb = tfs_openFile_ctx (b, "/same");
+  CHECK (fa >= 0 && fb >= 0);
+  CHECK (tfs_writeFile_ctx (a, fa, one, sizeof (one)) == 0);
+  CHECK (tfs_writeFile_ctx (b, fb, two, sizeof (two)) == 0);
+  CHECK (tfs_pread_ctx (a, fa, two, sizeof (two), 0) == sizeof (one));
+  CHECK (memcmp (one, two, sizeof (one)) == 0);
+  fillPattern (two, sizeof (two), 5);
+  CHECK (tfs_pread_ctx (b, fb, one, sizeof (one), 0) == sizeof (two));
+  CHECK (memcmp (one, two, sizeof (two)) == 0);
+  CHECK (tfs_sync_ctx (a, fa) == 0);
+  CHECK (tfs_syncfs_ctx (a) == 0);
+  CHECK (tfs_unmount_ctx (a) == 0);
+
+  /* the other disk is still there, and the first mounts again */
+  CHECK (tfs_pread_ctx (b, fb, one, sizeof (one), 0) == sizeof (two));
+  CHECK (memcmp (one, two, sizeof (two)) == 0);
+  fillPattern (one, sizeof (one), 4);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (fileHolds ("/same", one, sizeof (one)));
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_unmount_ctx (b) == 0);
+}
+
+/* writes CRASH_FILES files in a child that exits without unmounting
+ * under policy, then some more it never syncs; the first ones all
+ * come back and the rest leaves nothing broken */
+static void
+crashWith (int policy, int mode)
+{
+  char name[32], buf[600];
+  fileDescriptor fd;
+  pid_t pid;
+  int status, i;
+
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  pid = fork ();
+  if (pid == 0)
     {
-      if (tfs_writeFile (bFD, bfileContent, bfileSize) < 0)
+      if (tfs_mount (TEST_DISK) < 0
+	  || tfs_setDurability (policy, 5, 4) < 0
+	  || tfs_createDir ("/d") < 0)
+	_exit (1);
+      for (i = 0; i < CRASH_FILES; i++)
+	{
+	  sprintf (name, "/d/f%d", i);
+	  fillPattern (buf, 100 + i * 10, i);
+	  fd = tfs_openFile (name);
+	  if (fd < 0 || tfs_writeFile (fd, buf, 100 + i * 10) < 0)
+	    _exit (1);
+	  /* the default policy is only durable once synced */
+	  if (policy == TFS_DURABLE_NONE && tfs_sync (fd) < 0)
+	    _exit (1);
+	  tfs_closeFile (fd);
+	}
+      for (i = 0; i < CRASH_FILES; i++)
 	{
-	  perror ("tfs_writeFile failed");
+	  sprintf (name, "/e%d", i);
+	  fd = tfs_openFile (name);
+	  if (fd < 0 || tfs_writeFile (fd, buf, sizeof (buf)) < 0)
+	    _exit (1);
 	}
-      else
-	printf ("Successfully written to bfile\n");
+      if (policy == TFS_DURABLE_GROUP)
+	usleep (100 * 1000);
+      _exit (0);
     }
-  else
+  CHECK (waitpid (pid, &status, 0) == pid);
+  CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+  CHECK (tfs_mountMode (TEST_DISK, mode) == 0);
+  for (i = 0; i < CRASH_FILES; i++)
     {
-      printf ("\n*** reading bfile from TinyFS: \n%c", readBuffer);
-      while (tfs_readByte (bFD, &readBuffer) >= 0)
-	printf ("%c", readBuffer);
+      sprintf (name, "/d/f%d", i);
+      fillPattern (buf, 100 + i * 10, i);
+      CHECK (fileHolds (name, buf, 100 + i * 10));
+    }
+  CHECK (tfs_unmount () == 0);
+  /* what replay left behind passes a full check */
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (tfs_unmount () == 0);
+}
+
+static void
+testCrash (void)
+{
+  crashWith (TFS_DURABLE_NONE, TFS_MOUNT_QUICK);
+  crashWith (TFS_DURABLE_NONE, TFS_MOUNT_FULL);
+  crashWith (TFS_DURABLE_SYNC, TFS_MOUNT_QUICK);
+  crashWith (TFS_DURABLE_GROUP, TFS_MOUNT_FULL);
+
+  /* policies are checked before anything changes */
+  CHECK (tfs_setDurability (TFS_DURABLE_GROUP + 1, 5, 4) == ERR_DURABILITY);
+  CHECK (tfs_setDurability (TFS_DURABLE_GROUP, 0, 4) == ERR_DURABILITY);
+  CHECK (tfs_setDurability (TFS_DURABLE_NONE, 0, 0) == 0);
+}
 
-      tfs_deleteFile (bFD);
+/* blocks a file gave up must not hold another file's data before the
+ * delete is committed, a crash brings the deleted file back */
+static void
+testDeferredFree (void)
+{
+  char old[256 * 8], young[256 * 8];
+  pid_t pid;
+  int status;
+
+  fillPattern (old, sizeof (old), 1);
+  fillPattern (young, sizeof (young), 2);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  pid = fork ();
+  if (pid == 0)
+    {
+      fileDescriptor fd;
+      if (tfs_mount (TEST_DISK) < 0)
+	_exit (1);
+      fd = tfs_openFile ("/old");
+      if (fd < 0 || tfs_writeFile (fd, old, sizeof (old)) < 0
+	  || tfs_syncfs () < 0 || tfs_deleteFile (fd) < 0)
+	_exit (1);
+      /* data goes straight to disk, the delete only to the journal */
+      fd = tfs_openFile ("/young");
+      if (fd < 0 || tfs_writeFile (fd, young, sizeof (young)) < 0)
+	_exit (1);
+      _exit (0);
     }
+  CHECK (waitpid (pid, &status, 0) == pid);
+  CHECK (WIFEXITED (status) && WEXITSTATUS (status) == 0);
 
-/* Free both content buffers */
-  free (bfileContent);
-  free (afileContent);
-  if (tfs_unmount () < 0)
-    perror ("tfs_unmount failed");
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  CHECK (fileHolds ("/old", old, sizeof (old)));
+  CHECK (tfs_unmount () == 0);
+}
 
-  printf ("\nend of demo\n\n");
-  return 0;
+/* files deleted and rewritten over and over on a nearly full disk get
+ * their space back before the frees are checkpointed */
+static void
+testReclaim (void)
+{
+  int size = TEST_DISK_SIZE / 3, round;
+  char *buf = malloc (size);
+  fileDescriptor fd;
+
+  fillPattern (buf, size, 9);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  for (round = 0; round < 10; round++)
+    {
+      fd = tfs_openFile ("/a");
+      CHECK (tfs_writeFile (fd, buf, size) == 0);
+      CHECK (tfs_deleteFile (fd) == 0);
+      fd = tfs_openFile ("/b");
+      CHECK (tfs_writeFile (fd, buf, size) == 0);
+      CHECK (tfs_closeFile (fd) == 0);
+    }
+  CHECK (tfs_unmount () == 0);
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  CHECK (fileHolds ("/b", buf, size));
+  CHECK (tfs_unmount () == 0);
+  free (buf);
+}
+
+/* a damaged block fails its checksum on every mount until it is
+ * written again, and so does a block torn from its trailer */
+static void
+testChecksum (void)
+{
+  char buf[256 * 20], got[256 * 20], *image, *at, b;
+  fileDescriptor fd;
+  int raw, disk;
+
+  fillPattern (buf, sizeof (buf), 3);
+  unlink (TEST_DISK);
+  CHECK (tfs_mkfs (TEST_DISK, TEST_DISK_SIZE) == 0);
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/f");
+  CHECK (tfs_writeFile (fd, buf, sizeof (buf)) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  /* flip one bit in the file data */
+  raw = open (TEST_DISK, O_RDWR);
+  CHECK (raw >= 0);
+  image = malloc (TEST_DISK_SIZE * 2);
+  CHECK (pread (raw, image, TEST_DISK_SIZE * 2, 0) > 0);
+  at = memmem (image, TEST_DISK_SIZE * 2, buf + 256 * 10, 64);
+  CHECK (at != NULL);
+  if (at != NULL)
+    {
+      CHECK (pread (raw, &b, 1, at - image + 10) == 1);
+      b ^= 1;
+      CHECK (pwrite (raw, &b, 1, at - image + 10) == 1);
+    }
+  close (raw);
+  free (image);
+
+  CHECK (tfs_mount (TEST_DISK) == 0);
+  fd = tfs_openFile ("/f");
+  CHECK (tfs_pread (fd, got, sizeof (got), 0) == ERR_CHECKSUM);
+  CHECK (tfs_unmount () == 0);
+
+  /* a full mount doesn't take the damage for data */
+  CHECK (tfs_mountMode (TEST_DISK, TFS_MOUNT_FULL) == 0);
+  fd = tfs_openFile ("/f");
+  CHECK (tfs_pread (fd, got, sizeof (got), 0) == ERR_CHECKSUM);
+  /* writing the blocks again seals them */
+  CHECK (tfs_pwrite (fd, buf, sizeof (buf), 0) == sizeof (buf));
+  CHECK (tfs_pread (fd, got, sizeof (got), 0) == sizeof (buf));
+  CHECK (memcmp (got, buf, sizeof (buf)) == 0);
+  CHECK (tfs_unmount () == 0);
+
+  /* a block never written reads as zeros, one whose data landed
+   * without its trailer fails */
+  unlink (TEST_DISK);
+  disk = openDisk (TEST_DISK, 256 * 16);
+  CHECK (disk >= 0);
+  CHECK (writeBlock (disk, 15, buf) == 0);
+  CHECK (readBlock (disk, 3, got) == 0);
+  memset (buf, 0, 256);
+  CHECK (memcmp (got, buf, 256) == 0);
+  raw = open (TEST_DISK, O_RDWR);
+  CHECK (pwrite (raw, "torn", 4, (256 + 4) * 4 + 100) == 4);
+  close (raw);
+  CHECK (readBlock (disk, 4, got) == ERR_CHECKSUM);
+  CHECK (closeDisk (disk) == 0);
+}
+
+/* both kernels give the standard CRC32C, whole or in pieces */
+static void
+testCrcKernels (void)
+{
+  char buf[1000];
+  unsigned int whole;
+  int kernel;
+
+  fillPattern (buf, sizeof (buf), 6);
+  for (kernel = DISK_CRC_HARDWARE; kernel <= DISK_CRC_SLICING; kernel++)
+    {
+      if (setDiskCrc (kernel) < 0)
+	continue;
+      CHECK (crc32c (0, "123456789", 9) == 0xe3069283);
+      whole = crc32c (0, buf, sizeof (buf));
+      CHECK (crc32c (crc32c (0, buf, 333), buf + 333, 667) == whole);
+      CHECK (crc32c (crc32c (0, buf + 1, 0), buf, 1000) == whole);
+    }
+  CHECK (setDiskCrc (DISK_CRC_SLICING + 1) == ERR_NO_BACKEND);
+  CHECK (setDiskCrc (DISK_CRC_AUTO) == 0);
+}
+
+int
+main ()
+{
+  printf ("] disk\n");
+  testDisk ();
+  printf ("] cache\n");
+  testCache ();
+  printf ("] files\n");
+  testFiles ();
+
+  printf ("] read\n");
+  testRead ();
+  printf ("] open files\n");
+  testOpenFile ();
+  printf ("] descriptors\n");
+  testDescriptors ();
+  printf ("] dentries\n");
+  testDentries ();
+  printf ("] directory scan\n");
+  testDirScan ();
+  printf ("] allocator\n");
+  testAllocator ();
+  printf ("] quick mount\n");
+  testQuickMount ();
+  printf ("] wide blocks\n");
+  testWideBlocks ();
+  printf ("] block sizes\n");
+  testBlockSizes ();
+  printf ("] extents\n");
+  testExtents ();
+  printf ("] partial writes\n");
+  testPartialWrites ();
+  printf ("] pread\n");
+  testPread ();
+  printf ("] vectored\n");
+  testVectored ();
+  printf ("] async\n");
+  testAsync ();
+  printf ("] read-ahead\n");
+  testReadAhead ();
+  printf ("] inline data\n");
+  testInline ();
+  printf ("] big directory\n");
+  testBigDirectory ();
+  printf ("] threads\n");
+  testThreads ();
+  printf ("] contexts\n");
+  testContexts ();
+  printf ("] crash\n");
+  testCrash ();
+  printf ("] deferred free\n");
+  testDeferredFree ();
+  printf ("] reclaim\n");
+  testReclaim ();
+  printf ("] checksums\n");
+  testChecksum ();
+  testCrcKernels ();
+
+  unlink (TEST_DISK);
+  unlink (TEST_DISK2);
+  printf ("] %d failures\n", failures);
+  return failures;
 }